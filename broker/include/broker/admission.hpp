@@ -0,0 +1,65 @@
+#ifndef BROKER_ADMISSION_HPP
+#define BROKER_ADMISSION_HPP
+
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+
+#include "queue.hpp"
+
+
+namespace broker {
+	struct admission_options {
+		// Submissions per second and burst size per user and per contest; a rate of zero disables the limit
+		double user_rate = 0;
+		double user_burst = 10;
+		double contest_rate = 0;
+		double contest_burst = 1000;
+		// A class is turned away once this many submissions are queued in total, so low classes give way first
+		std::array<size_t, n_priority_classes> max_queued = {SIZE_MAX, SIZE_MAX, SIZE_MAX};
+		// What a submission turned away because of the queue length is told
+		std::chrono::milliseconds overload_retry_after{5000};
+	};
+
+
+	// Decides whether a submission is let into the queue, so that a flood of submissions is pushed back to the front-ends
+	// instead of piling up in the broker. Every user and every contest has a token bucket; a submission takes a token
+	// from both, and is turned away with the time until both have one again if either is empty. Buckets that have
+	// filled up are forgotten now and then, so idle users cost nothing.
+	class admission_control {
+		using clock = std::chrono::steady_clock;
+
+		struct bucket {
+			double tokens;
+			clock::time_point updated;
+		};
+
+		admission_options options;
+		std::unordered_map<uint64_t, bucket> users;
+		std::unordered_map<uint64_t, bucket> contests;
+		size_t n_buckets_after_prune = 0;
+		uint64_t rejected = 0;
+
+		// Refills the bucket; returns how long it takes to have a token
+		static clock::duration wait_for_token(bucket& b, double rate, double burst, clock::time_point now);
+		void prune(clock::time_point now);
+
+	public:
+		explicit admission_control(admission_options options = {});
+
+		// Id zero stands for no user or no contest. Returns nullopt if the submission is admitted, and when to try again
+		// otherwise.
+		std::optional<std::chrono::milliseconds> admit(uint64_t user_id, uint64_t contest_id, priority_class priority, size_t n_queued);
+
+		uint64_t n_rejected() const {
+			return rejected;
+		}
+	};
+}
+
+
+#endif
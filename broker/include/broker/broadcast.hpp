@@ -0,0 +1,47 @@
+#ifndef BROKER_BROADCAST_HPP
+#define BROKER_BROADCAST_HPP
+
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "common/async.hpp"
+#include "registry/protocol.hpp"
+
+
+namespace broker {
+	// Pushes test data to every invoker when it is announced, e.g. at the start of a contest, so that the registry does
+	// not have to send the same tests to all of them at once. Invokers are arranged into a forest: about log2(N) roots
+	// fetch from the registry, and every other invoker fetches from its parent, falling back to its grandparent and then
+	// to the registry. Each invoker serves at most fanout children.
+	class broadcaster {
+		using prefetch_fn = std::function<async::promise<bool>(std::vector<registry_key>, std::vector<std::string>)>;
+
+		struct member {
+			std::string address;
+			prefetch_fn prefetch;
+		};
+
+		size_t fanout;
+		// By id, i.e. in the order of registration, so that long-lived invokers stay near the roots
+		std::map<uint64_t, member> members;
+		uint64_t next_member_id = 0;
+		uint64_t next_broadcast_id = 0;
+
+	public:
+		explicit broadcaster(size_t fanout);
+
+		// address is where other invokers can fetch from this one
+		uint64_t add_member(std::string address, prefetch_fn prefetch);
+		void remove_member(uint64_t member_id);
+
+		void announce(std::vector<registry_key> keys);
+	};
+}
+
+
+#endif
@@ -0,0 +1,229 @@
+#ifndef BROKER_DISPATCH_HPP
+#define BROKER_DISPATCH_HPP
+
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <optional>
+#include <set>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "common/async.hpp"
+
+#include "journal.hpp"
+#include "locality.hpp"
+#include "protocol.hpp"
+#include "queue.hpp"
+
+
+namespace broker {
+	struct dispatcher_options {
+		queue_options queue;
+		size_t locality_candidates = 8;
+		// A job the invoker has not listed in a heartbeat for this long is handed out again
+		std::chrono::milliseconds lease{10000};
+		// An invoker that has sent no heartbeat for this long gets no more jobs, and its jobs are handed out again
+		std::chrono::milliseconds fence_after{5000};
+	};
+
+
+	// Hands queued submissions to invokers. Every invoker tells how many jobs it can run at once and in which languages;
+	// the broker counts free slots itself from then on, taking one when it sends a job and giving it back when the result
+	// arrives. A job goes to the invoker with the most free slots among those that support its language, ties broken by
+	// memory, which is O(log invokers) per language the invoker supports. Tests rather go to one of the locality_candidates
+	// invokers with the most free slots that reports having the problem's tests cached, if there is one; the order in which
+	// jobs are handed out does not depend on locality, so it cannot starve anything.
+	//
+	// A submission is compiled by one invoker, and then each of its tests becomes a job of its own, so the tests of one
+	// submission run on all invokers with free slots at once; they fetch the compiled program from the registry.
+	// Compilations and tests take slots of separate kinds, counted and indexed separately, so a burst of new submissions
+	// does not hold up the tests of those already compiled and the other way round. Tests are run highest priority class
+	// first, so that started work finishes quickly without making live submissions wait for a rejudge. There is a queue
+	// per language, so that submissions in a language no idle invoker supports do not hold up the rest.
+	//
+	// With a journal, submissions survive a restart of the broker. Those that had been handed to an invoker start over
+	// from compilation, since the invokers lose the connection anyway.
+	//
+	// An invoker can hang with its connection still open, so every job has a lease that runs out unless heartbeats of the
+	// invoker keep listing the job. A job whose lease has run out is taken to be lost: its slot is given back and it is
+	// handed out again before anything that was queued after it. An invoker that misses heartbeats altogether is fenced
+	// off as if it had disconnected. A heartbeat only updates the lease of each job it lists; expired leases are found by
+	// expire_leases(), which scans all running jobs about once a second, microseconds of work even with thousands of
+	// invokers.
+	//
+	// An invoker shared with other brokers lends this one only some of its slots, and changes how many with set_slots()
+	// as the backlogs of the brokers change.
+	class dispatcher {
+	public:
+		using compile_fn = std::function<async::promise<compilation_result>(compilation)>;
+		using run_test_fn = std::function<async::promise<invocation_result>(test_run)>;
+		// Gets nullopt if the submission is cancelled
+		using finish_fn = std::function<void(uint64_t, std::optional<submission_result>)>;
+
+		struct taken_submission {
+			queued_submission record;
+			finish_fn on_finish;
+		};
+
+	private:
+		using clock = std::chrono::steady_clock;
+
+		struct lease {
+			clock::time_point expiry;
+			// Tells the result of this dispatch of the job from a late one of an earlier dispatch to the same invoker
+			uint64_t dispatch_id;
+		};
+
+		struct invoker {
+			invoker_capacity capacity;
+			uint32_t free_slots;
+			uint32_t free_compile_slots;
+			compile_fn compile;
+			run_test_fn run_test;
+			problem_filter cached_problems;
+			// Submission id and test number
+			std::map<std::pair<uint64_t, uint32_t>, lease> running;
+			clock::time_point last_heartbeat;
+			uint32_t load = 0;
+			uint64_t available_memory = 0;
+			// Of the running jobs
+			uint32_t n_compiling = 0;
+		};
+
+		struct submission {
+			uint64_t language_id;
+			finish_fn on_finish;
+			// Set once the submission leaves the queue; kept to requeue it if its compilation is lost
+			std::optional<queued_submission> record;
+			uint64_t artifact_id = 0;
+			// Tests that are waiting or running and still matter for the verdict
+			std::set<uint32_t> outstanding;
+			std::vector<std::optional<invocation_result>> results;
+			std::optional<uint32_t> failed_test;
+		};
+
+		// Priority class, submission id, test number
+		using runnable_test = std::tuple<priority_class, uint64_t, uint32_t>;
+
+		struct language {
+			queue waiting;
+			std::set<runnable_test> runnable;
+
+			explicit language(const queue_options& options): waiting(options) {
+			}
+		};
+
+		// Free slots, memory, invoker id
+		using availability = std::tuple<uint32_t, uint64_t, uint64_t>;
+
+		dispatcher_options options;
+		std::unordered_map<uint64_t, language> languages;
+		std::unordered_map<uint64_t, submission> submissions;
+		std::map<uint64_t, invoker> invokers;
+		// Language id to the invokers supporting it that have a free run slot, and those that have a free compile slot
+		std::unordered_map<uint64_t, std::set<availability>> available;
+		std::unordered_map<uint64_t, std::set<availability>> compilers;
+		uint64_t next_submission_id = 1;
+		uint64_t next_invoker_id = 0;
+		uint64_t next_dispatch_id = 0;
+		uint64_t n_tests_dispatched = 0;
+		uint64_t locality_hits = 0;
+		uint64_t n_leases_expired = 0;
+		uint64_t n_invokers_fenced = 0;
+		uint64_t n_deadline_misses = 0;
+		uint64_t n_slots = 0;
+		uint64_t n_free_slots = 0;
+		// Fraction of the run slots that tests of rejudges are not given
+		double rejudge_headroom = 0;
+		// Taken by take_waiting() and not released yet; compaction keeps them in the journal as waiting, so that a
+		// restarted broker judges them if nobody else took them over
+		std::unordered_map<uint64_t, queued_submission> unreleased;
+		journal* log = nullptr;
+
+		language& language_for(uint64_t language_id);
+		static void reindex(std::unordered_map<uint64_t, std::set<availability>>& index, uint64_t invoker_id, const invoker& inv, uint32_t& current, uint32_t free_slots);
+		void set_free_slots(uint64_t invoker_id, invoker& inv, uint32_t free_slots);
+		void set_free_compile_slots(uint64_t invoker_id, invoker& inv, uint32_t free_slots);
+		// Counts free run slots from the tests the invoker is running, so that after set_slots() lowered the slots,
+		// finished tests free none until the invoker is under the new limit
+		void recount_free_slots(uint64_t invoker_id, invoker& inv);
+		std::optional<uint64_t> pick_compiler(uint64_t language_id) const;
+		// Returns the invoker and whether it has the tests
+		std::optional<std::pair<uint64_t, bool>> pick_for_tests(uint64_t language_id, uint64_t problem_id) const;
+		// Puts a job that was lost back in line; false if it does not matter anymore
+		bool requeue_job(uint64_t submission_id, uint32_t test);
+		void pump();
+		void compile(uint64_t invoker_id, queued_submission next);
+		void run_test(uint64_t invoker_id, uint64_t submission_id, uint32_t test);
+		// Frees the slot; returns the submission if the job still matters
+		submission* finish_job(uint64_t invoker_id, uint64_t dispatch_id, uint64_t submission_id, uint32_t test);
+		void compiled(uint64_t submission_id, compilation_result result);
+		void tested(uint64_t submission_id, uint32_t test, invocation_result result);
+		void finish(uint64_t submission_id, submission_result result);
+		void maybe_compact();
+
+	public:
+		explicit dispatcher(dispatcher_options options = {});
+
+		uint64_t add_invoker(invoker_capacity capacity, compile_fn compile, run_test_fn run_test);
+		// Jobs the invoker was running are handed out again
+		void remove_invoker(uint64_t invoker_id);
+		void set_cached_problems(uint64_t invoker_id, problem_filter cached_problems);
+		// nullopt if the invoker is not known, e.g. because it has been fenced off
+		std::optional<heartbeat_reply> heartbeat(uint64_t invoker_id, const invoker_heartbeat& status);
+		// Free run slots are recounted from the tests the invoker is running
+		void set_slots(uint64_t invoker_id, uint32_t slots);
+		// Hands out again the jobs whose leases have run out and fences off invokers that stopped sending heartbeats
+		void expire_leases();
+
+		// Restores the submissions in the journal and records all changes there from then on. Must be called before
+		// anything is submitted.
+		void recover(journal& log);
+
+		uint64_t submit(pending_addition_submission pending, finish_fn on_finish);
+		// An id for a submission that is answered without being judged, so that it does not clash with judged ones
+		uint64_t reserve_submission_id() {
+			return next_submission_id++;
+		}
+		// For submissions recovered from the journal, or to get the verdict over another connection; false if the
+		// submission is not known or already finished
+		bool watch(uint64_t submission_id, finish_fn on_finish);
+		// Both fail once the submission has left the queue
+		bool cancel(uint64_t submission_id);
+		bool reprioritize(uint64_t submission_id, priority_class priority);
+		// Empties the queues, in the order the submissions would have been handed out, so that they can be judged
+		// elsewhere. They stay in the journal until release() is called for them, so that they are not lost if the broker
+		// goes down before another one has taken them.
+		std::vector<taken_submission> take_waiting();
+		void release(uint64_t submission_id);
+
+		// Submissions waiting to be compiled, over all languages
+		size_t n_queued() const;
+		// Submissions and tests waiting for a free slot
+		uint64_t backlog() const;
+		// Run slots over all invokers
+		uint64_t total_slots() const {
+			return n_slots;
+		}
+		uint64_t free_slots() const {
+			return n_free_slots;
+		}
+		// Tests of rejudge-class submissions are only handed out while more run slots than this are free, so that
+		// live submissions that compile in the meantime find slots for their tests
+		void set_rejudge_headroom(double headroom) {
+			rejudge_headroom = headroom;
+		}
+		uint64_t reserved_slots() const;
+		broker_stats stats() const;
+	};
+}
+
+
+#endif
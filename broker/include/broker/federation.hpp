@@ -0,0 +1,100 @@
+#ifndef BROKER_FEDERATION_HPP
+#define BROKER_FEDERATION_HPP
+
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common/hash_ring.hpp"
+#include "rpc/client.hpp"
+
+#include "dispatch.hpp"
+#include "protocol.hpp"
+
+
+namespace uvw {
+	class TimerHandle;
+}
+
+
+namespace broker {
+	// Several brokers split the submissions between them by problem, by consistent hashing over their frontend
+	// addresses, while invokers serve all of them. Every broker and front-end builds the same ring from the same list of
+	// brokers; a submission sent to the wrong broker is redirected rather than forwarded, so that the front-end learns
+	// where to send the rest.
+	//
+	// A drained broker leaves the ring and tells the others to drop it too. It redirects new submissions, hands those
+	// waiting in its queue to their new owners, relaying the verdicts under the old ids, and judges the ones it has
+	// started. Brokers listed as draining in the config are left out of the ring from the start, which is how a drain is
+	// made to outlive restarts. A handed off submission that its new owner has not taken by hand_off_timeout is taken
+	// back and judged here. Once the new owner has taken it, its verdict is relayed from there; calls in flight when a
+	// connection drops are never answered, so the submission is watched again whenever the connection is made again.
+	class federation {
+		class client_impl: public rpc::simplex_impl<client_impl, rpc::EmptyProtocol> {
+		};
+		using broker_client = rpc::client<broker_frontend_protocol, client_impl>;
+
+		// Lives until the new owner has taken the submission or it is taken back
+		struct pending_hand_off {
+			std::shared_ptr<uvw::TimerHandle> deadline;
+			bool is_taken_back = false;
+		};
+
+		// Where a submission that was taken over is judged
+		struct new_owner {
+			std::string address;
+			uint64_t submission_id;
+		};
+
+		dispatcher& judge;
+		std::string self;
+		std::chrono::milliseconds hand_off_timeout;
+		// Brokers that take submissions, in the order of the config
+		std::vector<std::string> members;
+		hash_ring ring;
+		std::map<std::string, std::unique_ptr<broker_client>> peers;
+		// Watchers of submissions handed to another broker, by the id this broker gave them
+		std::unordered_map<uint64_t, dispatcher::finish_fn> handed_off;
+		// Of the handed off submissions the new owner has taken
+		std::unordered_map<uint64_t, new_owner> taken_over;
+		uint64_t redirected = 0;
+		uint64_t n_handed_off_total = 0;
+
+		broker_client& peer(const std::string& address);
+		void hand_off(uint64_t submission_id, submission_request request, const std::string& address, std::shared_ptr<pending_hand_off> pending);
+		void judge_here(uint64_t submission_id, const submission_request& request);
+		// Relays the verdict from the new owner
+		void relay(uint64_t submission_id);
+		void finished(uint64_t submission_id, std::optional<submission_result> result);
+
+	public:
+		// self is the frontend address of this broker as it appears in brokers
+		federation(dispatcher& judge, std::vector<std::string> brokers, const std::vector<std::string>& draining, std::string self, std::chrono::milliseconds hand_off_timeout);
+
+		void stop();
+
+		// The frontend address of the broker that owns the submission, or nullopt if this one does
+		std::optional<std::string> redirect(const submission_request& request);
+		void remove(const std::string& address);
+		// nullopt if no other broker is left to take the submissions
+		std::optional<uint64_t> drain();
+		// For submissions that were handed off; false if the submission is not known
+		bool watch(uint64_t submission_id, dispatcher::finish_fn on_finish);
+
+		uint64_t n_redirected() const {
+			return redirected;
+		}
+		uint64_t n_handed_off() const {
+			return n_handed_off_total;
+		}
+	};
+}
+
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef BROKER_JOURNAL_HPP
+#define BROKER_JOURNAL_HPP
+
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <vector>
+
+#include "invoker/protocol.hpp"
+
+#include "queue.hpp"
+
+
+namespace broker {
+	enum class journal_record_type: uint32_t {
+		// argument is the sequence number; followed by the fixed fields and the source
+		add = 1,
+		dispatch = 2,
+		// argument is the new priority class
+		reprioritize = 3,
+		// argument is the verdict
+		finish = 4,
+		cancel = 5,
+		// Written first by compaction so that ids of finished submissions are not reused; id is the next id
+		watermark = 6,
+		// Follows add; argument is the deadline in milliseconds since the epoch. Without it, the submission gets the
+		// default deadline of its class again when it is recovered.
+		deadline = 7
+	};
+
+
+	struct recovered_state {
+		// In the order of their sequence numbers within each language
+		std::vector<queued_submission> submissions;
+		// How many of them had been handed to an invoker
+		size_t n_dispatched;
+		uint64_t next_submission_id;
+	};
+
+
+	// Append-only log of what happens to submissions, so that a restarted broker knows which ones are still waiting for a
+	// verdict. Every record is a single write, so a broker that crashes loses nothing; records are synced to disk only by
+	// sync(), so a machine that crashes loses what was written before the last call. Once the file has grown to twice its
+	// size after the last compaction, compact() rewrites it as a snapshot of the live submissions. Syncing and writing the
+	// snapshot run on the libuv thread pool, one at a time; a sync asked for meanwhile starts when the other finishes.
+	class journal {
+	public:
+		using entry_fn = std::function<void(uint64_t id, uint64_t sequence, const pending_addition_submission& submission, bool is_dispatched)>;
+
+	private:
+		std::filesystem::path path;
+		int fd = -1;
+		uint64_t size = 0;
+		uint64_t compacted_size = 0;
+		uint64_t min_compaction_size;
+		bool is_dirty = false;
+		// Set after compaction until the rename has been synced
+		bool is_directory_dirty = false;
+		bool is_busy = false;
+		bool is_sync_requested = false;
+
+		struct snapshot_entry {
+			uint64_t id;
+			uint64_t sequence;
+			pending_addition_submission submission;
+			bool is_dispatched;
+		};
+		// Records appended while compaction is writing the snapshot, to be copied after it
+		std::optional<std::vector<std::byte>> tail;
+
+		std::vector<std::byte> buffer;
+
+		void write(const std::vector<std::byte>& records);
+		void append(journal_record_type type, uint64_t id, uint64_t argument);
+		void run_in_background(std::function<void()> task, std::function<void()> on_done);
+
+	public:
+		journal(std::filesystem::path path, uint64_t min_compaction_size);
+		journal(const journal&) = delete;
+		journal& operator=(const journal&) = delete;
+		~journal();
+
+		// Must be called before anything is appended
+		recovered_state replay();
+
+		void add(uint64_t id, uint64_t sequence, const pending_addition_submission& submission);
+		void dispatch(uint64_t id);
+		void reprioritize(uint64_t id, priority_class priority);
+		void finish(uint64_t id, verdict status);
+		void cancel(uint64_t id);
+		void sync();
+
+		// False while compaction or a sync is running
+		bool needs_compaction() const;
+		// list_live must call its argument for every submission that has no verdict yet. Errors are logged rather than
+		// thrown, as they come after compact() has returned.
+		void compact(uint64_t next_submission_id, const std::function<void(const entry_fn&)>& list_live);
+	};
+}
+
+
+#endif
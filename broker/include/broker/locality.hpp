@@ -0,0 +1,64 @@
+#ifndef BROKER_LOCALITY_HPP
+#define BROKER_LOCALITY_HPP
+
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+
+namespace broker {
+	// A Bloom filter of the problems whose tests an invoker has cached. 4096 bits and four probes keep false positives
+	// under 1% for the few hundred problems an invoker cache holds, in half a kilobyte per report.
+	class problem_filter {
+		std::vector<uint64_t> words;
+
+		static uint64_t mix(uint64_t x) {
+			x += 0x9e3779b97f4a7c15;
+			x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+			x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+			return x ^ (x >> 31);
+		}
+
+	public:
+		static constexpr size_t n_bits = 4096;
+		static constexpr size_t n_probes = 4;
+
+		problem_filter(): words(n_bits / 64) {
+		}
+
+		// Filters of another size are treated as empty
+		explicit problem_filter(std::vector<uint64_t> data): words(std::move(data)) {
+			if(words.size() != n_bits / 64) {
+				words.assign(n_bits / 64, 0);
+			}
+		}
+
+		void insert(uint64_t problem_id) {
+			uint64_t h = mix(problem_id);
+			for(size_t i = 0; i < n_probes; i++) {
+				size_t bit = (h >> (i * 12)) % n_bits;
+				words[bit / 64] |= uint64_t{1} << (bit % 64);
+			}
+		}
+
+		bool might_contain(uint64_t problem_id) const {
+			uint64_t h = mix(problem_id);
+			for(size_t i = 0; i < n_probes; i++) {
+				size_t bit = (h >> (i * 12)) % n_bits;
+				if(!(words[bit / 64] >> (bit % 64) & 1)) {
+					return false;
+				}
+			}
+			return true;
+		}
+
+		const std::vector<uint64_t>& data() const {
+			return words;
+		}
+	};
+}
+
+
+#endif
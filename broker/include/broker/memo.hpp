@@ -0,0 +1,64 @@
+#ifndef BROKER_MEMO_HPP
+#define BROKER_MEMO_HPP
+
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common/async.hpp"
+#include "common/registry.hpp"
+#include "common/sha256.hpp"
+
+#include "protocol.hpp"
+
+
+namespace broker {
+	struct memo_options {
+		// Language id to the compiler version and flags invokers use for it; only languages listed here are memoized, and
+		// changing an entry invalidates what was remembered for the language
+		std::unordered_map<uint64_t, std::string> toolchains;
+		// Verdicts that are not reproducible enough to reuse; judge_error is never reused
+		std::vector<verdict> uncached_verdicts;
+		// Results with a test that took at least this much of the time limit, in thousandths, are judged again, since
+		// the verdict could go either way on a rerun
+		uint32_t max_time_usage = 800;
+		// A lookup that takes longer than this counts as a miss, so that a registry outage does not hold up submissions
+		std::chrono::milliseconds lookup_timeout{200};
+	};
+
+
+	// Reuses the verdicts of submissions that have been judged before. The key is a SHA-256 of the source, the language's
+	// toolchain, the problem, its test set version and the options that affect the verdict; the result is stored in the
+	// registry under data_class "verdict" and an id made of the first eight bytes of the key, together with the full key
+	// to rule out collisions.
+	class verdict_memo {
+		registry& store;
+		memo_options options;
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+
+	public:
+		verdict_memo(registry& store, memo_options options);
+
+		// nullopt if the submission cannot be memoized, e.g. because its test set version is not known
+		std::optional<sha256::digest> key_for(const submission_request& request) const;
+		async::promise<std::optional<submission_result>> lookup(const sha256::digest& key);
+		// Stores the result if the policy allows reusing it
+		void remember(const sha256::digest& key, const submission_result& result);
+
+		uint64_t n_hits() const {
+			return hits;
+		}
+		uint64_t n_misses() const {
+			return misses;
+		}
+	};
+}
+
+
+#endif
@@ -0,0 +1,218 @@
+#ifndef BROKER_PROTOCOL_HPP
+#define BROKER_PROTOCOL_HPP
+
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "invoker/protocol.hpp"
+#include "registry/protocol.hpp"
+#include "rpc/buffer.hpp"
+#include "rpc/reflection.hpp"
+
+
+// slots is the number of tests the invoker runs at once in isolation, free_slots how many of them are idle right now.
+// Compiling needs no isolation and does not disturb the timing of tests much, so it has slots of its own. An invoker
+// serving several brokers counts only the run slots it lends this one, and offers all compile slots to each.
+struct invoker_capacity {
+	uint32_t cores;
+	uint64_t memory;
+	std::vector<uint64_t> language_ids;
+	uint32_t slots;
+	uint32_t free_slots;
+	uint32_t compile_slots;
+	uint32_t free_compile_slots;
+};
+RPC_DEFINE_STRUCT(invoker_capacity, cores, memory, language_ids, slots, free_slots, compile_slots, free_compile_slots)
+
+
+// A job is identified by the submission id and the test number, which is compilation_job for the compilation
+inline constexpr uint32_t compilation_job = UINT32_MAX;
+
+
+// Sent every second or so. Jobs that are not listed lose their lease once it runs out, so an invoker that has lost a job
+// without reporting a result gets it taken away. load is the 1-minute load average of the machine times 1000.
+struct invoker_heartbeat {
+	std::vector<std::pair<uint64_t, uint32_t>> jobs;
+	uint32_t load;
+	uint64_t available_memory;
+};
+RPC_DEFINE_STRUCT(invoker_heartbeat, jobs, load, available_memory)
+
+
+// backlog is how many submissions and tests wait for a free slot at the broker, n_running how many tests of this invoker
+// it counts as running. An invoker serving several brokers lends its slots to those with a backlog.
+struct heartbeat_reply {
+	uint64_t backlog;
+	uint32_t n_running;
+};
+RPC_DEFINE_STRUCT(heartbeat_reply, backlog, n_running)
+
+
+RPC_PROTOCOL(broker_protocol,
+	// The address other invokers can fetch test data from this invoker at
+	void RPC_METHOD(register_peer)(std::string address);
+	// Makes the invoker eligible for submissions; the broker keeps track of free slots from then on
+	void RPC_METHOD(register_invoker)(invoker_capacity capacity);
+	// The words of a broker::problem_filter of the problems whose tests the invoker has cached; sent when it changes
+	void RPC_METHOD(report_cached_problems)(std::vector<uint64_t> filter);
+	// Extends the leases of the jobs the invoker is working on. Resolves to nullopt if the invoker is not registered,
+	// e.g. because it was fenced off after missing heartbeats, and has to register again to get jobs; results of the jobs
+	// it had are ignored.
+	std::optional<heartbeat_reply> RPC_METHOD(heartbeat)(invoker_heartbeat status);
+	// Changes how many tests the broker may give the invoker at once; tests already running over the new limit are let
+	// finish
+	void RPC_METHOD(set_slots)(uint32_t slots);
+)
+
+
+// priority is 0 for live contests, 1 for practice and 2 for rejudges. With stops_at_first_failure, tests after the first
+// failed one are not run. user_id and contest_id are what submissions are rate-limited by, zero for none.
+// test_set_version must change whenever the tests of the problem do; verdicts of earlier submissions with the same source
+// and test set are reused unless it is zero. deadline is when the verdict should be known, in milliseconds since the
+// epoch, or zero for the default of the class; submissions of a class are judged earliest deadline first.
+struct submission_request {
+	uint64_t problem_id;
+	uint64_t language_id;
+	rpc::blob source;
+	uint8_t priority;
+	uint32_t n_tests;
+	bool stops_at_first_failure;
+	uint64_t user_id;
+	uint64_t contest_id;
+	uint64_t test_set_version;
+	uint64_t deadline;
+};
+RPC_DEFINE_STRUCT(submission_request, problem_id, language_id, source, priority, n_tests, stops_at_first_failure, user_id, contest_id, test_set_version, deadline)
+
+
+// status is that of the first failed test, or of the compilation if it failed. tests has the verdict of every test,
+// nullopt for those that were not run. max_time_usage is the highest time_usage of the tests that were run.
+struct submission_result {
+	verdict status;
+	std::string message;
+	std::optional<uint32_t> failed_test;
+	std::vector<std::optional<verdict>> tests;
+	uint32_t max_time_usage;
+};
+RPC_DEFINE_STRUCT(submission_result, status, message, failed_test, tests, max_time_usage)
+
+
+// A submission that was not admitted yields a single event with submission_id zero and retry_after_ms set to how long
+// the front-end should wait before submitting it again. One that belongs to another broker of the federation yields a
+// single event with submission_id zero and the frontend address of that broker in redirect.
+struct submission_event {
+	uint64_t submission_id;
+	std::optional<submission_result> result;
+	std::optional<uint32_t> retry_after_ms;
+	std::optional<std::string> redirect;
+};
+RPC_DEFINE_STRUCT(submission_event, submission_id, result, retry_after_ms, redirect)
+
+
+// locality_hits counts the tests sent to an invoker that already had the tests of the problem. load and
+// available_memory are the sums of what the invokers last reported in heartbeats. memo_hits counts submissions answered
+// with the verdict of an identical earlier one. n_deadline_misses counts verdicts that came after the submission's
+// deadline, n_aged submissions that moved up a class because they were overdue. n_redirected counts submissions that
+// belonged to another broker of the federation, n_handed_off those passed on to another broker when this one drained.
+struct broker_stats {
+	uint64_t n_invokers;
+	uint64_t n_queued;
+	uint64_t n_tests_dispatched;
+	uint64_t locality_hits;
+	uint64_t n_leases_expired;
+	uint64_t n_invokers_fenced;
+	uint64_t load;
+	uint64_t available_memory;
+	uint64_t n_rejected;
+	uint64_t memo_hits;
+	uint64_t memo_misses;
+	uint64_t n_deadline_misses;
+	uint64_t n_aged;
+	uint64_t n_redirected;
+	uint64_t n_handed_off;
+};
+RPC_DEFINE_STRUCT(broker_stats, n_invokers, n_queued, n_tests_dispatched, locality_hits, n_leases_expired, n_invokers_fenced, load, available_memory, n_rejected, memo_hits, memo_misses, n_deadline_misses, n_aged, n_redirected, n_handed_off)
+
+
+// Submissions of a problem whose verdicts may have changed, e.g. because its tests were fixed. The front-end looks them
+// up and feeds them to the broker in batches; the broker only checks that they match.
+struct rejudge_query {
+	uint64_t problem_id;
+	uint64_t first_submission_id;
+	uint64_t last_submission_id;
+};
+RPC_DEFINE_STRUCT(rejudge_query, problem_id, first_submission_id, last_submission_id)
+
+
+// submission_id is the id the front-end knows the submission by; results are reported under it
+struct rejudge_item {
+	uint64_t submission_id;
+	submission_request request;
+};
+RPC_DEFINE_STRUCT(rejudge_item, submission_id, request)
+
+
+struct rejudge_event {
+	uint64_t submission_id;
+	submission_result result;
+};
+RPC_DEFINE_STRUCT(rejudge_event, submission_id, result)
+
+
+// n_waiting have been fed but not handed to the dispatcher yet; the front-end should feed more before they run out.
+// n_finished_last_minute is the throughput.
+struct rejudge_progress {
+	rejudge_query query;
+	uint64_t n_fed;
+	uint64_t n_waiting;
+	uint64_t n_running;
+	uint64_t n_finished;
+	uint64_t n_finished_last_minute;
+	bool is_paused;
+	bool is_complete;
+};
+RPC_DEFINE_STRUCT(rejudge_progress, query, n_fed, n_waiting, n_running, n_finished, n_finished_last_minute, is_paused, is_complete)
+
+
+// Spoken by whatever feeds submissions to the broker, e.g. the contest system
+RPC_PROTOCOL(broker_frontend_protocol,
+	// Yields an event with the id of the submission right away and one with the result once it is judged. A cancelled
+	// submission yields no result. When the broker is overloaded, the submission is turned away with a retry_after_ms
+	// event instead.
+	rpc::stream<submission_event> RPC_METHOD(submit)(submission_request request);
+	// Yields the result of a submission that is not finished yet, e.g. one submitted before the broker restarted, and
+	// nothing if it is not known
+	rpc::stream<submission_event> RPC_METHOD(watch)(uint64_t submission_id);
+	// Only submissions that have not been handed to an invoker yet can be cancelled or reprioritized
+	bool RPC_METHOD(cancel)(uint64_t submission_id);
+	bool RPC_METHOD(reprioritize)(uint64_t submission_id, uint8_t priority);
+	// Pushes the tests of a problem set to every invoker, e.g. when a contest opens
+	void RPC_METHOD(announce_test_data)(std::vector<registry_key> keys);
+	broker_stats RPC_METHOD(stats)();
+	// Takes the broker out of its federation: new submissions are redirected, and those waiting in the queue are handed to
+	// the brokers that own them now, whose verdicts are reported under the old ids. Submissions that have started are
+	// judged here. Resolves to the number of submissions handed off, or nullopt if there is no broker to hand them to.
+	std::optional<uint64_t> RPC_METHOD(drain)();
+	// Sent by a draining broker to the rest of the federation, so that they stop redirecting submissions to it
+	void RPC_METHOD(remove_broker)(std::string address);
+
+	// Rejudges run in a lane of their own that only takes capacity live submissions leave idle. start_rejudge returns the
+	// id of the rejudge.
+	uint64_t RPC_METHOD(start_rejudge)(rejudge_query query);
+	// Submissions that do not match the query are ignored; is_last tells that no more follow
+	bool RPC_METHOD(feed_rejudge)(uint64_t rejudge_id, std::vector<rejudge_item> items, bool is_last);
+	// Running submissions are let finish
+	bool RPC_METHOD(pause_rejudge)(uint64_t rejudge_id, bool is_paused);
+	std::optional<rejudge_progress> RPC_METHOD(rejudge_status)(uint64_t rejudge_id);
+	// Yields the result of every submission of the rejudge that finishes from now on, and ends once the rejudge is
+	// complete
+	rpc::stream<rejudge_event> RPC_METHOD(watch_rejudge)(uint64_t rejudge_id);
+)
+
+
+#endif
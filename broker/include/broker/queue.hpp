@@ -0,0 +1,142 @@
+#ifndef BROKER_QUEUE_HPP
+#define BROKER_QUEUE_HPP
+
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include "rpc/buffer.hpp"
+
+
+namespace broker {
+	enum class priority_class: uint8_t {
+		live = 0,
+		practice = 1,
+		rejudge = 2
+	};
+
+	constexpr size_t n_priority_classes = 3;
+
+
+	struct queue_options {
+		std::array<uint32_t, n_priority_classes> weights = {16, 4, 1};
+		// The deadline of a submission that does not have one, counted from when it is added
+		std::array<std::chrono::milliseconds, n_priority_classes> default_deadline = {std::chrono::minutes{1}, std::chrono::minutes{10}, std::chrono::hours{1}};
+		// A submission this late moves up a class; milliseconds::max() turns aging off for the class. The top class has
+		// nowhere to go, and rejudges never age, so that they do not compete with live judging.
+		std::array<std::chrono::milliseconds, n_priority_classes> aging_after = {std::chrono::milliseconds::max(), std::chrono::minutes{10}, std::chrono::milliseconds::max()};
+	};
+
+
+	struct pending_addition_submission {
+		uint64_t problem_id;
+		uint64_t language_id;
+		// Shared rather than copied when the submission is sent to an invoker, and mapped straight from the journal when it
+		// is recovered
+		rpc::blob source;
+		priority_class priority = priority_class::live;
+		uint32_t n_tests = 0;
+		bool stops_at_first_failure = false;
+		// A soft one: it only decides the order. Set by the queue if it is missing.
+		std::optional<std::chrono::system_clock::time_point> deadline;
+	};
+
+
+	struct queued_submission {
+		uint64_t id;
+		uint64_t sequence;
+		pending_addition_submission submission;
+	};
+
+
+	// Where a submission stands: its class and its sequence number. Sequence numbers only grow, so submissions of the same
+	// class with the same deadline are served in the order of their sequence numbers.
+	struct queue_position {
+		priority_class priority;
+		uint64_t sequence;
+	};
+
+
+	// Submissions waiting for an invoker. Classes share the invokers by weight using stride scheduling: every class has a
+	// pass value that grows by 1/weight each time it is served, and the non-empty class with the lowest pass goes next,
+	// so with weights 16:4:1 a flood of rejudges still gets a twentieth of the dequeues and never delays live submissions
+	// by more than that. Within a class the submission with the earliest deadline goes first; those without one get a
+	// default deadline per class, so they are served first come, first served among themselves. A class that gets too
+	// small a share to keep up with its deadlines ages: a submission that is overdue by aging_after is moved up a class.
+	// Rejudges are the exception and wait however long it takes, since they must never compete with live judging.
+	// There it is due by the default deadline of that class, counted from the move, so it rises one class per aging_after
+	// at most and does not jump ahead of the submissions of its new class that are overdue already. The most overdue
+	// submission of a class is the one at its head, so aging costs one look at each head per dequeue.
+	//
+	// Insertion, dequeue, cancellation and reprioritization are O(log n); locating a submission by id is O(1).
+	class queue {
+		struct entry {
+			pending_addition_submission submission;
+			uint64_t sequence;
+			// What the submission is ordered by: its deadline, or a later one once it has aged
+			std::chrono::system_clock::time_point due;
+		};
+
+		// Due time in milliseconds since the epoch and sequence number
+		using order_key = std::pair<int64_t, uint64_t>;
+
+		struct lane {
+			// To submission id
+			std::map<order_key, uint64_t> order;
+			uint64_t stride;
+			uint64_t pass = 0;
+		};
+
+		queue_options options;
+		std::unordered_map<uint64_t, entry> entries;
+		std::array<lane, n_priority_classes> lanes;
+		uint64_t next_id = 1;
+		uint64_t next_sequence = 0;
+		// Pass of the last class served; a class that was idle rejoins here instead of catching up on its lost turns
+		uint64_t global_pass = 0;
+		uint64_t aged = 0;
+
+		static order_key key_of(const entry& e);
+		void enqueue(uint64_t id, const entry& e);
+		void age(std::chrono::system_clock::time_point now);
+
+	public:
+		explicit queue(queue_options options = {});
+
+		// Returns the id of the submission
+		uint64_t add_submission(pending_addition_submission submission);
+		// For callers that assign ids themselves, e.g. to share them between several queues; ids must be unique
+		void add_submission(uint64_t id, pending_addition_submission submission);
+		// Puts back a submission that was taken out but could not be run, or one recovered from a journal; it goes ahead of
+		// everything that arrived after it
+		void requeue(queued_submission submission);
+		std::optional<queued_submission> pop();
+
+		bool cancel(uint64_t id);
+		// Keeps the submission's place relative to others that arrived before and after it
+		bool reprioritize(uint64_t id, priority_class priority);
+		std::optional<queue_position> locate(uint64_t id) const;
+		const pending_addition_submission* find(uint64_t id) const;
+		// In no particular order
+		void for_each(const std::function<void(uint64_t, uint64_t, const pending_addition_submission&)>& visit) const;
+
+		void reserve(size_t n);
+		size_t size() const;
+		size_t size(priority_class priority) const;
+		bool empty() const;
+		// How many submissions have moved up a class by aging
+		uint64_t n_aged() const {
+			return aged;
+		}
+	};
+}
+
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef BROKER_REJUDGE_HPP
+#define BROKER_REJUDGE_HPP
+
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <optional>
+#include <vector>
+
+#include "dispatch.hpp"
+#include "protocol.hpp"
+
+
+namespace broker {
+	// Feeds rejudges to the dispatcher as rejudge-class submissions, but only while more than a headroom fraction of all
+	// run slots is free, and never more at once than the slots outside the headroom. The dispatcher is told the headroom
+	// too and keeps it free of rejudge tests, however many tests the submissions fed so far turn into, so live tests find
+	// it idle; tests of higher classes go first anyway. Rejudges are served oldest first; a paused one lets the next one
+	// through.
+	//
+	// Rejudges are not journalled: submissions that were handed to the dispatcher survive a restart, but the front-end
+	// has to start the rest of a rejudge again. A complete rejudge is forgotten once its watchers are told, except for its
+	// final progress, which is kept for the last max_completed of them.
+	class rejudge_lane {
+	public:
+		// Gets nullopt once the rejudge is complete
+		using event_fn = std::function<void(std::optional<rejudge_event>)>;
+
+	private:
+		using clock = std::chrono::steady_clock;
+
+		struct rejudge {
+			rejudge_query query;
+			std::deque<rejudge_item> waiting;
+			uint64_t n_fed = 0;
+			uint64_t n_running = 0;
+			uint64_t n_finished = 0;
+			bool is_paused = false;
+			bool is_fed = false;
+			std::deque<clock::time_point> recent_finishes;
+			std::vector<event_fn> watchers;
+		};
+
+		static constexpr size_t max_completed = 1024;
+
+		dispatcher& judge;
+		// By id, so older rejudges go first
+		std::map<uint64_t, rejudge> rejudges;
+		std::map<uint64_t, rejudge_progress> completed;
+		uint64_t next_rejudge_id = 1;
+		uint64_t n_running = 0;
+		bool is_pumping = false;
+
+		void finished(uint64_t rejudge_id, uint64_t submission_id, std::optional<submission_result> result);
+		void maybe_complete(std::map<uint64_t, rejudge>::iterator it);
+		static void forget_old_finishes(rejudge& r, clock::time_point now);
+		static rejudge_progress progress_of(rejudge& r);
+
+	public:
+		rejudge_lane(dispatcher& judge, double headroom);
+
+		uint64_t start(rejudge_query query);
+		bool feed(uint64_t rejudge_id, std::vector<rejudge_item> items, bool is_last);
+		bool set_paused(uint64_t rejudge_id, bool is_paused);
+		std::optional<rejudge_progress> progress(uint64_t rejudge_id);
+		// false if the rejudge is not known or already complete
+		bool watch(uint64_t rejudge_id, event_fn on_event);
+
+		// Hands out as many submissions as idle capacity allows; to be called whenever slots may have been freed
+		void pump();
+	};
+}
+
+
+#endif
@@ -0,0 +1,73 @@
+#include <algorithm>
+
+#include "admission.hpp"
+
+
+namespace broker {
+	admission_control::admission_control(admission_options options): options(options) {
+	}
+
+
+	admission_control::clock::duration admission_control::wait_for_token(bucket& b, double rate, double burst, clock::time_point now) {
+		double elapsed = std::chrono::duration<double>(now - b.updated).count();
+		b.tokens = std::min(burst, b.tokens + elapsed * rate);
+		b.updated = now;
+		if(b.tokens >= 1) {
+			return clock::duration::zero();
+		}
+		return std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>((1 - b.tokens) / rate));
+	}
+
+
+	void admission_control::prune(clock::time_point now) {
+		for(auto* buckets: {&users, &contests}) {
+			double rate = buckets == &users ? options.user_rate : options.contest_rate;
+			double burst = buckets == &users ? options.user_burst : options.contest_burst;
+			for(auto it = buckets->begin(); it != buckets->end();) {
+				// A full bucket is no different from one that does not exist yet
+				if(it->second.tokens + std::chrono::duration<double>(now - it->second.updated).count() * rate >= burst) {
+					it = buckets->erase(it);
+				} else {
+					++it;
+				}
+			}
+		}
+		n_buckets_after_prune = users.size() + contests.size();
+	}
+
+
+	std::optional<std::chrono::milliseconds> admission_control::admit(uint64_t user_id, uint64_t contest_id, priority_class priority, size_t n_queued) {
+		if(n_queued >= options.max_queued[static_cast<size_t>(priority)]) {
+			rejected++;
+			return options.overload_retry_after;
+		}
+
+		auto now = clock::now();
+		if(users.size() + contests.size() > 2 * n_buckets_after_prune + 1024) {
+			prune(now);
+		}
+		bucket* user = nullptr;
+		bucket* contest = nullptr;
+		clock::duration wait = clock::duration::zero();
+		if(user_id != 0 && options.user_rate > 0) {
+			user = &users.try_emplace(user_id, bucket{options.user_burst, now}).first->second;
+			wait = std::max(wait, wait_for_token(*user, options.user_rate, options.user_burst, now));
+		}
+		if(contest_id != 0 && options.contest_rate > 0) {
+			contest = &contests.try_emplace(contest_id, bucket{options.contest_burst, now}).first->second;
+			wait = std::max(wait, wait_for_token(*contest, options.contest_rate, options.contest_burst, now));
+		}
+		if(wait > clock::duration::zero()) {
+			rejected++;
+			return std::chrono::ceil<std::chrono::milliseconds>(wait);
+		}
+		// Tokens are only taken once both buckets have one, so a rejected submission does not eat into the other bucket
+		if(user) {
+			user->tokens--;
+		}
+		if(contest) {
+			contest->tokens--;
+		}
+		return std::nullopt;
+	}
+}
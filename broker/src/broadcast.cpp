@@ -0,0 +1,68 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+
+#include "broadcast.hpp"
+
+
+namespace broker {
+	broadcaster::broadcaster(size_t fanout): fanout(std::max<size_t>(fanout, 1)) {
+	}
+
+
+	uint64_t broadcaster::add_member(std::string address, prefetch_fn prefetch) {
+		uint64_t member_id = next_member_id++;
+		members.emplace(member_id, member{std::move(address), std::move(prefetch)});
+		return member_id;
+	}
+
+
+	void broadcaster::remove_member(uint64_t member_id) {
+		members.erase(member_id);
+	}
+
+
+	void broadcaster::announce(std::vector<registry_key> keys) {
+		uint64_t broadcast_id = next_broadcast_id++;
+		std::vector<member*> order;
+		for(auto& [member_id, m]: members) {
+			order.push_back(&m);
+		}
+		if(order.empty()) {
+			std::cerr << "Broadcast #" << broadcast_id << ": no invokers are registered" << std::endl;
+			return;
+		}
+
+		size_t n_roots = 1;
+		while(n_roots < order.size() && (size_t{1} << n_roots) < order.size()) {
+			n_roots++;
+		}
+		n_roots = std::min(n_roots, order.size());
+
+		std::cerr << "Broadcast #" << broadcast_id << ": " << keys.size() << " objects to " << order.size() << " invokers, " << n_roots << " of them fetching from the registry" << std::endl;
+
+		auto started = std::chrono::steady_clock::now();
+		auto n_left = std::make_shared<size_t>(order.size());
+		auto n_incomplete = std::make_shared<size_t>(0);
+		// Parents are told first, so that they usually know about the objects by the time their children ask
+		for(size_t i = 0; i < order.size(); i++) {
+			std::vector<std::string> sources;
+			for(size_t j = i; j >= n_roots && sources.size() < 2;) {
+				j = (j - n_roots) / fanout;
+				sources.push_back(order[j]->address);
+			}
+			order[i]->prefetch(keys, std::move(sources)) | [broadcast_id, started, n_left, n_incomplete](bool is_complete) {
+				*n_incomplete += !is_complete;
+				if(--*n_left == 0) {
+					auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+					std::cerr << "Broadcast #" << broadcast_id << " finished in " << elapsed.count() << " ms";
+					if(*n_incomplete > 0) {
+						std::cerr << ", " << *n_incomplete << " invokers could not fetch some objects";
+					}
+					std::cerr << std::endl;
+				}
+			};
+		}
+	}
+}
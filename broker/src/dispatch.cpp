@@ -0,0 +1,552 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+
+#include "dispatch.hpp"
+
+
+namespace broker {
+	dispatcher::dispatcher(dispatcher_options options_): options(std::move(options_)) {
+		options.locality_candidates = std::max<size_t>(options.locality_candidates, 1);
+	}
+
+
+	dispatcher::language& dispatcher::language_for(uint64_t language_id) {
+		return languages.try_emplace(language_id, options.queue).first->second;
+	}
+
+
+	uint64_t dispatcher::add_invoker(invoker_capacity capacity, compile_fn compile, run_test_fn run_test) {
+		uint64_t invoker_id = next_invoker_id++;
+		std::sort(capacity.language_ids.begin(), capacity.language_ids.end());
+		capacity.language_ids.erase(std::unique(capacity.language_ids.begin(), capacity.language_ids.end()), capacity.language_ids.end());
+		uint32_t free_slots = std::min(capacity.free_slots, capacity.slots);
+		uint32_t free_compile_slots = std::min(capacity.free_compile_slots, capacity.compile_slots);
+		auto& inv = invokers.emplace(invoker_id, invoker{std::move(capacity), 0, 0, std::move(compile), std::move(run_test), {}, {}, clock::now()}).first->second;
+		n_slots += inv.capacity.slots;
+		set_free_slots(invoker_id, inv, free_slots);
+		set_free_compile_slots(invoker_id, inv, free_compile_slots);
+		std::cerr << "Invoker #" << invoker_id << " registered with " << inv.capacity.slots << " run slots, " << inv.capacity.compile_slots << " compile slots, " << inv.capacity.cores << " cores, " << inv.capacity.language_ids.size() << " languages" << std::endl;
+		pump();
+		return invoker_id;
+	}
+
+
+	void dispatcher::remove_invoker(uint64_t invoker_id) {
+		auto node = invokers.extract(invoker_id);
+		if(!node) {
+			return;
+		}
+		auto& inv = node.mapped();
+		n_slots -= inv.capacity.slots;
+		set_free_slots(invoker_id, inv, 0);
+		set_free_compile_slots(invoker_id, inv, 0);
+		size_t n_lost = 0;
+		for(auto& [job, job_lease]: inv.running) {
+			n_lost += requeue_job(job.first, job.second);
+		}
+		if(n_lost > 0) {
+			std::cerr << "Invoker #" << invoker_id << " went away, handing out " << n_lost << " of its jobs again" << std::endl;
+		}
+		pump();
+	}
+
+
+	void dispatcher::set_cached_problems(uint64_t invoker_id, problem_filter cached_problems) {
+		auto it = invokers.find(invoker_id);
+		if(it != invokers.end()) {
+			it->second.cached_problems = std::move(cached_problems);
+		}
+	}
+
+
+	std::optional<heartbeat_reply> dispatcher::heartbeat(uint64_t invoker_id, const invoker_heartbeat& status) {
+		auto it = invokers.find(invoker_id);
+		if(it == invokers.end()) {
+			return std::nullopt;
+		}
+		auto& inv = it->second;
+		inv.last_heartbeat = clock::now();
+		inv.load = status.load;
+		inv.available_memory = status.available_memory;
+		for(auto& job: status.jobs) {
+			if(auto running = inv.running.find(job); running != inv.running.end()) {
+				running->second.expiry = inv.last_heartbeat + options.lease;
+			}
+		}
+		return heartbeat_reply{backlog(), static_cast<uint32_t>(inv.running.size() - inv.n_compiling)};
+	}
+
+
+	void dispatcher::set_slots(uint64_t invoker_id, uint32_t slots) {
+		auto it = invokers.find(invoker_id);
+		if(it == invokers.end()) {
+			return;
+		}
+		auto& inv = it->second;
+		n_slots += slots;
+		n_slots -= inv.capacity.slots;
+		inv.capacity.slots = slots;
+		recount_free_slots(invoker_id, inv);
+		pump();
+	}
+
+
+	void dispatcher::expire_leases() {
+		auto now = clock::now();
+		std::vector<uint64_t> silent;
+		size_t n_expired = 0;
+		for(auto& [invoker_id, inv]: invokers) {
+			if(now - inv.last_heartbeat > options.fence_after) {
+				silent.push_back(invoker_id);
+				continue;
+			}
+			for(auto it = inv.running.begin(); it != inv.running.end();) {
+				if(it->second.expiry > now) {
+					++it;
+					continue;
+				}
+				auto [submission_id, test] = it->first;
+				it = inv.running.erase(it);
+				if(test == compilation_job) {
+					inv.n_compiling--;
+					set_free_compile_slots(invoker_id, inv, inv.free_compile_slots + 1);
+				} else {
+					recount_free_slots(invoker_id, inv);
+				}
+				n_expired += requeue_job(submission_id, test);
+			}
+		}
+		if(n_expired > 0) {
+			std::cerr << "Leases of " << n_expired << " jobs ran out, handing them out again" << std::endl;
+			n_leases_expired += n_expired;
+		}
+		for(uint64_t invoker_id: silent) {
+			std::cerr << "Invoker #" << invoker_id << " missed its heartbeats, fencing it off" << std::endl;
+			n_invokers_fenced++;
+			remove_invoker(invoker_id);
+		}
+		pump();
+	}
+
+
+	bool dispatcher::requeue_job(uint64_t submission_id, uint32_t test) {
+		auto it = submissions.find(submission_id);
+		if(it == submissions.end()) {
+			return false;
+		}
+		auto& sub = it->second;
+		auto& lang = language_for(sub.language_id);
+		// A requeued submission keeps its sequence number, and tests of compiled submissions go before the queue anyway
+		if(test == compilation_job) {
+			lang.waiting.requeue(std::move(*sub.record));
+			sub.record.reset();
+		} else if(sub.outstanding.count(test)) {
+			lang.runnable.emplace(sub.record->submission.priority, submission_id, test);
+		} else {
+			return false;
+		}
+		return true;
+	}
+
+
+	void dispatcher::reindex(std::unordered_map<uint64_t, std::set<availability>>& index, uint64_t invoker_id, const invoker& inv, uint32_t& current, uint32_t free_slots) {
+		if(current > 0) {
+			for(uint64_t language_id: inv.capacity.language_ids) {
+				auto it = index.find(language_id);
+				it->second.erase({current, inv.capacity.memory, invoker_id});
+				if(it->second.empty()) {
+					index.erase(it);
+				}
+			}
+		}
+		current = free_slots;
+		if(current > 0) {
+			for(uint64_t language_id: inv.capacity.language_ids) {
+				index[language_id].insert({current, inv.capacity.memory, invoker_id});
+			}
+		}
+	}
+
+
+	void dispatcher::set_free_slots(uint64_t invoker_id, invoker& inv, uint32_t free_slots) {
+		n_free_slots += free_slots;
+		n_free_slots -= inv.free_slots;
+		reindex(available, invoker_id, inv, inv.free_slots, free_slots);
+	}
+
+
+	void dispatcher::set_free_compile_slots(uint64_t invoker_id, invoker& inv, uint32_t free_slots) {
+		reindex(compilers, invoker_id, inv, inv.free_compile_slots, free_slots);
+	}
+
+
+	void dispatcher::recount_free_slots(uint64_t invoker_id, invoker& inv) {
+		uint32_t n_running = inv.running.size() - inv.n_compiling;
+		set_free_slots(invoker_id, inv, inv.capacity.slots - std::min(inv.capacity.slots, n_running));
+	}
+
+
+	std::optional<uint64_t> dispatcher::pick_compiler(uint64_t language_id) const {
+		auto it = compilers.find(language_id);
+		if(it == compilers.end()) {
+			return std::nullopt;
+		}
+		return std::get<2>(*it->second.rbegin());
+	}
+
+
+	std::optional<std::pair<uint64_t, bool>> dispatcher::pick_for_tests(uint64_t language_id, uint64_t problem_id) const {
+		auto it = available.find(language_id);
+		if(it == available.end()) {
+			return std::nullopt;
+		}
+		size_t n_seen = 0;
+		for(auto candidate = it->second.rbegin(); candidate != it->second.rend() && n_seen < options.locality_candidates; ++candidate, n_seen++) {
+			uint64_t invoker_id = std::get<2>(*candidate);
+			if(invokers.at(invoker_id).cached_problems.might_contain(problem_id)) {
+				return std::pair{invoker_id, true};
+			}
+		}
+		return std::pair{std::get<2>(*it->second.rbegin()), false};
+	}
+
+
+	uint64_t dispatcher::submit(pending_addition_submission pending, finish_fn on_finish) {
+		uint64_t submission_id = next_submission_id++;
+		uint64_t language_id = pending.language_id;
+		submissions.emplace(submission_id, submission{language_id, std::move(on_finish)});
+		auto& waiting = language_for(language_id).waiting;
+		waiting.add_submission(submission_id, std::move(pending));
+		if(log) {
+			log->add(submission_id, waiting.locate(submission_id)->sequence, *waiting.find(submission_id));
+			maybe_compact();
+		}
+		pump();
+		return submission_id;
+	}
+
+
+	void dispatcher::recover(journal& log_) {
+		log = &log_;
+		auto started = std::chrono::steady_clock::now();
+		recovered_state state = log->replay();
+		next_submission_id = state.next_submission_id;
+		size_t n_recovered = state.submissions.size();
+		submissions.reserve(n_recovered);
+		std::unordered_map<uint64_t, size_t> n_per_language;
+		for(queued_submission& recovered: state.submissions) {
+			n_per_language[recovered.submission.language_id]++;
+		}
+		for(auto [language_id, n]: n_per_language) {
+			language_for(language_id).waiting.reserve(n);
+		}
+		for(queued_submission& recovered: state.submissions) {
+			uint64_t language_id = recovered.submission.language_id;
+			submissions.emplace(recovered.id, submission{language_id, nullptr});
+			language_for(language_id).waiting.requeue(std::move(recovered));
+		}
+		auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+		std::cerr << "Recovered " << n_recovered << " submissions from the journal in " << elapsed.count() << " ms, " << state.n_dispatched << " of them to be judged again" << std::endl;
+		pump();
+	}
+
+
+	bool dispatcher::watch(uint64_t submission_id, finish_fn on_finish) {
+		auto it = submissions.find(submission_id);
+		if(it == submissions.end()) {
+			return false;
+		}
+		auto& sub = it->second;
+		if(sub.on_finish) {
+			sub.on_finish = [first = std::move(sub.on_finish), second = std::move(on_finish)](uint64_t submission_id, std::optional<submission_result> result) {
+				first(submission_id, result);
+				second(submission_id, std::move(result));
+			};
+		} else {
+			sub.on_finish = std::move(on_finish);
+		}
+		return true;
+	}
+
+
+	bool dispatcher::cancel(uint64_t submission_id) {
+		auto it = submissions.find(submission_id);
+		if(it == submissions.end() || !language_for(it->second.language_id).waiting.cancel(submission_id)) {
+			return false;
+		}
+		auto on_finish = std::move(it->second.on_finish);
+		submissions.erase(it);
+		if(log) {
+			log->cancel(submission_id);
+		}
+		if(on_finish) {
+			on_finish(submission_id, std::nullopt);
+		}
+		return true;
+	}
+
+
+	bool dispatcher::reprioritize(uint64_t submission_id, priority_class priority) {
+		auto it = submissions.find(submission_id);
+		if(it == submissions.end() || !language_for(it->second.language_id).waiting.reprioritize(submission_id, priority)) {
+			return false;
+		}
+		if(log) {
+			log->reprioritize(submission_id, priority);
+		}
+		return true;
+	}
+
+
+	std::vector<dispatcher::taken_submission> dispatcher::take_waiting() {
+		std::vector<taken_submission> result;
+		for(auto& [language_id, lang]: languages) {
+			while(auto next = lang.waiting.pop()) {
+				auto node = submissions.extract(next->id);
+				unreleased.emplace(next->id, *next);
+				result.push_back({std::move(*next), std::move(node.mapped().on_finish)});
+			}
+		}
+		return result;
+	}
+
+
+	void dispatcher::release(uint64_t submission_id) {
+		if(unreleased.erase(submission_id) && log) {
+			log->cancel(submission_id);
+			maybe_compact();
+		}
+	}
+
+
+	size_t dispatcher::n_queued() const {
+		size_t n = 0;
+		for(auto& [language_id, lang]: languages) {
+			n += lang.waiting.size();
+		}
+		return n;
+	}
+
+
+	uint64_t dispatcher::backlog() const {
+		uint64_t n = 0;
+		for(auto& [language_id, lang]: languages) {
+			n += lang.waiting.size() + lang.runnable.size();
+		}
+		return n;
+	}
+
+
+	uint64_t dispatcher::reserved_slots() const {
+		return static_cast<uint64_t>(std::ceil(rejudge_headroom * n_slots));
+	}
+
+
+	broker_stats dispatcher::stats() const {
+		broker_stats result{invokers.size(), n_queued(), n_tests_dispatched, locality_hits, n_leases_expired, n_invokers_fenced, 0, 0, 0, 0, 0, n_deadline_misses, 0, 0, 0};
+		for(auto& [language_id, lang]: languages) {
+			result.n_aged += lang.waiting.n_aged();
+		}
+		for(auto& [invoker_id, inv]: invokers) {
+			result.load += inv.load;
+			result.available_memory += inv.available_memory;
+		}
+		return result;
+	}
+
+
+	// Languages take turns, one test and one compilation each, for as long as some of them have both work and an idle
+	// invoker
+	void dispatcher::pump() {
+		uint64_t reserved = reserved_slots();
+		bool is_progress = true;
+		while(is_progress && (!available.empty() || !compilers.empty())) {
+			is_progress = false;
+			for(auto& [language_id, lang]: languages) {
+				// Tests are ordered by class, so if the first one is a rejudge's, all of them are
+				if(!lang.runnable.empty() && (std::get<0>(*lang.runnable.begin()) != priority_class::rejudge || n_free_slots > reserved)) {
+					auto [priority, submission_id, test] = *lang.runnable.begin();
+					if(auto choice = pick_for_tests(language_id, submissions.at(submission_id).record->submission.problem_id)) {
+						lang.runnable.erase(lang.runnable.begin());
+						n_tests_dispatched++;
+						locality_hits += choice->second;
+						run_test(choice->first, submission_id, test);
+						is_progress = true;
+					}
+				}
+				if(!lang.waiting.empty()) {
+					if(auto invoker_id = pick_compiler(language_id)) {
+						compile(*invoker_id, *lang.waiting.pop());
+						is_progress = true;
+					}
+				}
+			}
+		}
+	}
+
+
+	void dispatcher::compile(uint64_t invoker_id, queued_submission next) {
+		auto& inv = invokers.at(invoker_id);
+		set_free_compile_slots(invoker_id, inv, inv.free_compile_slots - 1);
+		inv.n_compiling++;
+		uint64_t submission_id = next.id;
+		uint64_t dispatch_id = next_dispatch_id++;
+		inv.running.emplace(std::pair{submission_id, compilation_job}, lease{clock::now() + options.lease, dispatch_id});
+
+		auto& sub = submissions.at(submission_id);
+		compilation task{submission_id, next.submission.language_id, next.submission.source};
+		sub.record = std::move(next);
+		if(log) {
+			log->dispatch(submission_id);
+		}
+		inv.compile(std::move(task)) | [this, invoker_id, dispatch_id, submission_id](compilation_result result) {
+			if(finish_job(invoker_id, dispatch_id, submission_id, compilation_job)) {
+				compiled(submission_id, std::move(result));
+			}
+			pump();
+		};
+	}
+
+
+	void dispatcher::run_test(uint64_t invoker_id, uint64_t submission_id, uint32_t test) {
+		auto& inv = invokers.at(invoker_id);
+		set_free_slots(invoker_id, inv, inv.free_slots - 1);
+		uint64_t dispatch_id = next_dispatch_id++;
+		inv.running.emplace(std::pair{submission_id, test}, lease{clock::now() + options.lease, dispatch_id});
+
+		auto& sub = submissions.at(submission_id);
+		// The invoker fetches the tests now, so later tests of the problem may as well go there
+		inv.cached_problems.insert(sub.record->submission.problem_id);
+		inv.run_test({submission_id, sub.record->submission.problem_id, sub.language_id, test, sub.artifact_id}) | [this, invoker_id, dispatch_id, submission_id, test](invocation_result result) {
+			if(finish_job(invoker_id, dispatch_id, submission_id, test)) {
+				tested(submission_id, test, std::move(result));
+			}
+			pump();
+		};
+	}
+
+
+	dispatcher::submission* dispatcher::finish_job(uint64_t invoker_id, uint64_t dispatch_id, uint64_t submission_id, uint32_t test) {
+		auto inv = invokers.find(invoker_id);
+		if(inv == invokers.end()) {
+			return nullptr;
+		}
+		// The invoker was removed or the lease ran out in the meantime, and the job has been handed out again
+		auto job = inv->second.running.find({submission_id, test});
+		if(job == inv->second.running.end() || job->second.dispatch_id != dispatch_id) {
+			return nullptr;
+		}
+		inv->second.running.erase(job);
+		if(test == compilation_job) {
+			inv->second.n_compiling--;
+			set_free_compile_slots(invoker_id, inv->second, inv->second.free_compile_slots + 1);
+		} else {
+			recount_free_slots(invoker_id, inv->second);
+		}
+		auto it = submissions.find(submission_id);
+		// The verdict was known before the test finished
+		if(it == submissions.end() || (test != compilation_job && !it->second.outstanding.count(test))) {
+			return nullptr;
+		}
+		return &it->second;
+	}
+
+
+	void dispatcher::compiled(uint64_t submission_id, compilation_result result) {
+		auto& sub = submissions.at(submission_id);
+		uint32_t n_tests = sub.record->submission.n_tests;
+		if(result.status != verdict::accepted) {
+			finish(submission_id, {result.status, std::move(result.message), std::nullopt, std::vector<std::optional<verdict>>(n_tests), 0});
+			return;
+		}
+		if(n_tests == 0) {
+			finish(submission_id, {verdict::accepted, "", std::nullopt, {}, 0});
+			return;
+		}
+
+		sub.artifact_id = result.artifact_id;
+		sub.results.resize(n_tests);
+		auto& runnable = language_for(sub.language_id).runnable;
+		priority_class priority = sub.record->submission.priority;
+		for(uint32_t test = 0; test < n_tests; test++) {
+			sub.outstanding.insert(sub.outstanding.end(), test);
+			runnable.emplace(priority, submission_id, test);
+		}
+	}
+
+
+	// The verdict is that of the failed test with the lowest number, so with stops_at_first_failure the tests before a
+	// failed one still have to finish, but those after it are dropped
+	void dispatcher::tested(uint64_t submission_id, uint32_t test, invocation_result result) {
+		auto& sub = submissions.at(submission_id);
+		sub.outstanding.erase(test);
+		bool is_failed = result.status != verdict::accepted;
+		sub.results[test] = std::move(result);
+		if(is_failed && (!sub.failed_test || test < *sub.failed_test)) {
+			sub.failed_test = test;
+			if(sub.record->submission.stops_at_first_failure) {
+				// Those already running are let finish, and their results are ignored
+				auto& runnable = language_for(sub.language_id).runnable;
+				priority_class priority = sub.record->submission.priority;
+				runnable.erase(runnable.upper_bound({priority, submission_id, test}), runnable.lower_bound({priority, submission_id + 1, 0}));
+				sub.outstanding.erase(sub.outstanding.upper_bound(test), sub.outstanding.end());
+			}
+		}
+		if(!sub.outstanding.empty()) {
+			return;
+		}
+
+		submission_result total{verdict::accepted, "", sub.failed_test, {}, 0};
+		for(auto& test_result: sub.results) {
+			total.tests.push_back(test_result ? std::optional<verdict>(test_result->status) : std::nullopt);
+			if(test_result) {
+				total.max_time_usage = std::max(total.max_time_usage, test_result->time_usage);
+			}
+		}
+		if(sub.failed_test) {
+			total.status = sub.results[*sub.failed_test]->status;
+			total.message = std::move(sub.results[*sub.failed_test]->message);
+		}
+		finish(submission_id, std::move(total));
+	}
+
+
+	void dispatcher::finish(uint64_t submission_id, submission_result result) {
+		auto node = submissions.extract(submission_id);
+		if(*node.mapped().record->submission.deadline < std::chrono::system_clock::now()) {
+			n_deadline_misses++;
+		}
+		auto on_finish = std::move(node.mapped().on_finish);
+		if(log) {
+			log->finish(submission_id, result.status);
+			maybe_compact();
+		}
+		if(on_finish) {
+			on_finish(submission_id, std::move(result));
+		}
+	}
+
+
+	void dispatcher::maybe_compact() {
+		if(!log->needs_compaction()) {
+			return;
+		}
+		log->compact(next_submission_id, [this](const journal::entry_fn& write) {
+			for(auto& [language_id, lang]: languages) {
+				lang.waiting.for_each([&](uint64_t submission_id, uint64_t sequence, const pending_addition_submission& pending) {
+					write(submission_id, sequence, pending, false);
+				});
+			}
+			for(auto& [submission_id, record]: unreleased) {
+				write(submission_id, record.sequence, record.submission, false);
+			}
+			for(auto& [submission_id, sub]: submissions) {
+				if(sub.record) {
+					write(submission_id, sub.record->sequence, sub.record->submission, true);
+				}
+			}
+		});
+	}
+}
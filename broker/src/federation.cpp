@@ -0,0 +1,220 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <utility>
+
+#include <uvw.hpp>
+
+#include "federation.hpp"
+
+
+namespace broker {
+	namespace {
+		const std::string data_class = "problem";
+	}
+
+
+	federation::federation(dispatcher& judge, std::vector<std::string> brokers, const std::vector<std::string>& draining, std::string self, std::chrono::milliseconds hand_off_timeout): judge(judge), self(std::move(self)), hand_off_timeout(hand_off_timeout), ring(std::vector<std::string>{}) {
+		for(std::string& address: brokers) {
+			if(std::find(draining.begin(), draining.end(), address) == draining.end()) {
+				members.push_back(std::move(address));
+			}
+		}
+		ring = hash_ring(members);
+	}
+
+
+	void federation::stop() {
+		for(auto& [address, client]: peers) {
+			client->stop();
+		}
+	}
+
+
+	federation::broker_client& federation::peer(const std::string& address) {
+		auto it = peers.find(address);
+		if(it == peers.end()) {
+			it = peers.emplace(address, std::make_unique<broker_client>(address)).first;
+			it->second->set_connect_handler([this, address]() {
+				for(auto& [submission_id, owner]: taken_over) {
+					if(owner.address == address) {
+						relay(submission_id);
+					}
+				}
+			});
+		}
+		return *it->second;
+	}
+
+
+	std::optional<std::string> federation::redirect(const submission_request& request) {
+		auto owners = ring.owners(data_class, request.problem_id, 1);
+		// With every broker draining, the submission is judged wherever it arrives
+		if(owners.empty() || members[owners[0]] == self) {
+			return std::nullopt;
+		}
+		redirected++;
+		return members[owners[0]];
+	}
+
+
+	void federation::remove(const std::string& address) {
+		auto it = std::find(members.begin(), members.end(), address);
+		if(it == members.end()) {
+			return;
+		}
+		members.erase(it);
+		ring = hash_ring(members);
+		std::cerr << "Broker " << address << " left the federation, " << members.size() << " remain" << std::endl;
+	}
+
+
+	std::optional<uint64_t> federation::drain() {
+		std::vector<std::string> rest;
+		for(auto& address: members) {
+			if(address != self) {
+				rest.push_back(address);
+			}
+		}
+		if(rest.empty()) {
+			return std::nullopt;
+		}
+		// The others learn first, so that none of them sends a handed off submission back. Calls over one connection are
+		// handled in order.
+		for(auto& address: rest) {
+			peer(address)->remove_broker(self);
+		}
+		members = std::move(rest);
+		ring = hash_ring(members);
+
+		auto taken = judge.take_waiting();
+		for(auto& [record, on_finish]: taken) {
+			auto& pending = record.submission;
+			uint64_t deadline = pending.deadline ? std::chrono::duration_cast<std::chrono::milliseconds>(pending.deadline->time_since_epoch()).count() : 0;
+			submission_request request{pending.problem_id, pending.language_id, std::move(pending.source), static_cast<uint8_t>(pending.priority), pending.n_tests, pending.stops_at_first_failure, 0, 0, 0, deadline};
+			handed_off.emplace(record.id, std::move(on_finish));
+			// The new owner may never answer, and until it takes the submission the journal has to keep it
+			auto state = std::make_shared<pending_hand_off>();
+			state->deadline = uvw::Loop::getDefault()->resource<uvw::TimerHandle>();
+			state->deadline->on<uvw::TimerEvent>([this, submission_id = record.id, request, state](const uvw::TimerEvent&, uvw::TimerHandle& timer) {
+				timer.close();
+				state->deadline.reset();
+				state->is_taken_back = true;
+				std::cerr << "Submission #" << submission_id << " was not taken over in time, judging it here" << std::endl;
+				judge_here(submission_id, request);
+			});
+			state->deadline->start(hand_off_timeout, std::chrono::milliseconds{0});
+			hand_off(record.id, std::move(request), members[ring.owners(data_class, pending.problem_id, 1)[0]], std::move(state));
+		}
+		n_handed_off_total += taken.size();
+		std::cerr << "Draining, handed " << taken.size() << " waiting submissions to " << members.size() << " other brokers" << std::endl;
+		return taken.size();
+	}
+
+
+	// Submitted like any other, so a new owner that is overloaded may turn it away for a while. Each event of the new
+	// owner ends the attempt except the one with its id, which only tells that it has the submission journalled.
+	void federation::hand_off(uint64_t submission_id, submission_request request, const std::string& address, std::shared_ptr<pending_hand_off> pending) {
+		auto is_over = std::make_shared<bool>(false);
+		auto settle = [pending]() {
+			if(pending->deadline) {
+				pending->deadline->stop();
+				pending->deadline->close();
+				pending->deadline.reset();
+			}
+		};
+		peer(address)->submit(request).subscribe([this, submission_id, request, address, pending, is_over, settle](submission_event event) {
+			if(*is_over || pending->is_taken_back) {
+				return;
+			}
+			if(event.redirect && *event.redirect != self) {
+				*is_over = true;
+				hand_off(submission_id, request, *event.redirect, pending);
+			} else if(event.redirect) {
+				// The other broker has not dropped this one from its ring, e.g. because of a config mismatch
+				*is_over = true;
+				settle();
+				std::cerr << "Broker " << address << " sent submission #" << submission_id << " back, judging it here" << std::endl;
+				judge_here(submission_id, request);
+			} else if(event.retry_after_ms) {
+				*is_over = true;
+				auto timer = uvw::Loop::getDefault()->resource<uvw::TimerHandle>();
+				timer->on<uvw::TimerEvent>([this, submission_id, request, address, pending](const uvw::TimerEvent&, uvw::TimerHandle& timer) {
+					timer.close();
+					if(!pending->is_taken_back) {
+						hand_off(submission_id, request, address, pending);
+					}
+				});
+				timer->start(std::chrono::milliseconds{*event.retry_after_ms}, std::chrono::milliseconds{0});
+			} else if(event.result) {
+				*is_over = true;
+				settle();
+				judge.release(submission_id);
+				finished(submission_id, std::move(event.result));
+			} else {
+				settle();
+				judge.release(submission_id);
+				taken_over[submission_id] = {address, event.submission_id};
+			}
+		}, [this, submission_id, pending, is_over, settle]() {
+			// Cancelled at the new owner
+			if(!*is_over && !pending->is_taken_back) {
+				*is_over = true;
+				settle();
+				judge.release(submission_id);
+				finished(submission_id, std::nullopt);
+			}
+		});
+	}
+
+
+	void federation::judge_here(uint64_t submission_id, const submission_request& request) {
+		pending_addition_submission pending{request.problem_id, request.language_id, request.source, static_cast<priority_class>(request.priority), request.n_tests, request.stops_at_first_failure, std::nullopt};
+		if(request.deadline != 0) {
+			pending.deadline = std::chrono::system_clock::time_point{std::chrono::milliseconds{request.deadline}};
+		}
+		judge.submit(std::move(pending), [this, submission_id](uint64_t, std::optional<submission_result> result) {
+			finished(submission_id, std::move(result));
+		});
+		judge.release(submission_id);
+	}
+
+
+	// A submission the new owner does not know anymore finished while the connection was down, and its verdict is lost
+	void federation::relay(uint64_t submission_id) {
+		auto& owner = taken_over.at(submission_id);
+		peer(owner.address)->watch(owner.submission_id).subscribe([this, submission_id](submission_event event) {
+			if(event.result) {
+				finished(submission_id, std::move(event.result));
+			}
+		}, [this, submission_id]() {
+			finished(submission_id, std::nullopt);
+		});
+	}
+
+
+	void federation::finished(uint64_t submission_id, std::optional<submission_result> result) {
+		taken_over.erase(submission_id);
+		auto node = handed_off.extract(submission_id);
+		if(node && node.mapped()) {
+			node.mapped()(submission_id, std::move(result));
+		}
+	}
+
+
+	bool federation::watch(uint64_t submission_id, dispatcher::finish_fn on_finish) {
+		auto it = handed_off.find(submission_id);
+		if(it == handed_off.end()) {
+			return false;
+		}
+		if(it->second) {
+			it->second = [first = std::move(it->second), second = std::move(on_finish)](uint64_t submission_id, std::optional<submission_result> result) {
+				first(submission_id, result);
+				second(submission_id, std::move(result));
+			};
+		} else {
+			it->second = std::move(on_finish);
+		}
+		return true;
+	}
+}
@@ -0,0 +1,426 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <uvw.hpp>
+
+#include "common/crc32.hpp"
+
+#include "journal.hpp"
+
+
+namespace broker {
+	namespace {
+		struct record_header {
+			uint32_t crc;
+			uint32_t type;
+			uint64_t id;
+			uint64_t argument;
+			uint64_t length;
+		};
+		static_assert(sizeof(record_header) == 32);
+
+		struct add_payload {
+			uint64_t problem_id;
+			uint64_t language_id;
+			uint32_t n_tests;
+			uint8_t priority;
+			uint8_t stops_at_first_failure;
+			uint16_t reserved;
+		};
+		static_assert(sizeof(add_payload) == 24);
+
+		constexpr size_t write_batch_size = 1 << 20;
+
+
+		struct mapping {
+			void* addr;
+			size_t size;
+
+			mapping(void* addr, size_t size): addr(addr), size(size) {
+			}
+			mapping(const mapping&) = delete;
+			mapping& operator=(const mapping&) = delete;
+			~mapping() {
+				munmap(addr, size);
+			}
+		};
+
+
+		[[noreturn]] void throw_errno(const std::string& what, const std::filesystem::path& path) {
+			throw std::system_error(errno, std::generic_category(), what + " " + path.string());
+		}
+
+
+		void sync_directory(const std::filesystem::path& path) {
+			int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if(fd == -1) {
+				throw_errno("Could not open", path);
+			}
+			fsync(fd);
+			close(fd);
+		}
+
+
+		void encode(std::vector<std::byte>& out, journal_record_type type, uint64_t id, uint64_t argument, const void* payload = nullptr, size_t payload_length = 0, const void* data = nullptr, size_t data_length = 0) {
+			record_header header{0, static_cast<uint32_t>(type), id, argument, payload_length + data_length};
+			uint32_t crc = crc32::update(0, &header, sizeof(header));
+			crc = crc32::update(crc, payload, payload_length);
+			header.crc = crc32::update(crc, data, data_length);
+
+			size_t offset = out.size();
+			out.resize(offset + sizeof(header) + payload_length + data_length);
+			std::memcpy(out.data() + offset, &header, sizeof(header));
+			if(payload_length > 0) {
+				std::memcpy(out.data() + offset + sizeof(header), payload, payload_length);
+			}
+			if(data_length > 0) {
+				std::memcpy(out.data() + offset + sizeof(header) + payload_length, data, data_length);
+			}
+		}
+
+
+		void encode_add(std::vector<std::byte>& out, uint64_t id, uint64_t sequence, const pending_addition_submission& submission) {
+			add_payload payload{submission.problem_id, submission.language_id, submission.n_tests, static_cast<uint8_t>(submission.priority), submission.stops_at_first_failure, 0};
+			encode(out, journal_record_type::add, id, sequence, &payload, sizeof(payload), submission.source.data(), submission.source.size());
+			if(submission.deadline) {
+				encode(out, journal_record_type::deadline, id, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(submission.deadline->time_since_epoch()).count()));
+			}
+		}
+
+
+		void write_all(int fd, const std::byte* data, size_t length, uint64_t offset, const std::filesystem::path& path) {
+			while(length > 0) {
+				ssize_t n = pwrite(fd, data, length, offset);
+				if(n == -1) {
+					if(errno == EINTR) {
+						continue;
+					}
+					throw_errno("Could not write to", path);
+				}
+				data += n;
+				length -= n;
+				offset += n;
+			}
+		}
+	}
+
+
+	journal::journal(std::filesystem::path path_, uint64_t min_compaction_size): path(std::move(path_)), min_compaction_size(min_compaction_size) {
+		fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if(fd == -1) {
+			throw_errno("Could not open", path);
+		}
+		sync_directory(path.parent_path());
+	}
+
+
+	journal::~journal() {
+		close(fd);
+	}
+
+
+	recovered_state journal::replay() {
+		struct stat st;
+		if(fstat(fd, &st) == -1) {
+			throw_errno("Could not stat", path);
+		}
+		// Recovered sources point into the mapping, which lives as long as any of them does, even after compaction has
+		// replaced the file
+		size_t file_size = st.st_size;
+		const std::byte* contents = nullptr;
+		std::shared_ptr<const mapping> owner;
+		if(file_size > 0) {
+			void* addr = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if(addr == MAP_FAILED) {
+				throw_errno("Could not map", path);
+			}
+			madvise(addr, file_size, MADV_SEQUENTIAL);
+			owner = std::make_shared<const mapping>(addr, file_size);
+			contents = static_cast<const std::byte*>(addr);
+		}
+
+		// Submissions in the order they were added, with finished ones left empty; the map only holds indices, so that
+		// rehashing does not move submissions around
+		struct live {
+			queued_submission submission;
+			bool is_alive;
+			bool is_dispatched;
+		};
+		std::vector<live> submissions;
+		std::unordered_map<uint64_t, size_t> indices;
+		uint64_t next_submission_id = 1;
+
+		size_t offset = 0;
+		while(file_size - offset >= sizeof(record_header)) {
+			record_header header;
+			std::memcpy(&header, contents + offset, sizeof(header));
+			const std::byte* data = contents + offset + sizeof(header);
+			if(header.length > file_size - offset - sizeof(header)) {
+				break;
+			}
+			uint32_t crc = header.crc;
+			header.crc = 0;
+			if(crc32::update(crc32::update(0, &header, sizeof(header)), data, header.length) != crc) {
+				break;
+			}
+			offset += sizeof(header) + header.length;
+
+			auto type = static_cast<journal_record_type>(header.type);
+			next_submission_id = std::max(next_submission_id, header.id + (type != journal_record_type::watermark));
+			if(type == journal_record_type::add && header.length >= sizeof(add_payload)) {
+				add_payload payload;
+				std::memcpy(&payload, data, sizeof(payload));
+				pending_addition_submission submission{
+					payload.problem_id,
+					payload.language_id,
+					rpc::blob{owner, data + sizeof(payload), header.length - sizeof(payload)},
+					static_cast<priority_class>(std::min<size_t>(payload.priority, n_priority_classes - 1)),
+					payload.n_tests,
+					payload.stops_at_first_failure != 0
+				};
+				auto [it, is_new] = indices.try_emplace(header.id, submissions.size());
+				if(is_new) {
+					submissions.push_back({{header.id, header.argument, std::move(submission)}, true, false});
+				} else {
+					submissions[it->second] = {{header.id, header.argument, std::move(submission)}, true, false};
+				}
+			} else if(auto it = indices.find(header.id); it != indices.end()) {
+				live& s = submissions[it->second];
+				if(type == journal_record_type::dispatch) {
+					s.is_dispatched = true;
+				} else if(type == journal_record_type::deadline) {
+					s.submission.submission.deadline = std::chrono::system_clock::time_point{std::chrono::milliseconds{static_cast<int64_t>(header.argument)}};
+				} else if(type == journal_record_type::reprioritize) {
+					s.submission.submission.priority = static_cast<priority_class>(std::min<size_t>(header.argument, n_priority_classes - 1));
+				} else if(type == journal_record_type::finish || type == journal_record_type::cancel) {
+					s = {};
+					indices.erase(it);
+				}
+			}
+		}
+		if(offset != file_size) {
+			std::cerr << "Dropping " << file_size - offset << " bytes of a torn record at the end of " << path << std::endl;
+			if(ftruncate(fd, offset) == -1 || fsync(fd) == -1) {
+				throw_errno("Could not truncate", path);
+			}
+		}
+		size = offset;
+
+		// Sorting indices rather than the submissions themselves is cheaper, and the order is nearly sorted already
+		std::vector<std::pair<std::pair<uint64_t, uint64_t>, size_t>> order;
+		order.reserve(indices.size());
+		for(size_t i = 0; i < submissions.size(); i++) {
+			if(submissions[i].is_alive) {
+				order.push_back({{submissions[i].submission.submission.language_id, submissions[i].submission.sequence}, i});
+			}
+		}
+		std::sort(order.begin(), order.end());
+
+		recovered_state result{{}, 0, next_submission_id};
+		result.submissions.reserve(order.size());
+		for(auto& [key, i]: order) {
+			result.n_dispatched += submissions[i].is_dispatched;
+			result.submissions.push_back(std::move(submissions[i].submission));
+		}
+		return result;
+	}
+
+
+	void journal::write(const std::vector<std::byte>& records) {
+		try {
+			write_all(fd, records.data(), records.size(), size, path);
+		} catch(...) {
+			// Replay stops at the first broken record, so a partial one must not stay in front of later ones
+			ftruncate(fd, size);
+			throw;
+		}
+		size += records.size();
+		is_dirty = true;
+		if(tail) {
+			tail->insert(tail->end(), records.begin(), records.end());
+		}
+	}
+
+
+	void journal::append(journal_record_type type, uint64_t id, uint64_t argument) {
+		buffer.clear();
+		encode(buffer, type, id, argument);
+		write(buffer);
+	}
+
+
+	void journal::add(uint64_t id, uint64_t sequence, const pending_addition_submission& submission) {
+		buffer.clear();
+		encode_add(buffer, id, sequence, submission);
+		write(buffer);
+	}
+
+
+	void journal::dispatch(uint64_t id) {
+		append(journal_record_type::dispatch, id, 0);
+	}
+
+
+	void journal::reprioritize(uint64_t id, priority_class priority) {
+		append(journal_record_type::reprioritize, id, static_cast<uint64_t>(priority));
+	}
+
+
+	void journal::finish(uint64_t id, verdict status) {
+		append(journal_record_type::finish, id, static_cast<uint64_t>(status));
+	}
+
+
+	void journal::cancel(uint64_t id) {
+		append(journal_record_type::cancel, id, 0);
+	}
+
+
+	void journal::run_in_background(std::function<void()> task, std::function<void()> on_done) {
+		is_busy = true;
+		auto shared_task = std::make_shared<std::function<void()>>(std::move(task));
+		auto done = [this, on_done = std::move(on_done)]() {
+			is_busy = false;
+			on_done();
+			if(is_sync_requested) {
+				sync();
+			}
+		};
+		auto req = uvw::Loop::getDefault()->resource<uvw::WorkReq>([shared_task]() {
+			(*shared_task)();
+		});
+		req->once<uvw::WorkEvent>([done](const uvw::WorkEvent&, uvw::WorkReq&) {
+			done();
+		});
+		req->once<uvw::ErrorEvent>([shared_task, done](const uvw::ErrorEvent& ev, uvw::WorkReq&) {
+			std::cerr << "Could not queue a journal operation, running it on the event loop: " << ev.what() << std::endl;
+			(*shared_task)();
+			done();
+		});
+		req->queue();
+	}
+
+
+	void journal::sync() {
+		is_sync_requested = true;
+		if(is_busy) {
+			return;
+		}
+		is_sync_requested = false;
+		if(!is_dirty) {
+			return;
+		}
+		is_dirty = false;
+		bool syncs_directory = std::exchange(is_directory_dirty, false);
+		run_in_background([fd = fd, syncs_directory, path = path]() {
+			fdatasync(fd);
+			if(syncs_directory) {
+				try {
+					sync_directory(path.parent_path());
+				} catch(std::exception& e) {
+					std::cerr << e.what() << std::endl;
+				}
+			}
+		}, []() {});
+	}
+
+
+	bool journal::needs_compaction() const {
+		return !is_busy && size > std::max(min_compaction_size, 2 * compacted_size);
+	}
+
+
+	// The snapshot is written next to the journal on the thread pool and renamed over it once the records appended in
+	// the meantime have been copied after it, so a crash at any point leaves one of the two complete. The sources are
+	// shared with the queue rather than copied, so taking the snapshot on the event loop is cheap.
+	void journal::compact(uint64_t next_submission_id, const std::function<void(const entry_fn&)>& list_live) {
+		auto entries = std::make_shared<std::vector<snapshot_entry>>();
+		list_live([&](uint64_t id, uint64_t sequence, const pending_addition_submission& submission, bool is_dispatched) {
+			entries->push_back({id, sequence, submission, is_dispatched});
+		});
+
+		auto snapshot_path = path;
+		snapshot_path += ".tmp";
+		struct outcome {
+			int fd = -1;
+			uint64_t size = 0;
+			std::string error;
+		};
+		auto result = std::make_shared<outcome>();
+		tail.emplace();
+		run_in_background([entries, next_submission_id, snapshot_path, result]() {
+			try {
+				result->fd = open(snapshot_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+				if(result->fd == -1) {
+					throw_errno("Could not open", snapshot_path);
+				}
+				std::vector<std::byte> records;
+				encode(records, journal_record_type::watermark, next_submission_id, 0);
+				for(auto& entry: *entries) {
+					encode_add(records, entry.id, entry.sequence, entry.submission);
+					if(entry.is_dispatched) {
+						encode(records, journal_record_type::dispatch, entry.id, 0);
+					}
+					if(records.size() >= write_batch_size) {
+						write_all(result->fd, records.data(), records.size(), result->size, snapshot_path);
+						result->size += records.size();
+						records.clear();
+					}
+				}
+				write_all(result->fd, records.data(), records.size(), result->size, snapshot_path);
+				result->size += records.size();
+				if(fdatasync(result->fd) == -1) {
+					throw_errno("Could not sync", snapshot_path);
+				}
+			} catch(std::exception& e) {
+				result->error = e.what();
+				if(result->fd != -1) {
+					close(result->fd);
+				}
+				unlink(snapshot_path.c_str());
+			}
+			entries->clear();
+		}, [this, snapshot_path, result]() {
+			std::vector<std::byte> appended = std::move(*tail);
+			tail.reset();
+			if(result->error.empty()) {
+				try {
+					write_all(result->fd, appended.data(), appended.size(), result->size, snapshot_path);
+					if(rename(snapshot_path.c_str(), path.c_str()) == -1) {
+						throw_errno("Could not rename", snapshot_path);
+					}
+				} catch(std::exception& e) {
+					result->error = e.what();
+					close(result->fd);
+					unlink(snapshot_path.c_str());
+				}
+			}
+			if(!result->error.empty()) {
+				// Retried only once the journal has doubled again, rather than on every record
+				std::cerr << "Could not compact the queue journal: " << result->error << std::endl;
+				compacted_size = size;
+				return;
+			}
+			close(std::exchange(fd, result->fd));
+			std::cerr << "Compacted the queue journal from " << size << " to " << result->size + appended.size() << " bytes" << std::endl;
+			size = result->size + appended.size();
+			compacted_size = size;
+			// The copied records and the rename reach the disk with the next sync
+			is_dirty = true;
+			is_directory_dirty = true;
+		});
+	}
+}
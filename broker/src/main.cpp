@@ -5,16 +5,232 @@
 #include <nlohmann/json.hpp>
 #include <uvw.hpp>
 
+#include "common/registry.hpp"
 #include "invoker/protocol.hpp"
 #include "rpc/server.hpp"
 
+#include "admission.hpp"
+#include "broadcast.hpp"
+#include "dispatch.hpp"
+#include "federation.hpp"
+#include "journal.hpp"
+#include "memo.hpp"
 #include "protocol.hpp"
 #include "queue.hpp"
+#include "rejudge.hpp"
 
 
+std::optional<broker::broadcaster> broadcaster;
+std::optional<broker::dispatcher> dispatcher;
+std::optional<broker::journal> journal;
+std::optional<broker::admission_control> admission;
+std::optional<broker::rejudge_lane> rejudges;
+std::optional<registry> verdict_store;
+std::optional<broker::verdict_memo> memo;
+std::optional<broker::federation> federation;
+
 
 class broker_impl: public rpc::duplex_impl<broker_impl, broker_protocol, invoker_protocol> {
+	std::optional<uint64_t> member_id;
+	std::optional<uint64_t> invoker_id;
+
 public:
+	using duplex_impl::duplex_impl;
+
+	~broker_impl() {
+		if(member_id) {
+			broadcaster->remove_member(*member_id);
+		}
+		if(invoker_id) {
+			dispatcher->remove_invoker(*invoker_id);
+		}
+	}
+
+	void register_peer(std::string address) {
+		if(member_id) {
+			broadcaster->remove_member(*member_id);
+		}
+		member_id = broadcaster->add_member(std::move(address), [this](std::vector<registry_key> keys, std::vector<std::string> sources) {
+			return peer.prefetch(std::move(keys), std::move(sources));
+		});
+	}
+
+	void register_invoker(invoker_capacity capacity) {
+		if(invoker_id) {
+			dispatcher->remove_invoker(*invoker_id);
+		}
+		invoker_id = dispatcher->add_invoker(std::move(capacity), [this](compilation task) {
+			return peer.compile(std::move(task));
+		}, [this](test_run task) {
+			return peer.run_test(std::move(task));
+		});
+	}
+
+	void report_cached_problems(std::vector<uint64_t> filter) {
+		if(invoker_id) {
+			dispatcher->set_cached_problems(*invoker_id, broker::problem_filter{std::move(filter)});
+		}
+	}
+
+	std::optional<heartbeat_reply> heartbeat(invoker_heartbeat status) {
+		if(!invoker_id) {
+			return std::nullopt;
+		}
+		return dispatcher->heartbeat(*invoker_id, status);
+	}
+
+	void set_slots(uint32_t slots) {
+		if(invoker_id) {
+			dispatcher->set_slots(*invoker_id, slots);
+		}
+	}
+};
+
+
+class frontend_impl: public rpc::simplex_impl<frontend_impl, broker_frontend_protocol> {
+	static broker::dispatcher::finish_fn report_to(rpc::stream<submission_event> events) {
+		return [events](uint64_t submission_id, std::optional<submission_result> result) mutable {
+			if(result) {
+				events.push({submission_id, std::move(result), std::nullopt, std::nullopt});
+			}
+			events.finish();
+		};
+	}
+
+	static std::optional<std::chrono::system_clock::time_point> deadline_of(const submission_request& request) {
+		if(request.deadline == 0) {
+			return std::nullopt;
+		}
+		return std::chrono::system_clock::time_point{std::chrono::milliseconds{request.deadline}};
+	}
+
+	// The verdict is remembered under key if there is one
+	static void enqueue(submission_request request, rpc::stream<submission_event> events, std::optional<sha256::digest> key) {
+		broker::pending_addition_submission pending{request.problem_id, request.language_id, std::move(request.source), static_cast<broker::priority_class>(request.priority), request.n_tests, request.stops_at_first_failure, deadline_of(request)};
+		auto on_finish = report_to(events);
+		if(key) {
+			on_finish = [on_finish = std::move(on_finish), key = *key](uint64_t submission_id, std::optional<submission_result> result) {
+				if(result) {
+					memo->remember(key, *result);
+				}
+				on_finish(submission_id, std::move(result));
+			};
+		}
+		uint64_t submission_id = dispatcher->submit(std::move(pending), std::move(on_finish));
+		events.push({submission_id, std::nullopt, std::nullopt, std::nullopt});
+	}
+
+public:
+	rpc::stream<submission_event> submit(submission_request request) {
+		rpc::stream<submission_event> events;
+		if(request.priority >= broker::n_priority_classes) {
+			std::cerr << "Submission rejected: unknown priority class " << static_cast<int>(request.priority) << std::endl;
+			events.finish();
+			return events;
+		}
+		if(auto owner = federation ? federation->redirect(request) : std::nullopt) {
+			events.push({0, std::nullopt, std::nullopt, std::move(owner)});
+			events.finish();
+			return events;
+		}
+		if(auto retry_after = admission->admit(request.user_id, request.contest_id, static_cast<broker::priority_class>(request.priority), dispatcher->n_queued())) {
+			events.push({0, std::nullopt, static_cast<uint32_t>(std::min<int64_t>(retry_after->count(), UINT32_MAX)), std::nullopt});
+			events.finish();
+			return events;
+		}
+		std::optional<sha256::digest> key = memo ? memo->key_for(request) : std::nullopt;
+		if(!key) {
+			enqueue(std::move(request), events, std::nullopt);
+			return events;
+		}
+		memo->lookup(*key) | [request = std::move(request), events, key](std::optional<submission_result> cached) mutable {
+			if(!cached) {
+				enqueue(std::move(request), events, key);
+				return;
+			}
+			uint64_t submission_id = dispatcher->reserve_submission_id();
+			events.push({submission_id, std::nullopt, std::nullopt, std::nullopt});
+			events.push({submission_id, std::move(cached), std::nullopt, std::nullopt});
+			events.finish();
+		};
+		return events;
+	}
+
+	rpc::stream<submission_event> watch(uint64_t submission_id) {
+		rpc::stream<submission_event> events;
+		// Submissions handed to another broker are still reported here
+		if(!dispatcher->watch(submission_id, report_to(events)) && !(federation && federation->watch(submission_id, report_to(events)))) {
+			events.finish();
+		}
+		return events;
+	}
+
+	bool cancel(uint64_t submission_id) {
+		return dispatcher->cancel(submission_id);
+	}
+
+	bool reprioritize(uint64_t submission_id, uint8_t priority) {
+		return priority < broker::n_priority_classes && dispatcher->reprioritize(submission_id, static_cast<broker::priority_class>(priority));
+	}
+
+	void announce_test_data(std::vector<registry_key> keys) {
+		broadcaster->announce(std::move(keys));
+	}
+
+	broker_stats stats() {
+		broker_stats result = dispatcher->stats();
+		result.n_rejected = admission->n_rejected();
+		if(memo) {
+			result.memo_hits = memo->n_hits();
+			result.memo_misses = memo->n_misses();
+		}
+		if(federation) {
+			result.n_redirected = federation->n_redirected();
+			result.n_handed_off = federation->n_handed_off();
+		}
+		return result;
+	}
+
+	std::optional<uint64_t> drain() {
+		return federation ? federation->drain() : std::nullopt;
+	}
+
+	void remove_broker(std::string address) {
+		if(federation) {
+			federation->remove(address);
+		}
+	}
+
+	uint64_t start_rejudge(rejudge_query query) {
+		return rejudges->start(query);
+	}
+
+	bool feed_rejudge(uint64_t rejudge_id, std::vector<rejudge_item> items, bool is_last) {
+		return rejudges->feed(rejudge_id, std::move(items), is_last);
+	}
+
+	bool pause_rejudge(uint64_t rejudge_id, bool is_paused) {
+		return rejudges->set_paused(rejudge_id, is_paused);
+	}
+
+	std::optional<rejudge_progress> rejudge_status(uint64_t rejudge_id) {
+		return rejudges->progress(rejudge_id);
+	}
+
+	rpc::stream<rejudge_event> watch_rejudge(uint64_t rejudge_id) {
+		rpc::stream<rejudge_event> events;
+		bool is_known = rejudges->watch(rejudge_id, [events](std::optional<rejudge_event> event) mutable {
+			if(event) {
+				events.push(std::move(*event));
+			} else {
+				events.finish();
+			}
+		});
+		if(!is_known) {
+			events.finish();
+		}
+		return events;
+	}
 };
 
 
@@ -55,14 +271,62 @@ int main(int argc, char** argv) {
 	}
 
 
-	std::string s = "print('hello, world!')";
-	std::vector<std::byte> b(s.size());
-	std::transform(s.begin(), s.end(), b.begin(), [](char c) { return (std::byte)c; });
+	broadcaster.emplace(config.value<size_t>("broadcast_fanout", 2));
+	broker::dispatcher_options dispatcher_options;
+	dispatcher_options.queue.weights = config.value("priority_weights", dispatcher_options.queue.weights);
+	auto default_deadlines = config.value("default_deadline_ms", std::array<int64_t, broker::n_priority_classes>{60000, 600000, 3600000});
+	// A negative value turns aging off for the class; the top class and rejudges do not age whatever the config says
+	auto aging_after = config.value("aging_after_ms", std::array<int64_t, broker::n_priority_classes>{-1, 600000, -1});
+	for(size_t i = 0; i < broker::n_priority_classes; i++) {
+		dispatcher_options.queue.default_deadline[i] = std::chrono::milliseconds{default_deadlines[i]};
+		if(i > 0 && i != static_cast<size_t>(broker::priority_class::rejudge)) {
+			dispatcher_options.queue.aging_after[i] = aging_after[i] < 0 ? std::chrono::milliseconds::max() : std::chrono::milliseconds{aging_after[i]};
+		}
+	}
+	dispatcher_options.locality_candidates = config.value("locality_candidates", dispatcher_options.locality_candidates);
+	dispatcher_options.lease = std::chrono::milliseconds{config.value<int64_t>("lease_ms", 10000)};
+	auto heartbeat_interval = std::chrono::milliseconds{config.value<int64_t>("heartbeat_interval_ms", 1000)};
+	dispatcher_options.fence_after = heartbeat_interval * config.value<int64_t>("missed_heartbeats", 5);
+	dispatcher.emplace(dispatcher_options);
 
-	broker::queue q;
-	q.add_submission(broker::pending_addition_submission{1, 2, {}});
+	broker::admission_options admission_options;
+	admission_options.user_rate = config.value("user_submission_rate", admission_options.user_rate);
+	admission_options.user_burst = config.value("user_submission_burst", admission_options.user_burst);
+	admission_options.contest_rate = config.value("contest_submission_rate", admission_options.contest_rate);
+	admission_options.contest_burst = config.value("contest_submission_burst", admission_options.contest_burst);
+	admission_options.max_queued = config.value("max_queued", admission_options.max_queued);
+	admission_options.overload_retry_after = std::chrono::milliseconds{config.value<int64_t>("overload_retry_after_ms", 5000)};
+	admission.emplace(admission_options);
+	rejudges.emplace(*dispatcher, config.value<double>("rejudge_headroom", 0.2));
 
-	return 0;
+	// Reusing verdicts needs a registry to keep them in
+	if(config.contains("registry")) {
+		registry_cluster_options cluster_options;
+		cluster_options.nodes = config.at("registry").get<std::vector<std::string>>();
+		cluster_options.draining_nodes = config.value("registry_draining", std::vector<std::string>{});
+		cluster_options.n_replicas = config.value<size_t>("registry_replicas", 1);
+		cluster_options.timeout = std::chrono::milliseconds{config.value<int64_t>("registry_timeout_ms", 30000)};
+		verdict_store.emplace(cluster_options);
+
+		broker::memo_options memo_options;
+		for(auto& item: config.value("toolchains", nlohmann::json::object()).items()) {
+			memo_options.toolchains[std::stoull(item.key())] = item.value().get<std::string>();
+		}
+		for(uint8_t status: config.value("memo_uncached_verdicts", std::vector<uint8_t>{})) {
+			memo_options.uncached_verdicts.push_back(static_cast<verdict>(status));
+		}
+		memo_options.max_time_usage = config.value("memo_max_time_usage", memo_options.max_time_usage);
+		memo_options.lookup_timeout = std::chrono::milliseconds{config.value<int64_t>("memo_lookup_timeout_ms", 200)};
+		memo.emplace(*verdict_store, std::move(memo_options));
+	}
+	// Brokers of a federation are known by their frontend addresses
+	if(config.contains("federation")) {
+		federation.emplace(*dispatcher, config.at("federation").get<std::vector<std::string>>(), config.value("federation_draining", std::vector<std::string>{}), config.at("federation_self").get<std::string>(), std::chrono::milliseconds{config.value<int64_t>("federation_hand_off_timeout_ms", 30000)});
+	}
+	if(config.contains("journal")) {
+		journal.emplace(config["journal"].get<std::string>(), config.value<uint64_t>("journal_compaction_size", uint64_t{64} * 1024 * 1024));
+		dispatcher->recover(*journal);
+	}
 
 
 	// Start server
@@ -73,6 +337,38 @@ int main(int argc, char** argv) {
 		server.bind(address);
 	}
 
+	rpc::server<frontend_impl> frontend_server;
+	for(const auto& address: config.at("frontend_listen")) {
+		frontend_server.bind(address.get<std::string>());
+	}
+
+	// A crashed broker loses nothing that was written to the journal, but a crashed machine loses what was not synced
+	auto journal_timer = loop->resource<uvw::TimerHandle>();
+	journal_timer->on<uvw::TimerEvent>([](const uvw::TimerEvent&, uvw::TimerHandle&) {
+		journal->sync();
+	});
+	if(journal) {
+		auto interval = std::chrono::milliseconds{config.value<int64_t>("journal_sync_ms", 1000)};
+		journal_timer->start(interval, interval);
+	}
+
+
+	// Invokers that hang with the connection open keep their jobs only until the leases run out
+	auto lease_timer = loop->resource<uvw::TimerHandle>();
+	lease_timer->on<uvw::TimerEvent>([](const uvw::TimerEvent&, uvw::TimerHandle&) {
+		dispatcher->expire_leases();
+	});
+	lease_timer->start(heartbeat_interval, heartbeat_interval);
+
+
+	// Rejudges fill whatever capacity live submissions leave idle
+	auto rejudge_timer = loop->resource<uvw::TimerHandle>();
+	rejudge_timer->on<uvw::TimerEvent>([](const uvw::TimerEvent&, uvw::TimerHandle&) {
+		rejudges->pump();
+	});
+	auto rejudge_interval = std::chrono::milliseconds{config.value<int64_t>("rejudge_poll_ms", 100)};
+	rejudge_timer->start(rejudge_interval, rejudge_interval);
+
 
 	// Handle SIGINT, SIHUP, SIGTERM
 	std::vector<std::shared_ptr<uvw::SignalHandle>> signals;
@@ -86,6 +382,22 @@ int main(int argc, char** argv) {
 			}
 			signals.clear();
 			server.stop();
+			frontend_server.stop();
+			journal_timer->stop();
+			journal_timer->close();
+			lease_timer->stop();
+			lease_timer->close();
+			rejudge_timer->stop();
+			rejudge_timer->close();
+			if(journal) {
+				journal->sync();
+			}
+			if(verdict_store) {
+				verdict_store->stop();
+			}
+			if(federation) {
+				federation->stop();
+			}
 		});
 		signal->start(signum);
 		signals.push_back(std::move(signal));
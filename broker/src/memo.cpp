@@ -0,0 +1,70 @@
+#include <algorithm>
+#include <exception>
+#include <tuple>
+
+#include "memo.hpp"
+
+
+namespace broker {
+	namespace {
+		const std::string data_class = "verdict";
+
+		using memo_record = std::tuple<sha256::digest, submission_result>;
+	}
+
+
+	verdict_memo::verdict_memo(registry& store, memo_options options): store(store), options(std::move(options)) {
+		this->options.uncached_verdicts.push_back(verdict::judge_error);
+	}
+
+
+	std::optional<sha256::digest> verdict_memo::key_for(const submission_request& request) const {
+		auto toolchain = options.toolchains.find(request.language_id);
+		if(toolchain == options.toolchains.end() || request.test_set_version == 0) {
+			return std::nullopt;
+		}
+		return registry_key_hasher("verdict-v1")
+			.number(request.language_id)
+			.bytes(toolchain->second.data(), toolchain->second.size())
+			.number(request.problem_id)
+			.number(request.test_set_version)
+			.number(request.n_tests)
+			.number(request.stops_at_first_failure)
+			.bytes(request.source.data(), request.source.size())
+			.finish();
+	}
+
+
+	async::promise<std::optional<submission_result>> verdict_memo::lookup(const sha256::digest& key) {
+		return store.retrieve(data_class, registry_key_hasher::id_of(key), options.lookup_timeout) | [this, key](std::optional<std::vector<std::byte>> data) {
+			std::optional<submission_result> found;
+			if(data) {
+				try {
+					auto [stored_key, stored_result] = rpc::deserialize<memo_record>(*data);
+					if(stored_key == key) {
+						found = std::move(stored_result);
+					}
+				} catch(std::exception&) {
+				}
+			}
+			(found ? hits : misses)++;
+			return found;
+		};
+	}
+
+
+	void verdict_memo::remember(const sha256::digest& key, const submission_result& result) {
+		auto is_uncached = [this](verdict status) {
+			return std::find(options.uncached_verdicts.begin(), options.uncached_verdicts.end(), status) != options.uncached_verdicts.end();
+		};
+		if(is_uncached(result.status) || result.max_time_usage >= options.max_time_usage) {
+			return;
+		}
+		for(auto& test: result.tests) {
+			if(test && is_uncached(*test)) {
+				return;
+			}
+		}
+		store.store(data_class, registry_key_hasher::id_of(key), rpc::serialize(memo_record{key, result}));
+	}
+}
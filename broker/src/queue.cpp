@@ -1,8 +1,168 @@
+#include <algorithm>
+#include <utility>
+
 #include "queue.hpp"
 
 
 namespace broker {
+	queue::queue(queue_options options_): options(options_) {
+		for(size_t i = 0; i < n_priority_classes; i++) {
+			lanes[i].stride = (uint64_t{1} << 32) / std::max<uint32_t>(options.weights[i], 1);
+		}
+	}
+
+
+	queue::order_key queue::key_of(const entry& e) {
+		return {std::chrono::duration_cast<std::chrono::milliseconds>(e.due.time_since_epoch()).count(), e.sequence};
+	}
+
+
+	void queue::enqueue(uint64_t id, const entry& e) {
+		lane& l = lanes[static_cast<size_t>(e.submission.priority)];
+		if(l.order.empty()) {
+			l.pass = std::max(l.pass, global_pass);
+		}
+		// Most submissions get the default deadline and so go to the end, where the hint makes insertion O(1)
+		l.order.emplace_hint(l.order.end(), key_of(e), id);
+	}
+
+
 	uint64_t queue::add_submission(pending_addition_submission submission) {
-		return 0;
+		uint64_t id = next_id++;
+		add_submission(id, std::move(submission));
+		return id;
+	}
+
+
+	void queue::add_submission(uint64_t id, pending_addition_submission submission) {
+		uint64_t sequence = next_sequence++;
+		if(!submission.deadline) {
+			submission.deadline = std::chrono::system_clock::now() + options.default_deadline[static_cast<size_t>(submission.priority)];
+		}
+		auto due = *submission.deadline;
+		auto& e = entries.emplace(id, entry{std::move(submission), sequence, due}).first->second;
+		enqueue(id, e);
+	}
+
+
+	void queue::requeue(queued_submission submission) {
+		next_sequence = std::max(next_sequence, submission.sequence + 1);
+		if(!submission.submission.deadline) {
+			submission.submission.deadline = std::chrono::system_clock::now() + options.default_deadline[static_cast<size_t>(submission.submission.priority)];
+		}
+		auto due = *submission.submission.deadline;
+		auto& e = entries.emplace(submission.id, entry{std::move(submission.submission), submission.sequence, due}).first->second;
+		enqueue(submission.id, e);
+	}
+
+
+	void queue::age(std::chrono::system_clock::time_point now) {
+		for(size_t i = 1; i < n_priority_classes; i++) {
+			lane& l = lanes[i];
+			if(i == static_cast<size_t>(priority_class::rejudge) || options.aging_after[i] == std::chrono::milliseconds::max()) {
+				continue;
+			}
+			int64_t threshold = std::chrono::duration_cast<std::chrono::milliseconds>((now - options.aging_after[i]).time_since_epoch()).count();
+			while(!l.order.empty() && l.order.begin()->first.first < threshold) {
+				uint64_t id = l.order.begin()->second;
+				l.order.erase(l.order.begin());
+				entry& e = entries.at(id);
+				e.submission.priority = static_cast<priority_class>(i - 1);
+				e.due = now + options.default_deadline[i - 1];
+				enqueue(id, e);
+				aged++;
+			}
+		}
+	}
+
+
+	std::optional<queued_submission> queue::pop() {
+		age(std::chrono::system_clock::now());
+
+		lane* next = nullptr;
+		for(lane& l: lanes) {
+			if(!l.order.empty() && (!next || l.pass < next->pass)) {
+				next = &l;
+			}
+		}
+		if(!next) {
+			return std::nullopt;
+		}
+		global_pass = next->pass;
+		next->pass += next->stride;
+
+		uint64_t id = next->order.begin()->second;
+		next->order.erase(next->order.begin());
+		auto node = entries.extract(id);
+		return queued_submission{id, node.mapped().sequence, std::move(node.mapped().submission)};
+	}
+
+
+	bool queue::cancel(uint64_t id) {
+		auto it = entries.find(id);
+		if(it == entries.end()) {
+			return false;
+		}
+		lanes[static_cast<size_t>(it->second.submission.priority)].order.erase(key_of(it->second));
+		entries.erase(it);
+		return true;
+	}
+
+
+	bool queue::reprioritize(uint64_t id, priority_class priority) {
+		auto it = entries.find(id);
+		if(it == entries.end()) {
+			return false;
+		}
+		entry& e = it->second;
+		if(e.submission.priority == priority) {
+			return true;
+		}
+		lanes[static_cast<size_t>(e.submission.priority)].order.erase(key_of(e));
+		e.submission.priority = priority;
+		enqueue(id, e);
+		return true;
+	}
+
+
+	std::optional<queue_position> queue::locate(uint64_t id) const {
+		auto it = entries.find(id);
+		if(it == entries.end()) {
+			return std::nullopt;
+		}
+		return queue_position{it->second.submission.priority, it->second.sequence};
+	}
+
+
+	const pending_addition_submission* queue::find(uint64_t id) const {
+		auto it = entries.find(id);
+		return it == entries.end() ? nullptr : &it->second.submission;
+	}
+
+
+	void queue::for_each(const std::function<void(uint64_t, uint64_t, const pending_addition_submission&)>& visit) const {
+		for(auto& [id, e]: entries) {
+			visit(id, e.sequence, e.submission);
+		}
+	}
+
+
+	void queue::reserve(size_t n) {
+		entries.reserve(n);
+	}
+
+
+	size_t queue::size() const {
+		return entries.size();
+	}
+
+
+	size_t queue::size(priority_class priority) const {
+		return lanes[static_cast<size_t>(priority)].order.size();
+	}
+
+
+	bool queue::empty() const {
+		return entries.empty();
 	}
 }
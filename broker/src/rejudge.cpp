@@ -0,0 +1,153 @@
+#include <iostream>
+
+#include "rejudge.hpp"
+
+
+namespace broker {
+	rejudge_lane::rejudge_lane(dispatcher& judge, double headroom): judge(judge) {
+		judge.set_rejudge_headroom(headroom);
+	}
+
+
+	uint64_t rejudge_lane::start(rejudge_query query) {
+		uint64_t rejudge_id = next_rejudge_id++;
+		rejudges[rejudge_id].query = query;
+		std::cerr << "Rejudge #" << rejudge_id << " of problem " << query.problem_id << ", submissions " << query.first_submission_id << " to " << query.last_submission_id << " started" << std::endl;
+		return rejudge_id;
+	}
+
+
+	bool rejudge_lane::feed(uint64_t rejudge_id, std::vector<rejudge_item> items, bool is_last) {
+		auto it = rejudges.find(rejudge_id);
+		if(it == rejudges.end() || it->second.is_fed) {
+			return false;
+		}
+		auto& r = it->second;
+		for(auto& item: items) {
+			if(item.request.problem_id == r.query.problem_id && item.submission_id >= r.query.first_submission_id && item.submission_id <= r.query.last_submission_id) {
+				r.waiting.push_back(std::move(item));
+				r.n_fed++;
+			}
+		}
+		r.is_fed = is_last;
+		maybe_complete(it);
+		pump();
+		return true;
+	}
+
+
+	bool rejudge_lane::set_paused(uint64_t rejudge_id, bool is_paused) {
+		auto it = rejudges.find(rejudge_id);
+		if(it == rejudges.end()) {
+			return false;
+		}
+		it->second.is_paused = is_paused;
+		pump();
+		return true;
+	}
+
+
+	std::optional<rejudge_progress> rejudge_lane::progress(uint64_t rejudge_id) {
+		auto it = rejudges.find(rejudge_id);
+		if(it == rejudges.end()) {
+			auto done = completed.find(rejudge_id);
+			if(done == completed.end()) {
+				return std::nullopt;
+			}
+			return done->second;
+		}
+		return progress_of(it->second);
+	}
+
+
+	rejudge_progress rejudge_lane::progress_of(rejudge& r) {
+		forget_old_finishes(r, clock::now());
+		return rejudge_progress{r.query, r.n_fed, r.waiting.size(), r.n_running, r.n_finished, r.recent_finishes.size(), r.is_paused, r.is_fed && r.waiting.empty() && r.n_running == 0};
+	}
+
+
+	bool rejudge_lane::watch(uint64_t rejudge_id, event_fn on_event) {
+		auto it = rejudges.find(rejudge_id);
+		if(it == rejudges.end() || (it->second.is_fed && it->second.waiting.empty() && it->second.n_running == 0)) {
+			return false;
+		}
+		it->second.watchers.push_back(std::move(on_event));
+		return true;
+	}
+
+
+	void rejudge_lane::pump() {
+		if(is_pumping) {
+			return;
+		}
+		is_pumping = true;
+		uint64_t reserved = judge.reserved_slots();
+		auto it = rejudges.begin();
+		while(it != rejudges.end() && judge.free_slots() > reserved && n_running + reserved < judge.total_slots()) {
+			auto& [rejudge_id, r] = *it;
+			if(r.is_paused || r.waiting.empty()) {
+				++it;
+				continue;
+			}
+			rejudge_item item = std::move(r.waiting.front());
+			r.waiting.pop_front();
+			r.n_running++;
+			n_running++;
+			auto& request = item.request;
+			pending_addition_submission pending{request.problem_id, request.language_id, std::move(request.source), priority_class::rejudge, request.n_tests, request.stops_at_first_failure};
+			if(request.deadline != 0) {
+				pending.deadline = std::chrono::system_clock::time_point{std::chrono::milliseconds{request.deadline}};
+			}
+			uint64_t current = rejudge_id;
+			judge.submit(std::move(pending), [this, rejudge_id = rejudge_id, submission_id = item.submission_id](uint64_t, std::optional<submission_result> result) {
+				finished(rejudge_id, submission_id, std::move(result));
+			});
+			// A submission that finished right away may have completed the rejudge, which is then gone
+			it = rejudges.lower_bound(current);
+		}
+		is_pumping = false;
+	}
+
+
+	void rejudge_lane::finished(uint64_t rejudge_id, uint64_t submission_id, std::optional<submission_result> result) {
+		n_running--;
+		auto it = rejudges.find(rejudge_id);
+		auto& r = it->second;
+		r.n_running--;
+		r.n_finished++;
+		auto now = clock::now();
+		r.recent_finishes.push_back(now);
+		forget_old_finishes(r, now);
+		if(result) {
+			for(auto& on_event: r.watchers) {
+				on_event(rejudge_event{submission_id, *result});
+			}
+		}
+		maybe_complete(it);
+		pump();
+	}
+
+
+	void rejudge_lane::maybe_complete(std::map<uint64_t, rejudge>::iterator it) {
+		auto& r = it->second;
+		if(!r.is_fed || !r.waiting.empty() || r.n_running > 0) {
+			return;
+		}
+		completed.emplace(it->first, progress_of(r));
+		if(completed.size() > max_completed) {
+			completed.erase(completed.begin());
+		}
+		auto watchers = std::move(r.watchers);
+		rejudges.erase(it);
+		for(auto& on_event: watchers) {
+			on_event(std::nullopt);
+		}
+	}
+
+
+	void rejudge_lane::forget_old_finishes(rejudge& r, clock::time_point now) {
+		while(!r.recent_finishes.empty() && now - r.recent_finishes.front() > std::chrono::minutes{1}) {
+			r.recent_finishes.pop_front();
+		}
+	}
+}
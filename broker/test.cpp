@@ -0,0 +1,134 @@
+#include <array>
+#include <chrono>
+#include <iostream>
+#include <optional>
+#include <string>
+
+#include "queue.hpp"
+
+
+using namespace std::chrono_literals;
+
+
+int n_failed = 0;
+
+void check(bool condition, const std::string& what) {
+	if(!condition) {
+		std::cerr << "FAILED: " << what << std::endl;
+		n_failed++;
+	}
+}
+
+
+broker::pending_addition_submission make_submission(broker::priority_class priority, std::optional<std::chrono::system_clock::time_point> deadline = std::nullopt) {
+	return {1, 1, {}, priority, 1, false, deadline};
+}
+
+
+// With every class backlogged, dequeues are split by the weights, give or take one per class
+void test_weighted_share() {
+	broker::queue q;
+	for(int i = 0; i < 1000; i++) {
+		for(auto priority: {broker::priority_class::live, broker::priority_class::practice, broker::priority_class::rejudge}) {
+			q.add_submission(make_submission(priority));
+		}
+	}
+	std::array<int, broker::n_priority_classes> served{};
+	for(int i = 0; i < 210; i++) {
+		served[static_cast<size_t>(q.pop()->submission.priority)]++;
+	}
+	check(served[0] >= 159 && served[0] <= 161, "live gets 16/21 of the dequeues, got " + std::to_string(served[0]));
+	check(served[1] >= 39 && served[1] <= 41, "practice gets 4/21 of the dequeues, got " + std::to_string(served[1]));
+	check(served[2] >= 9 && served[2] <= 11, "rejudge gets 1/21 of the dequeues, got " + std::to_string(served[2]));
+
+	// A class that was idle does not get a burst of the turns it missed
+	broker::queue idle;
+	for(int i = 0; i < 100; i++) {
+		idle.add_submission(make_submission(broker::priority_class::live));
+	}
+	for(int i = 0; i < 50; i++) {
+		idle.pop();
+	}
+	for(int i = 0; i < 10; i++) {
+		idle.add_submission(make_submission(broker::priority_class::rejudge));
+	}
+	int n_rejudges = 0;
+	for(int i = 0; i < 34; i++) {
+		n_rejudges += idle.pop()->submission.priority == broker::priority_class::rejudge;
+	}
+	check(n_rejudges <= 3, "rejudges arriving late get their share only, got " + std::to_string(n_rejudges) + " of 34");
+}
+
+
+void test_cancel_and_reprioritize() {
+	auto now = std::chrono::system_clock::now();
+	broker::queue q;
+	uint64_t a = q.add_submission(make_submission(broker::priority_class::practice));
+	uint64_t b = q.add_submission(make_submission(broker::priority_class::practice));
+	uint64_t c = q.add_submission(make_submission(broker::priority_class::practice));
+
+	check(q.cancel(b), "cancel finds a waiting submission");
+	check(!q.cancel(b), "cancel fails the second time");
+	check(!q.locate(b) && !q.find(b), "a cancelled submission is gone");
+	check(q.size() == 2 && q.size(broker::priority_class::practice) == 2, "cancel shrinks the queue");
+
+	check(q.reprioritize(c, broker::priority_class::live), "reprioritize finds a waiting submission");
+	check(!q.reprioritize(b, broker::priority_class::live), "reprioritize fails for a cancelled submission");
+	check(q.locate(c)->priority == broker::priority_class::live, "reprioritize moves the submission to the new class");
+	check(q.locate(c)->sequence > q.locate(a)->sequence, "reprioritize keeps the sequence number");
+	check(q.pop()->id == c, "the reprioritized submission goes first");
+	check(q.pop()->id == a, "the rest follows");
+	check(q.empty(), "nothing is left");
+
+	// Within a class the earliest deadline goes first, and reprioritizing keeps the deadline
+	uint64_t late = q.add_submission(make_submission(broker::priority_class::live, now + 30s));
+	uint64_t early = q.add_submission(make_submission(broker::priority_class::practice, now + 10s));
+	q.reprioritize(early, broker::priority_class::live);
+	check(q.pop()->id == early, "an earlier deadline goes ahead after reprioritization");
+	check(q.pop()->id == late, "a later deadline follows");
+}
+
+
+void test_aging() {
+	auto now = std::chrono::system_clock::now();
+	broker::queue_options options;
+	options.aging_after = {std::chrono::milliseconds::max(), 10min, 1h};
+	broker::queue q(options);
+
+	// Overdue long enough, a practice submission moves up to live, which serves it first despite its arrival order
+	uint64_t live = q.add_submission(make_submission(broker::priority_class::live, now + 1h));
+	uint64_t practice = q.add_submission(make_submission(broker::priority_class::practice, now - 1h));
+	// Rejudges never age, whatever the options say
+	uint64_t rejudge = q.add_submission(make_submission(broker::priority_class::rejudge, now - 5h));
+
+	auto first = q.pop();
+	check(first->id == practice, "an aged submission goes first");
+	check(first->submission.priority == broker::priority_class::live, "an aged submission moves up one class");
+	check(*first->submission.deadline == now - 1h, "aging keeps the original deadline");
+	check(q.locate(rejudge)->priority == broker::priority_class::rejudge, "rejudges do not age");
+	check(q.n_aged() == 1, "one submission aged, counted " + std::to_string(q.n_aged()));
+
+	// The aged submission is due by the deadline of its new class from the move, so it does not pass live submissions
+	// that are overdue already
+	broker::queue ordered(options);
+	uint64_t overdue_live = ordered.add_submission(make_submission(broker::priority_class::live, now - 2min));
+	uint64_t aged = ordered.add_submission(make_submission(broker::priority_class::practice, now - 1h));
+	check(ordered.pop()->id == overdue_live, "an overdue live submission stays ahead of an aged one");
+	check(ordered.pop()->id == aged, "the aged one follows");
+	uint64_t second = q.pop()->id;
+	uint64_t third = q.pop()->id;
+	check(second != third && (second == live || second == rejudge) && (third == live || third == rejudge) && q.empty(), "the rest is served");
+}
+
+
+int main() {
+	test_weighted_share();
+	test_cancel_and_reprioritize();
+	test_aging();
+	if(n_failed > 0) {
+		std::cerr << n_failed << " checks failed" << std::endl;
+		return 1;
+	}
+	std::cout << "All checks passed" << std::endl;
+	return 0;
+}
@@ -0,0 +1,170 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include <uvw.hpp>
+
+#include "journal.hpp"
+
+
+// Measures how long a restarted broker takes to replay a journal of n_submissions, and checks what replay recovers: the
+// live submissions with their deadlines and priorities, a torn record at the end, and ids that compaction must not let
+// be reused.
+
+
+int n_failed = 0;
+
+void check(bool condition, const std::string& what) {
+	if(!condition) {
+		std::cerr << "FAILED: " << what << std::endl;
+		n_failed++;
+	}
+}
+
+
+std::chrono::system_clock::time_point deadline_of(uint64_t id) {
+	return std::chrono::system_clock::time_point{std::chrono::milliseconds{1'600'000'000'000 + static_cast<int64_t>(id) * 1000}};
+}
+
+
+// Odd ids have a deadline
+broker::pending_addition_submission make_submission(uint64_t id, const std::vector<std::byte>& source) {
+	broker::pending_addition_submission submission{id, id % 4, rpc::blob{nullptr, source.data(), source.size()}, broker::priority_class::practice, 10, false};
+	if(id % 2 == 1) {
+		submission.deadline = deadline_of(id);
+	}
+	return submission;
+}
+
+
+// Every third submission is finished, every fifth one is dispatched, and every seventh is reprioritized to live
+void fill(const std::filesystem::path& path, uint64_t n_submissions, size_t source_size) {
+	std::filesystem::remove(path);
+	broker::journal log(path, uint64_t{1} << 62);
+	log.replay();
+	std::vector<std::byte> source(source_size, std::byte{'x'});
+	for(uint64_t id = 1; id <= n_submissions; id++) {
+		log.add(id, id, make_submission(id, source));
+		if(id % 5 == 0) {
+			log.dispatch(id);
+		}
+		if(id % 7 == 0) {
+			log.reprioritize(id, broker::priority_class::live);
+		}
+		if(id % 3 == 0) {
+			log.finish(id, verdict::accepted);
+		}
+	}
+	log.sync();
+	uvw::Loop::getDefault()->run();
+}
+
+
+// Submissions after last_id must have been finished as well
+void check_recovered(const broker::recovered_state& state, uint64_t last_id) {
+	size_t n_live = 0;
+	size_t n_dispatched = 0;
+	for(uint64_t id = 1; id <= last_id; id++) {
+		n_live += id % 3 != 0;
+		n_dispatched += id % 5 == 0 && id % 3 != 0;
+	}
+	check(state.submissions.size() == n_live, "finished submissions are dropped, " + std::to_string(state.submissions.size()) + " recovered");
+	check(state.n_dispatched == n_dispatched, "dispatched submissions are counted");
+	size_t n_wrong = 0;
+	for(auto& recovered: state.submissions) {
+		auto& submission = recovered.submission;
+		n_wrong += submission.problem_id != recovered.id || recovered.sequence != recovered.id;
+		n_wrong += submission.priority != (recovered.id % 7 == 0 ? broker::priority_class::live : broker::priority_class::practice);
+		n_wrong += recovered.id % 2 == 1 ? submission.deadline != deadline_of(recovered.id) : submission.deadline.has_value();
+	}
+	check(n_wrong == 0, std::to_string(n_wrong) + " fields recovered wrong");
+}
+
+
+int main(int argc, char** argv) {
+	if(argc < 2) {
+		std::cerr << "Usage: " << argv[0] << " <scratch_dir> [n_submissions] [source_size]" << std::endl;
+		return 1;
+	}
+	std::filesystem::path dir = argv[1];
+	uint64_t n_submissions = argc > 2 ? std::stoull(argv[2]) : 1'000'000;
+	size_t source_size = argc > 3 ? std::stoull(argv[3]) : 100;
+	std::filesystem::remove_all(dir);
+	std::filesystem::create_directories(dir);
+	auto path = dir / "queue.journal";
+
+	fill(path, n_submissions, source_size);
+	auto file_size = std::filesystem::file_size(path);
+	{
+		broker::journal log(path, uint64_t{1} << 62);
+		auto started = std::chrono::steady_clock::now();
+		auto state = log.replay();
+		auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+		std::cout << "Replayed " << file_size / (1024 * 1024) << " MiB, " << state.submissions.size() << " live submissions in " << elapsed.count() << " ms" << std::endl;
+		check_recovered(state, n_submissions);
+		check(state.next_submission_id == n_submissions + 1, "the next id follows the last one");
+	}
+
+	// A record cut short by a crash is dropped, together with nothing before it
+	check(truncate(path.c_str(), file_size - 3) == 0, "truncate the journal");
+	{
+		broker::journal log(path, uint64_t{1} << 62);
+		auto state = log.replay();
+		// The last record is the add of the last submission, or its dispatch, reprioritization or finish
+		check(state.submissions.size() + 1 >= n_submissions - n_submissions / 3 && state.submissions.size() <= n_submissions - n_submissions / 3 + 1, "a torn record loses the last record only");
+		check(std::filesystem::file_size(path) < file_size - 3, "the torn record is cut off the file");
+		std::vector<std::byte> source(source_size, std::byte{'y'});
+		log.add(n_submissions + 1, n_submissions + 1, make_submission(n_submissions + 1, source));
+	}
+	{
+		broker::journal log(path, uint64_t{1} << 62);
+		auto state = log.replay();
+		check(std::any_of(state.submissions.begin(), state.submissions.end(), [&](auto& recovered) { return recovered.id == n_submissions + 1; }), "a record appended after the cut is recovered");
+	}
+
+	// Compaction keeps the live submissions only, and a watermark so that the ids of the finished ones stay used even
+	// when they were the last ones
+	fill(path, n_submissions, source_size);
+	uint64_t last_live_id = n_submissions > 10 ? n_submissions - 10 : 0;
+	{
+		broker::journal log(path, 0);
+		auto state = log.replay();
+		std::vector<broker::queued_submission> live;
+		for(auto& recovered: state.submissions) {
+			if(recovered.id <= last_live_id) {
+				live.push_back(std::move(recovered));
+			} else {
+				log.finish(recovered.id, verdict::accepted);
+			}
+		}
+		log.compact(n_submissions + 1, [&](const broker::journal::entry_fn& write) {
+			for(auto& recovered: live) {
+				write(recovered.id, recovered.sequence, recovered.submission, recovered.id % 5 == 0);
+			}
+		});
+		uvw::Loop::getDefault()->run();
+	}
+	check(std::filesystem::file_size(path) < file_size, "compaction shrinks the journal");
+	{
+		broker::journal log(path, uint64_t{1} << 62);
+		auto started = std::chrono::steady_clock::now();
+		auto state = log.replay();
+		auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+		std::cout << "Replayed the compacted journal, " << state.submissions.size() << " live submissions in " << elapsed.count() << " ms" << std::endl;
+		check(state.next_submission_id == n_submissions + 1, "the watermark keeps the ids of finished submissions used, next is " + std::to_string(state.next_submission_id));
+		check_recovered(state, last_live_id);
+	}
+
+	std::filesystem::remove_all(dir);
+	if(n_failed > 0) {
+		std::cerr << n_failed << " checks failed" << std::endl;
+		return 1;
+	}
+	return 0;
+}
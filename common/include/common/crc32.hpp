@@ -0,0 +1,52 @@
+#ifndef COMMON_CRC32_HPP
+#define COMMON_CRC32_HPP
+
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+
+// CRC-32 as used by zlib, for telling intact journal records from torn ones. Slicing-by-8: eight bytes per step using
+// eight tables, about five times as fast as the bytewise loop, which matters when a journal of hundreds of megabytes is
+// replayed at startup.
+namespace crc32 {
+	inline constexpr std::array<std::array<uint32_t, 256>, 8> tables = []() {
+		std::array<std::array<uint32_t, 256>, 8> tables{};
+		for(uint32_t i = 0; i < 256; i++) {
+			uint32_t value = i;
+			for(int bit = 0; bit < 8; bit++) {
+				value = value & 1 ? (value >> 1) ^ 0xedb88320 : value >> 1;
+			}
+			tables[0][i] = value;
+		}
+		for(uint32_t i = 0; i < 256; i++) {
+			for(size_t k = 1; k < 8; k++) {
+				tables[k][i] = (tables[k - 1][i] >> 8) ^ tables[0][tables[k - 1][i] & 0xff];
+			}
+		}
+		return tables;
+	}();
+
+	// Pass the previous result as crc to continue a checksum over several pieces
+	inline uint32_t update(uint32_t crc, const void* data, size_t size) {
+		const uint8_t* ptr = static_cast<const uint8_t*>(data);
+		crc = ~crc;
+		for(; size >= 8; ptr += 8, size -= 8) {
+			uint32_t low, high;
+			std::memcpy(&low, ptr, 4);
+			std::memcpy(&high, ptr + 4, 4);
+			// The tables assume little-endian loads
+			low ^= crc;
+			crc = tables[7][low & 0xff] ^ tables[6][(low >> 8) & 0xff] ^ tables[5][(low >> 16) & 0xff] ^ tables[4][low >> 24] ^ tables[3][high & 0xff] ^ tables[2][(high >> 8) & 0xff] ^ tables[1][(high >> 16) & 0xff] ^ tables[0][high >> 24];
+		}
+		for(; size > 0; ptr++, size--) {
+			crc = tables[0][(crc ^ *ptr) & 0xff] ^ (crc >> 8);
+		}
+		return ~crc;
+	}
+}
+
+
+#endif
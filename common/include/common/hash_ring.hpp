@@ -0,0 +1,67 @@
+#ifndef COMMON_HASH_RING_HPP
+#define COMMON_HASH_RING_HPP
+
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common/sha256.hpp"
+
+
+// Consistent hashing of registry keys onto nodes. Every node is placed at many pseudo-random points of a 64-bit ring,
+// and a key belongs to the nodes of the first points at or after its hash. Adding or removing one of N nodes moves
+// only the keys next to that node's points, about 1/N of all keys, and the virtual nodes keep the shares even.
+class hash_ring {
+	std::vector<std::pair<uint64_t, size_t>> points;
+	size_t n_nodes;
+
+	static uint64_t hash(const std::string& text) {
+		sha256::digest digest = sha256::hash(text.data(), text.size());
+		uint64_t result;
+		std::memcpy(&result, digest.data(), sizeof(result));
+		return result;
+	}
+
+public:
+	explicit hash_ring(const std::vector<std::string>& nodes, size_t n_virtual_nodes = 160): n_nodes(nodes.size()) {
+		// Points depend on the node's address only, so every client builds the same ring from the same list
+		for(size_t node = 0; node < nodes.size(); node++) {
+			for(size_t i = 0; i < n_virtual_nodes; i++) {
+				points.emplace_back(hash(nodes[node] + "#" + std::to_string(i)), node);
+			}
+		}
+		std::sort(points.begin(), points.end());
+	}
+
+	// Up to n distinct nodes responsible for the key, the primary one first
+	std::vector<size_t> owners(const std::string& data_class, uint64_t id, size_t n) const {
+		std::vector<size_t> result;
+		if(points.empty()) {
+			return result;
+		}
+		n = std::min(n, n_nodes);
+		uint64_t key_hash = hash(data_class + "/" + std::to_string(id));
+		auto it = std::lower_bound(points.begin(), points.end(), std::pair<uint64_t, size_t>{key_hash, 0});
+		for(size_t i = 0; i < points.size() && result.size() < n; i++, it++) {
+			if(it == points.end()) {
+				it = points.begin();
+			}
+			if(std::find(result.begin(), result.end(), it->second) == result.end()) {
+				result.push_back(it->second);
+			}
+		}
+		return result;
+	}
+
+	size_t size() const {
+		return n_nodes;
+	}
+};
+
+
+#endif
@@ -2,21 +2,194 @@
 #define COMMON_REGISTER_HPP
 
 
+#include <chrono>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <filesystem>
+#include <list>
+#include <map>
+#include <memory>
 #include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 
+#include <uvw.hpp>
+
 #include "common/async.hpp"
+#include "common/hash_ring.hpp"
+#include "common/sha256.hpp"
+#include "registry/protocol.hpp"
 #include "rpc/client.hpp"
 
 
+// Keys are spread over nodes by consistent hashing, each stored on n_replicas of them. Nodes that are being drained by
+// the rebalancing tool are not in the ring anymore but are still asked for keys the ring nodes do not have yet.
+struct registry_cluster_options {
+	std::vector<std::string> nodes;
+	std::vector<std::string> draining_nodes;
+	size_t n_replicas = 1;
+	// A read that a node does not answer within this goes to the next node, and a download that stalls for this long
+	// fails, since calls in flight when a connection drops are never answered
+	std::chrono::milliseconds timeout{30000};
+};
+
+
+// Objects that are looked up by what produced them, e.g. a verdict by the submission, are keyed by a SHA-256 of those
+// inputs and stored under an id made of its first eight bytes, together with the full key to rule out collisions. Every
+// variable-length field is preceded by its length, so that different inputs never hash the same bytes.
+class registry_key_hasher {
+	sha256::hasher h;
+
+public:
+	// The tag tells apart the kinds of objects and versions of their keys
+	explicit registry_key_hasher(std::string_view tag) {
+		h.update(tag.data(), tag.size());
+	}
+
+	registry_key_hasher& number(uint64_t value) {
+		h.update(&value, sizeof(value));
+		return *this;
+	}
+
+	registry_key_hasher& bytes(const void* data, size_t size) {
+		number(size);
+		h.update(data, size);
+		return *this;
+	}
+
+	sha256::digest finish() {
+		return h.finish();
+	}
+
+	static uint64_t id_of(const sha256::digest& key) {
+		uint64_t id;
+		std::memcpy(&id, key.data(), sizeof(id));
+		return id;
+	}
+};
+
+
+// Requests to a registry node that went away are never answered, so whoever cannot wait forever takes fallback once
+// timeout passes
+template<typename T> async::promise<T> with_timeout(async::promise<T> request, T fallback, std::chrono::milliseconds timeout) {
+	async::promise<T> result;
+	auto is_over = std::make_shared<bool>(false);
+	auto timer = uvw::Loop::getDefault()->resource<uvw::TimerHandle>();
+	timer->on<uvw::TimerEvent>([result, is_over, fallback](const uvw::TimerEvent&, uvw::TimerHandle& timer) mutable {
+		timer.close();
+		*is_over = true;
+		result.set(std::move(fallback));
+	});
+	timer->start(timeout, std::chrono::milliseconds{0});
+	request | [result, is_over, timer](T value) mutable {
+		if(*is_over) {
+			return;
+		}
+		*is_over = true;
+		timer->close();
+		result.set(std::move(value));
+	};
+	return result;
+}
+
+
+// Same for chunks that follow retrieve_stream: a stream that stays silent for timeout ends as if the object was missing
+rpc::stream<std::optional<std::vector<std::byte>>> with_timeout(rpc::stream<std::optional<std::vector<std::byte>>> chunks, std::chrono::milliseconds timeout);
+
+
+struct registry_cache_options {
+	std::filesystem::path directory;
+	uint64_t size_limit;
+};
+
+
+// Objects downloaded from the registry, kept on local disk across restarts. Files are named by their SHA-256, so the
+// same test shared by several problems is stored once. Least recently used files are removed once the total size
+// exceeds the limit; the order survives restarts because every use bumps the file's mtime.
+class registry_disk_cache {
+	struct entry {
+		std::list<sha256::digest>::iterator lru_position;
+		uint64_t size;
+	};
+
+	std::filesystem::path root;
+	uint64_t size_limit;
+	uint64_t total_size = 0;
+	std::list<sha256::digest> lru;
+	std::map<sha256::digest, entry> entries;
+	uint64_t next_tmp_id = 0;
+
+	std::filesystem::path object_path(const sha256::digest& digest) const;
+	void evict();
+
+public:
+	registry_disk_cache(registry_cache_options options);
+
+	std::optional<std::filesystem::path> lookup(const sha256::digest& digest);
+	// Moves a downloaded file into the cache
+	std::filesystem::path insert(const sha256::digest& digest, const std::filesystem::path& downloaded, uint64_t size);
+	std::filesystem::path tmp_path();
+};
+
+
+// Client of a registry cluster. Writes go to every replica of the key; reads go to the least loaded replica and fall
+// back to the other nodes if it does not have the key, which happens while keys are being moved after the ring changed.
+//
+// Objects fetched with fetch() or link_into() go through the disk cache: the registry is only asked for the object's
+// digest, and the contents are downloaded only if no file with that digest is cached yet.
 class registry {
+	class client_impl: public rpc::simplex_impl<client_impl, rpc::EmptyProtocol> {
+	};
+
+	struct node {
+		rpc::client<registry_protocol, client_impl> client;
+		size_t n_in_flight = 0;
+
+		explicit node(std::string address): client(std::move(address)) {
+		}
+	};
+
+	std::vector<std::unique_ptr<node>> nodes;
+	hash_ring ring;
+	size_t n_replicas;
+	std::chrono::milliseconds timeout;
+
+	std::optional<registry_disk_cache> cache;
+	std::map<sha256::digest, std::vector<async::promise<std::optional<std::filesystem::path>>>> downloads;
+
+	std::vector<size_t> read_order(const std::string& data_class, uint64_t id) const;
+	template<typename T, typename Request> void read_from(std::shared_ptr<const std::vector<size_t>> order, size_t i, Request request, async::promise<std::pair<size_t, std::optional<T>>> result);
+	template<typename T, typename Request> async::promise<std::pair<size_t, std::optional<T>>> read(const std::string& data_class, uint64_t id, Request request);
+	async::promise<std::optional<std::pair<sha256::digest, std::filesystem::path>>> receive(rpc::stream<std::optional<std::vector<std::byte>>> chunks, std::string description);
+	void download(size_t node_index, std::string data_class, uint64_t id, sha256::digest digest);
+
 public:
-	registry(const std::filesystem::path& path);
+	explicit registry(registry_cluster_options cluster_options, std::optional<registry_cache_options> cache_options = std::nullopt);
+
+	void stop();
+
+	async::promise<bool> store(std::string data_class, uint64_t id, std::vector<std::byte> data);
+	async::promise<std::optional<std::vector<std::byte>>> retrieve(std::string data_class, uint64_t id);
+	// An answer that takes longer than timeout counts as a miss
+	async::promise<std::optional<std::vector<std::byte>>> retrieve(std::string data_class, uint64_t id, std::chrono::milliseconds timeout);
+	// Asks the primary owner of the key, see registry_protocol::claim
+	async::promise<bool> claim(std::string data_class, uint64_t id, std::chrono::milliseconds ttl);
+	// nullopt if the owner does not answer within timeout
+	async::promise<std::optional<bool>> claim(std::string data_class, uint64_t id, std::chrono::milliseconds ttl, std::chrono::milliseconds timeout);
 
-	async::promise<void> store(const std::string& data_class, uint64_t id, const std::vector<std::byte>& data);
-	async::promise<std::optional<std::vector<std::byte>>> retrieve(const std::string& data_class, uint64_t id);
+	// Path to an up-to-date cached copy of the object. The file is read-only and may be removed by a later fetch once
+	// it is evicted, so it should be linked or opened right away.
+	async::promise<std::optional<std::filesystem::path>> fetch(std::string data_class, uint64_t id);
+	// Caches an object received from elsewhere, e.g. from another invoker, without asking the registry. The chunks
+	// follow retrieve_stream: a single nullopt if the sender does not have the object. A later fetch() of the key finds
+	// the file by its digest.
+	async::promise<std::optional<std::filesystem::path>> fetch_from(rpc::stream<std::optional<std::vector<std::byte>>> chunks, std::string data_class, uint64_t id);
+	// Places the object at target, e.g. inside a sandbox, by hard-linking the cached file. Falls back to a reflink and
+	// then to a copy if target is on another filesystem. Resolves to false if there is no such object.
+	async::promise<bool> link_into(std::string data_class, uint64_t id, std::filesystem::path target);
 };
 
 
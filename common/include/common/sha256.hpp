@@ -0,0 +1,156 @@
+#ifndef COMMON_SHA256_HPP
+#define COMMON_SHA256_HPP
+
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string>
+
+
+namespace sha256 {
+	using digest = std::array<uint8_t, 32>;
+
+
+	class hasher {
+		static constexpr uint32_t k[64] = {
+			0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+			0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+			0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+			0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+			0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+			0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+			0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+			0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+		};
+
+		uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+		uint8_t block[64];
+		size_t block_size = 0;
+		uint64_t total_size = 0;
+
+		static uint32_t rotr(uint32_t x, int n) {
+			return (x >> n) | (x << (32 - n));
+		}
+
+		void compress(const uint8_t* chunk) {
+			uint32_t w[64];
+			for(int i = 0; i < 16; i++) {
+				w[i] = (uint32_t{chunk[i * 4]} << 24) | (uint32_t{chunk[i * 4 + 1]} << 16) | (uint32_t{chunk[i * 4 + 2]} << 8) | uint32_t{chunk[i * 4 + 3]};
+			}
+			for(int i = 16; i < 64; i++) {
+				uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+				uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+				w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+			}
+
+			uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+			for(int i = 0; i < 64; i++) {
+				uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+				uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+				h = g;
+				g = f;
+				f = e;
+				e = d + t1;
+				d = c;
+				c = b;
+				b = a;
+				a = t1 + t2;
+			}
+			state[0] += a;
+			state[1] += b;
+			state[2] += c;
+			state[3] += d;
+			state[4] += e;
+			state[5] += f;
+			state[6] += g;
+			state[7] += h;
+		}
+
+	public:
+		void update(const void* data, size_t size) {
+			const uint8_t* ptr = static_cast<const uint8_t*>(data);
+			total_size += size;
+			if(block_size > 0) {
+				size_t n = std::min(size, 64 - block_size);
+				std::memcpy(block + block_size, ptr, n);
+				block_size += n;
+				ptr += n;
+				size -= n;
+				if(block_size < 64) {
+					return;
+				}
+				compress(block);
+				block_size = 0;
+			}
+			for(; size >= 64; ptr += 64, size -= 64) {
+				compress(ptr);
+			}
+			std::memcpy(block, ptr, size);
+			block_size = size;
+		}
+
+		digest finish() {
+			uint64_t bit_size = total_size * 8;
+			uint8_t padding[72] = {0x80};
+			size_t padding_size = (block_size < 56 ? 56 : 120) - block_size;
+			for(int i = 0; i < 8; i++) {
+				padding[padding_size + i] = static_cast<uint8_t>(bit_size >> (56 - i * 8));
+			}
+			update(padding, padding_size + 8);
+
+			digest result;
+			for(int i = 0; i < 8; i++) {
+				result[i * 4] = static_cast<uint8_t>(state[i] >> 24);
+				result[i * 4 + 1] = static_cast<uint8_t>(state[i] >> 16);
+				result[i * 4 + 2] = static_cast<uint8_t>(state[i] >> 8);
+				result[i * 4 + 3] = static_cast<uint8_t>(state[i]);
+			}
+			return result;
+		}
+	};
+
+
+	inline digest hash(const void* data, size_t size) {
+		hasher h;
+		h.update(data, size);
+		return h.finish();
+	}
+
+
+	inline std::string to_hex(const digest& value) {
+		static constexpr char digits[] = "0123456789abcdef";
+		std::string result(value.size() * 2, '0');
+		for(size_t i = 0; i < value.size(); i++) {
+			result[i * 2] = digits[value[i] >> 4];
+			result[i * 2 + 1] = digits[value[i] & 15];
+		}
+		return result;
+	}
+
+
+	inline std::optional<digest> from_hex(const std::string& text) {
+		if(text.size() != 64) {
+			return std::nullopt;
+		}
+		auto value_of = [](char c) {
+			return '0' <= c && c <= '9' ? c - '0' : 'a' <= c && c <= 'f' ? c - 'a' + 10 : -1;
+		};
+		digest result;
+		for(size_t i = 0; i < result.size(); i++) {
+			int high = value_of(text[i * 2]);
+			int low = value_of(text[i * 2 + 1]);
+			if(high == -1 || low == -1) {
+				return std::nullopt;
+			}
+			result[i] = static_cast<uint8_t>(high << 4 | low);
+		}
+		return result;
+	}
+}
+
+
+#endif
@@ -0,0 +1,439 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <system_error>
+#include <tuple>
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common/registry.hpp"
+
+
+namespace {
+	[[noreturn]] void throw_errno(const std::string& what, const std::filesystem::path& path) {
+		throw std::system_error(errno, std::generic_category(), what + " " + path.string());
+	}
+
+
+	void write_all(int fd, const std::byte* ptr, size_t left) {
+		while(left > 0) {
+			ssize_t n = write(fd, ptr, left);
+			if(n == -1) {
+				if(errno == EINTR) {
+					continue;
+				}
+				throw std::system_error(errno, std::generic_category(), "Could not write");
+			}
+			ptr += n;
+			left -= n;
+		}
+	}
+
+
+	void place_file(const std::filesystem::path& source, const std::filesystem::path& target) {
+		if(link(source.c_str(), target.c_str()) == 0) {
+			return;
+		}
+		if(errno != EXDEV && errno != EPERM) {
+			throw_errno("Could not link to", target);
+		}
+
+		// A different filesystem: a copy-on-write clone is nearly as cheap as a link where it is supported
+		int in = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+		if(in == -1) {
+			throw_errno("Could not open", source);
+		}
+		int out = open(target.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0444);
+		if(out == -1) {
+			int saved_errno = errno;
+			close(in);
+			errno = saved_errno;
+			throw_errno("Could not create", target);
+		}
+		bool is_cloned = ioctl(out, FICLONE, in) == 0;
+		close(in);
+		close(out);
+		if(!is_cloned) {
+			std::filesystem::copy_file(source, target, std::filesystem::copy_options::overwrite_existing);
+		}
+	}
+}
+
+
+
+registry_disk_cache::registry_disk_cache(registry_cache_options options): root(std::move(options.directory)), size_limit(options.size_limit) {
+	std::filesystem::create_directories(root / "objects");
+	// Leftovers from downloads interrupted by a restart
+	std::filesystem::remove_all(root / "tmp");
+	std::filesystem::create_directories(root / "tmp");
+
+	std::vector<std::tuple<std::filesystem::file_time_type, sha256::digest, uint64_t>> found;
+	for(auto& file: std::filesystem::recursive_directory_iterator(root / "objects")) {
+		if(!file.is_regular_file()) {
+			continue;
+		}
+		auto digest = sha256::from_hex(file.path().filename().string());
+		if(!digest || file.path() != object_path(*digest)) {
+			std::filesystem::remove(file.path());
+			continue;
+		}
+		found.emplace_back(file.last_write_time(), *digest, file.file_size());
+	}
+	std::sort(found.begin(), found.end());
+	for(auto& [mtime, digest, size]: found) {
+		lru.push_front(digest);
+		entries.emplace(digest, entry{lru.begin(), size});
+		total_size += size;
+	}
+	evict();
+}
+
+
+std::filesystem::path registry_disk_cache::object_path(const sha256::digest& digest) const {
+	std::string hex = sha256::to_hex(digest);
+	return root / "objects" / hex.substr(0, 2) / hex;
+}
+
+
+std::filesystem::path registry_disk_cache::tmp_path() {
+	return root / "tmp" / std::to_string(next_tmp_id++);
+}
+
+
+void registry_disk_cache::evict() {
+	// The most recent entry always stays, even if it alone is over the limit, since someone is about to use it. Files
+	// still linked into sandboxes keep taking space until the sandboxes are removed.
+	while(total_size > size_limit && lru.size() > 1) {
+		sha256::digest digest = lru.back();
+		lru.pop_back();
+		total_size -= entries.extract(digest).mapped().size;
+		std::filesystem::remove(object_path(digest));
+	}
+}
+
+
+std::optional<std::filesystem::path> registry_disk_cache::lookup(const sha256::digest& digest) {
+	auto it = entries.find(digest);
+	if(it == entries.end()) {
+		return std::nullopt;
+	}
+	std::filesystem::path path = object_path(digest);
+	if(utimensat(AT_FDCWD, path.c_str(), nullptr, 0) == -1) {
+		// Removed behind our back
+		lru.erase(it->second.lru_position);
+		total_size -= it->second.size;
+		entries.erase(it);
+		return std::nullopt;
+	}
+	lru.splice(lru.begin(), lru, it->second.lru_position);
+	return path;
+}
+
+
+std::filesystem::path registry_disk_cache::insert(const sha256::digest& digest, const std::filesystem::path& downloaded, uint64_t size) {
+	if(auto path = lookup(digest)) {
+		std::filesystem::remove(downloaded);
+		return *path;
+	}
+	std::filesystem::path path = object_path(digest);
+	std::filesystem::create_directories(path.parent_path());
+	std::filesystem::rename(downloaded, path);
+	lru.push_front(digest);
+	entries.emplace(digest, entry{lru.begin(), size});
+	total_size += size;
+	evict();
+	return path;
+}
+
+
+
+rpc::stream<std::optional<std::vector<std::byte>>> with_timeout(rpc::stream<std::optional<std::vector<std::byte>>> chunks, std::chrono::milliseconds timeout) {
+	rpc::stream<std::optional<std::vector<std::byte>>> result;
+	auto is_over = std::make_shared<bool>(false);
+	auto timer = uvw::Loop::getDefault()->resource<uvw::TimerHandle>();
+	timer->on<uvw::TimerEvent>([result, is_over](const uvw::TimerEvent&, uvw::TimerHandle& timer) mutable {
+		timer.close();
+		*is_over = true;
+		result.push(std::nullopt);
+		result.finish();
+	});
+	timer->start(timeout, std::chrono::milliseconds{0});
+	chunks.subscribe([timeout, result, is_over, timer](std::optional<std::vector<std::byte>> chunk) mutable {
+		if(*is_over) {
+			return;
+		}
+		timer->stop();
+		timer->start(timeout, std::chrono::milliseconds{0});
+		result.push(std::move(chunk));
+	}, [result, is_over, timer]() mutable {
+		if(*is_over) {
+			return;
+		}
+		*is_over = true;
+		timer->close();
+		result.finish();
+	});
+	return result;
+}
+
+
+
+registry::registry(registry_cluster_options cluster_options, std::optional<registry_cache_options> cache_options): ring(cluster_options.nodes), n_replicas(std::max<size_t>(cluster_options.n_replicas, 1)), timeout(cluster_options.timeout) {
+	// Ring nodes come first, so that the indices returned by the ring are indices into nodes
+	for(auto& address: cluster_options.nodes) {
+		nodes.push_back(std::make_unique<node>(address));
+	}
+	for(auto& address: cluster_options.draining_nodes) {
+		nodes.push_back(std::make_unique<node>(address));
+	}
+	if(cache_options) {
+		cache.emplace(std::move(*cache_options));
+	}
+}
+
+
+void registry::stop() {
+	for(auto& node: nodes) {
+		node->client.stop();
+	}
+}
+
+
+std::vector<size_t> registry::read_order(const std::string& data_class, uint64_t id) const {
+	std::vector<size_t> result = ring.owners(data_class, id, n_replicas);
+	std::stable_sort(result.begin(), result.end(), [&](size_t a, size_t b) {
+		return nodes[a]->n_in_flight < nodes[b]->n_in_flight;
+	});
+	// Everyone else, in case the key has not been moved to its owners yet. This makes reads of missing keys ask every
+	// node, but those are rare.
+	size_t n_owners = result.size();
+	for(size_t i = 0; i < nodes.size(); i++) {
+		if(std::find(result.begin(), result.begin() + n_owners, i) == result.begin() + n_owners) {
+			result.push_back(i);
+		}
+	}
+	return result;
+}
+
+
+template<typename T, typename Request> void registry::read_from(std::shared_ptr<const std::vector<size_t>> order, size_t i, Request request, async::promise<std::pair<size_t, std::optional<T>>> result) {
+	if(i == order->size()) {
+		result.set({0, std::nullopt});
+		return;
+	}
+	size_t node_index = (*order)[i];
+	nodes[node_index]->n_in_flight++;
+	with_timeout(request(nodes[node_index]->client), std::optional<T>{}, timeout) | [this, order, i, node_index, request, result](std::optional<T> value) mutable {
+		nodes[node_index]->n_in_flight--;
+		if(value) {
+			result.set({node_index, std::move(value)});
+		} else {
+			read_from<T>(std::move(order), i + 1, std::move(request), std::move(result));
+		}
+	};
+}
+
+
+// Resolves to the answer of the first node that has the key, along with that node's index
+template<typename T, typename Request> async::promise<std::pair<size_t, std::optional<T>>> registry::read(const std::string& data_class, uint64_t id, Request request) {
+	async::promise<std::pair<size_t, std::optional<T>>> result;
+	read_from<T>(std::make_shared<const std::vector<size_t>>(read_order(data_class, id)), 0, std::move(request), result);
+	return result;
+}
+
+
+async::promise<bool> registry::store(std::string data_class, uint64_t id, std::vector<std::byte> data) {
+	std::vector<size_t> owners = ring.owners(data_class, id, n_replicas);
+	if(owners.empty()) {
+		throw std::logic_error("The registry cluster has no nodes");
+	}
+	async::promise<bool> result;
+	auto n_left = std::make_shared<size_t>(owners.size());
+	auto is_stored = std::make_shared<bool>(true);
+	for(size_t node_index: owners) {
+		nodes[node_index]->n_in_flight++;
+		nodes[node_index]->client->store(data_class, id, data) | [this, node_index, n_left, is_stored, result](bool is_stored_here) mutable {
+			nodes[node_index]->n_in_flight--;
+			*is_stored = *is_stored && is_stored_here;
+			if(--*n_left == 0) {
+				result.set(std::move(*is_stored));
+			}
+		};
+	}
+	return result;
+}
+
+
+async::promise<std::optional<std::vector<std::byte>>> registry::retrieve(std::string data_class, uint64_t id) {
+	return read<std::vector<std::byte>>(data_class, id, [data_class, id](auto& client) {
+		return client->retrieve(data_class, id);
+	}) | [](std::pair<size_t, std::optional<std::vector<std::byte>>> answer) {
+		return std::move(answer.second);
+	};
+}
+
+
+async::promise<std::optional<std::vector<std::byte>>> registry::retrieve(std::string data_class, uint64_t id, std::chrono::milliseconds timeout) {
+	return with_timeout(retrieve(std::move(data_class), id), std::optional<std::vector<std::byte>>{}, timeout);
+}
+
+
+async::promise<bool> registry::claim(std::string data_class, uint64_t id, std::chrono::milliseconds ttl) {
+	std::vector<size_t> owners = ring.owners(data_class, id, 1);
+	if(owners.empty()) {
+		throw std::logic_error("The registry cluster has no nodes");
+	}
+	size_t node_index = owners[0];
+	nodes[node_index]->n_in_flight++;
+	return nodes[node_index]->client->claim(data_class, id, static_cast<uint32_t>(ttl.count())) | [this, node_index](bool is_claimed) {
+		nodes[node_index]->n_in_flight--;
+		return is_claimed;
+	};
+}
+
+
+async::promise<std::optional<bool>> registry::claim(std::string data_class, uint64_t id, std::chrono::milliseconds ttl, std::chrono::milliseconds timeout) {
+	return with_timeout(claim(std::move(data_class), id, ttl) | [](bool is_claimed) {
+		return std::optional<bool>(is_claimed);
+	}, std::optional<bool>{}, timeout);
+}
+
+
+async::promise<std::optional<std::filesystem::path>> registry::fetch(std::string data_class, uint64_t id) {
+	if(!cache) {
+		throw std::logic_error("The registry cache is not configured");
+	}
+	async::promise<std::optional<std::filesystem::path>> result;
+	read<registry_stat>(data_class, id, [data_class, id](auto& client) {
+		return client->stat(data_class, id);
+	}) | [this, data_class, id, result](std::pair<size_t, std::optional<registry_stat>> answer) mutable {
+		auto& [node_index, stat] = answer;
+		if(!stat) {
+			result.set(std::nullopt);
+			return;
+		}
+		if(auto path = cache->lookup(stat->sha256)) {
+			result.set(std::move(path));
+			return;
+		}
+		auto [it, inserted] = downloads.try_emplace(stat->sha256);
+		it->second.push_back(result);
+		if(inserted) {
+			download(node_index, std::move(data_class), id, stat->sha256);
+		}
+	};
+	return result;
+}
+
+
+// Writes the chunks to a temporary file and moves it into the cache under the digest of what was received
+async::promise<std::optional<std::pair<sha256::digest, std::filesystem::path>>> registry::receive(rpc::stream<std::optional<std::vector<std::byte>>> chunks, std::string description) {
+	struct state {
+		std::filesystem::path path;
+		int fd = -1;
+		sha256::hasher hasher;
+		uint64_t size = 0;
+		bool is_missing = false;
+		bool is_failed = false;
+	};
+	auto download = std::make_shared<state>();
+	download->path = cache->tmp_path();
+	download->fd = open(download->path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if(download->fd == -1) {
+		std::cerr << "Could not create " << download->path << ": " << std::strerror(errno) << std::endl;
+		download->is_failed = true;
+	}
+
+	async::promise<std::optional<std::pair<sha256::digest, std::filesystem::path>>> result;
+	chunks.subscribe([download](std::optional<std::vector<std::byte>> chunk) {
+		if(!chunk) {
+			download->is_missing = true;
+			return;
+		}
+		if(download->is_failed) {
+			return;
+		}
+		download->hasher.update(chunk->data(), chunk->size());
+		download->size += chunk->size();
+		try {
+			write_all(download->fd, chunk->data(), chunk->size());
+		} catch(std::exception& ex) {
+			std::cerr << "Could not write to " << download->path << ": " << ex.what() << std::endl;
+			download->is_failed = true;
+		}
+	}, [this, download, description, result]() mutable {
+		if(download->fd != -1) {
+			fchmod(download->fd, 0444);
+			close(download->fd);
+		}
+		if(download->is_missing || download->is_failed) {
+			std::filesystem::remove(download->path);
+			result.set(std::nullopt);
+			return;
+		}
+		sha256::digest digest = download->hasher.finish();
+		try {
+			result.set(std::pair{digest, cache->insert(digest, download->path, download->size)});
+		} catch(std::exception& ex) {
+			std::cerr << "Could not cache " << description << ": " << ex.what() << std::endl;
+			result.set(std::nullopt);
+		}
+	});
+	return result;
+}
+
+
+// Downloads from the node that reported the digest, which is known to have the object
+void registry::download(size_t node_index, std::string data_class, uint64_t id, sha256::digest expected_digest) {
+	nodes[node_index]->n_in_flight++;
+	std::string description = data_class + "/" + std::to_string(id);
+	receive(with_timeout(nodes[node_index]->client->retrieve_stream(data_class, id), timeout), description) | [this, node_index, expected_digest, description](std::optional<std::pair<sha256::digest, std::filesystem::path>> received) {
+		nodes[node_index]->n_in_flight--;
+		std::optional<std::filesystem::path> result;
+		if(received) {
+			// If the object was overwritten after stat(), this is the new version; it is cached under its own digest
+			if(received->first != expected_digest) {
+				std::cerr << "Object " << description << " changed while being downloaded" << std::endl;
+			}
+			result = std::move(received->second);
+		}
+		auto waiters = std::move(downloads.extract(expected_digest).mapped());
+		for(auto& waiter: waiters) {
+			waiter.set(std::optional<std::filesystem::path>(result));
+		}
+	};
+}
+
+
+async::promise<std::optional<std::filesystem::path>> registry::fetch_from(rpc::stream<std::optional<std::vector<std::byte>>> chunks, std::string data_class, uint64_t id) {
+	if(!cache) {
+		throw std::logic_error("The registry cache is not configured");
+	}
+	return receive(std::move(chunks), data_class + "/" + std::to_string(id)) | [](std::optional<std::pair<sha256::digest, std::filesystem::path>> received) -> std::optional<std::filesystem::path> {
+		if(!received) {
+			return std::nullopt;
+		}
+		return std::move(received->second);
+	};
+}
+
+
+async::promise<bool> registry::link_into(std::string data_class, uint64_t id, std::filesystem::path target) {
+	return fetch(std::move(data_class), id) | [target](std::optional<std::filesystem::path> source) {
+		if(!source) {
+			return false;
+		}
+		try {
+			place_file(*source, target);
+			return true;
+		} catch(std::exception& ex) {
+			std::cerr << "Could not place " << *source << " at " << target << ": " << ex.what() << std::endl;
+			return false;
+		}
+	};
+}
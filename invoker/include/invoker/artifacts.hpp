@@ -0,0 +1,92 @@
+#ifndef INVOKER_ARTIFACTS_HPP
+#define INVOKER_ARTIFACTS_HPP
+
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common/async.hpp"
+#include "common/registry.hpp"
+#include "common/sha256.hpp"
+
+#include "protocol.hpp"
+
+
+struct artifact_cache_options {
+	// Language id to the compiler version and flags used for it; only languages listed here are cached, and changing an
+	// entry invalidates what was cached for the language
+	std::unordered_map<uint64_t, std::string> toolchains;
+	// How long other invokers wait for one that is compiling a source before they compile it themselves
+	std::chrono::milliseconds compile_lease{30000};
+	// How often a waiting invoker looks for the artifact
+	std::chrono::milliseconds poll_interval{250};
+	// A registry request that takes longer than this counts as a miss, so that a registry outage does not stop compiles
+	std::chrono::milliseconds registry_timeout{1000};
+	// Storing or fetching a compiled program that takes longer than this fails the job with a judge error
+	std::chrono::milliseconds transfer_timeout{30000};
+};
+
+
+// What a compiler run on this invoker produced; binary is the program if status is accepted
+struct compiler_output {
+	verdict status;
+	std::string message;
+	std::vector<std::byte> binary;
+};
+
+
+// Compiles every source once for the whole cluster. Compiled programs are stored in the registry under data_class
+// "binary" and an id made of the first eight bytes of their SHA-256, which is the artifact_id of the compilation_result,
+// and the invokers that run the tests fetch them from there.
+//
+// The compilation_result is stored under data_class "artifact" and an id made of the first eight bytes of a SHA-256 of
+// the toolchain, the language and the source, together with the full hash to rule out collisions. Compilation errors
+// are reused like programs, judge errors are not.
+//
+// Compiles of the same source on one invoker are merged right away. Across invokers, the first one to miss claims the
+// key in the registry, and the others look for the artifact every poll_interval until it appears; if the claim runs out
+// first, e.g. because that invoker died, one of them claims the key and compiles.
+class artifact_cache {
+public:
+	using compile_fn = std::function<async::promise<compiler_output>(compilation)>;
+
+private:
+	registry& store;
+	artifact_cache_options options;
+	std::map<sha256::digest, std::vector<async::promise<compilation_result>>> in_flight;
+	uint64_t hits = 0;
+	uint64_t misses = 0;
+
+	void attempt(sha256::digest key, compilation task, compile_fn compile);
+	// Stores the program in the registry
+	async::promise<compilation_result> publish(compiler_output output);
+	void finish(const sha256::digest& key, compilation_result result);
+
+public:
+	artifact_cache(registry& store, artifact_cache_options options);
+
+	// nullopt if the language is not cached
+	std::optional<sha256::digest> key_for(const compilation& task) const;
+	// Takes the result from the cache, from another invoker compiling the same source, or from compile
+	async::promise<compilation_result> get(compilation task, compile_fn compile);
+	// Path to the program of a compilation_result, see registry::fetch; nullopt if it could not be fetched
+	async::promise<std::optional<std::filesystem::path>> fetch(uint64_t artifact_id);
+
+	uint64_t n_hits() const {
+		return hits;
+	}
+	uint64_t n_misses() const {
+		return misses;
+	}
+};
+
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef INVOKER_LOCALITY_HPP
+#define INVOKER_LOCALITY_HPP
+
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+
+#include "broker/locality.hpp"
+
+
+// The problems whose tests were used most recently, which are likely still in the registry cache. The broker is told
+// about them so that it sends tests of the same problems here.
+class recent_problems {
+	size_t capacity;
+	// Most recent first
+	std::list<uint64_t> order;
+	std::unordered_map<uint64_t, std::list<uint64_t>::iterator> positions;
+	bool is_changed = false;
+
+public:
+	explicit recent_problems(size_t capacity);
+
+	void touch(uint64_t problem_id);
+	// Whether the set changed since the last call
+	bool take_changed();
+	broker::problem_filter filter() const;
+};
+
+
+#endif
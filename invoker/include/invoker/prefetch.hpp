@@ -0,0 +1,75 @@
+#ifndef INVOKER_PREFETCH_HPP
+#define INVOKER_PREFETCH_HPP
+
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common/async.hpp"
+#include "common/registry.hpp"
+#include "rpc/buffer.hpp"
+#include "rpc/client.hpp"
+#include "rpc/stream.hpp"
+
+#include "protocol.hpp"
+
+
+// Fetches test data pushed by the broker into the registry cache and serves it to other invokers. Every object is
+// taken from the first peer in the list the broker sent that has it, and from the registry if none does. Objects are
+// fetched in the announced order, so a peer one level down gets an object as soon as this invoker has it rather than
+// after the whole set.
+class test_data_prefetcher {
+	class client_impl: public rpc::simplex_impl<client_impl, rpc::EmptyProtocol> {
+	};
+	using peer_client = rpc::client<invoker_peer_protocol, client_impl>;
+
+	struct object {
+		bool is_done = false;
+		std::optional<std::filesystem::path> path;
+		std::vector<async::promise<std::optional<std::filesystem::path>>> waiters;
+	};
+
+	struct job {
+		std::vector<registry_key> keys;
+		std::shared_ptr<const std::vector<std::string>> sources;
+		size_t next = 0;
+		size_t n_in_flight = 0;
+		bool is_complete = true;
+		async::promise<bool> result;
+	};
+
+	registry& test_data;
+	size_t max_in_flight;
+	std::chrono::milliseconds peer_timeout;
+
+	std::map<std::string, std::unique_ptr<peer_client>> peers;
+	std::map<std::pair<std::string, uint64_t>, object> objects;
+
+	static constexpr size_t chunk_size = 1024 * 1024;
+
+	peer_client& peer(const std::string& address);
+	void pump(std::shared_ptr<job> state);
+	async::promise<bool> claim(const registry_key& key, std::shared_ptr<const std::vector<std::string>> sources);
+	void fetch(std::string data_class, uint64_t id, std::shared_ptr<const std::vector<std::string>> sources, size_t i, async::promise<std::optional<std::filesystem::path>> result);
+
+public:
+	test_data_prefetcher(registry& test_data, size_t max_in_flight, std::chrono::milliseconds peer_timeout);
+
+	void stop();
+
+	// Resolves to false if some of the objects could not be fetched from anywhere
+	async::promise<bool> prefetch(std::vector<registry_key> keys, std::vector<std::string> sources);
+	// Yields nullopt if the object was not prefetched here; waits for it if it is being fetched
+	rpc::stream<std::optional<rpc::blob>> serve(std::string data_class, uint64_t id);
+};
+
+
+#endif
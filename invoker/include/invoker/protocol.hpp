@@ -0,0 +1,85 @@
+#ifndef INVOKER_PROTOCOL_HPP
+#define INVOKER_PROTOCOL_HPP
+
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "registry/protocol.hpp"
+#include "rpc/buffer.hpp"
+#include "rpc/reflection.hpp"
+
+
+enum class verdict: uint8_t {
+	accepted = 0,
+	wrong_answer = 1,
+	time_limit_exceeded = 2,
+	memory_limit_exceeded = 3,
+	runtime_error = 4,
+	compilation_error = 5,
+	// The invoker could not judge the submission; it is not the submission's fault
+	judge_error = 6
+};
+
+
+struct compilation {
+	uint64_t submission_id;
+	uint64_t language_id;
+	rpc::blob source;
+};
+RPC_DEFINE_STRUCT(compilation, submission_id, language_id, source)
+
+
+// status is accepted if the source compiled, in which case artifact_id is the id of the program the tests run. The
+// compiling invoker stores the program in the registry under data_class "binary", so the broker never handles it.
+struct compilation_result {
+	verdict status;
+	std::string message;
+	uint64_t artifact_id;
+};
+RPC_DEFINE_STRUCT(compilation_result, status, message, artifact_id)
+
+
+// The invoker fetches the program from the registry, so a test can run on any invoker, not just the one that compiled it
+struct test_run {
+	uint64_t submission_id;
+	uint64_t problem_id;
+	uint64_t language_id;
+	uint32_t test;
+	uint64_t artifact_id;
+};
+RPC_DEFINE_STRUCT(test_run, submission_id, problem_id, language_id, test, artifact_id)
+
+
+// time_usage is the CPU time the test took as a fraction of the time limit, in thousandths
+struct invocation_result {
+	verdict status;
+	std::string message;
+	uint32_t time_usage;
+};
+RPC_DEFINE_STRUCT(invocation_result, status, message, time_usage)
+
+
+RPC_PROTOCOL(invoker_protocol,
+	// A submission is compiled once and its tests are then run separately, possibly on different invokers. compile takes a
+	// compile slot and run_test a run slot.
+	compilation_result RPC_METHOD(compile)(compilation task);
+	invocation_result RPC_METHOD(run_test)(test_run task);
+	// Caches the objects, taking each one from the first of the peer invokers at sources that has it and from the registry
+	// otherwise. Resolves to false if some of them could not be fetched at all.
+	bool RPC_METHOD(prefetch)(std::vector<registry_key> keys, std::vector<std::string> sources);
+)
+
+
+// Spoken between invokers
+RPC_PROTOCOL(invoker_peer_protocol,
+	// Waits for the object if this invoker is still prefetching it. Yields a single nullopt if this invoker does not have
+	// the object, its contents in chunks of up to 1 MiB otherwise.
+	rpc::stream<std::optional<std::vector<std::byte>>> RPC_METHOD(retrieve_stream)(std::string data_class, uint64_t id);
+)
+
+
+#endif
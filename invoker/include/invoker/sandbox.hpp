@@ -0,0 +1,167 @@
+#ifndef INVOKER_SANDBOX_HPP
+#define INVOKER_SANDBOX_HPP
+
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "common/async.hpp"
+
+
+namespace uvw {
+	class PollHandle;
+	class TimerHandle;
+}
+
+
+struct sandbox_options {
+	// Every shell gets an empty working directory here
+	std::filesystem::path root;
+	// A cgroup v2 directory the invoker may create cgroups in, with the memory and pids controllers available; none are
+	// used if it is empty. Needs Linux 5.19 for memory.peak.
+	std::filesystem::path cgroup_parent;
+	// How many shells are kept ready; with zero, shells are only cloned when asked for
+	size_t pool_size = 4;
+	// Who the programs run as
+	uid_t uid = 65534;
+	gid_t gid = 65534;
+};
+
+
+// Without a cgroup, memory is limited by address space and n_processes is not enforced
+struct sandbox_limits {
+	std::chrono::milliseconds cpu_time;
+	std::chrono::milliseconds wall_time;
+	uint64_t memory;
+	uint64_t file_size;
+	uint32_t n_processes;
+};
+
+
+// status is as returned by wait4. is_timed_out tells that the program was killed for running out of wall time. With a
+// cgroup, cpu_time and max_memory cover every process the program started; without one they are what wait4 reports,
+// which leaves out processes that were not waited for and counts the peak of the largest process only.
+struct sandbox_usage {
+	int status;
+	std::chrono::microseconds cpu_time;
+	uint64_t max_memory;
+	bool is_timed_out;
+};
+
+
+struct sandbox_shell {
+	uint64_t id;
+	// Files the program needs are placed here before it is run
+	std::filesystem::path directory;
+};
+
+
+// Runs programs in sandbox shells: processes that have namespaces (mount, PID, network, IPC, UTS), a cgroup and an
+// empty working directory of their own and only wait to be told what to execve. Setting one up costs milliseconds, which
+// would dominate judging problems with hundreds of tiny tests, so a pool of them is kept ready and refilled in the
+// background. A shell runs one program.
+//
+// Shells are cloned by a zygote, a small process forked off the invoker before it starts any threads, since cloning the
+// invoker itself would copy its page tables and whatever locks its threads hold at the moment. The invoker asks the
+// zygote for shells over a socket the event loop polls, and the zygote hands back the control socket and a pidfd of
+// every shell it clones and reports how each one exits.
+//
+// Every shell is cloned into a cgroup leaf of its own, which it keeps until it exits. Leaves are not removed then but
+// reused for the next shells, so there are only as many as shells are ever alive at once, and the files read and written
+// around every run stay open: a run costs a write to reset memory.peak and a read of cpu.stat before the program starts,
+// writes to memory.max and pids.max only if the limits differ from the last run's, and a read each of cpu.stat and
+// memory.peak after it exits. Kernels before 6.12 cannot reset memory.peak, and there a leaf is recreated after each run.
+class sandbox_pool {
+	struct shell_state {
+		pid_t pid;
+		// The program to run is sent over it
+		int control;
+		// -1 on kernels without pidfds
+		int pidfd;
+		std::optional<size_t> leaf;
+		std::optional<async::promise<sandbox_usage>> result;
+		std::shared_ptr<uvw::TimerHandle> timer;
+		bool is_timed_out = false;
+	};
+
+	// A leaf is closed, i.e. all of these are -1, until it is first needed and after it could not be reused
+	struct cgroup_leaf {
+		int memory_peak = -1;
+		int memory_max = -1;
+		int pids_max = -1;
+		int cpu_stat = -1;
+		bool is_peak_resettable = false;
+		// usage_usec of cpu.stat when the program started
+		uint64_t cpu_usage = 0;
+		// What was last written to memory.max and pids.max, zero for nothing
+		uint64_t memory_limit = 0;
+		uint32_t process_limit = 0;
+	};
+
+	sandbox_options options;
+	pid_t zygote_pid = -1;
+	int zygote = -1;
+	std::shared_ptr<uvw::PollHandle> poll;
+	std::shared_ptr<uvw::TimerHandle> backoff_timer;
+	bool is_backing_off = false;
+	uint64_t next_shell_id = 0;
+	size_t n_spawning = 0;
+	std::deque<uint64_t> ready;
+	std::deque<async::promise<std::optional<sandbox_shell>>> waiters;
+	std::unordered_map<uint64_t, shell_state> shells;
+	std::vector<cgroup_leaf> leaves;
+	std::vector<size_t> free_leaves;
+	// Of the shells being spawned
+	std::unordered_map<uint64_t, size_t> spawning_leaves;
+
+	sandbox_shell shell_for(uint64_t shell_id) const;
+	std::optional<size_t> take_leaf();
+	bool open_leaf(size_t index);
+	void close_leaf(size_t index);
+	bool prepare_leaf(cgroup_leaf& leaf, const sandbox_limits& limits);
+	void account(size_t index, sandbox_usage& usage);
+	void refill();
+	void receive();
+	void spawned(uint64_t shell_id, pid_t pid, int control, int pidfd);
+	void exited(uint64_t shell_id, sandbox_usage usage);
+	void kill(shell_state& state);
+
+public:
+	// Forks the zygote, so it must be constructed before any threads are started
+	explicit sandbox_pool(sandbox_options options);
+	sandbox_pool(const sandbox_pool&) = delete;
+	sandbox_pool& operator=(const sandbox_pool&) = delete;
+	~sandbox_pool();
+
+	// Starts filling the pool on the event loop
+	void start();
+	// Kills the zygote and with it all shells. Programs that were running resolve as killed by SIGKILL, and those waiting
+	// for a shell get nullopt.
+	void stop();
+
+	// Resolves right away if a shell is ready, and to nullopt if the pool is stopped, e.g. because the zygote died
+	async::promise<std::optional<sandbox_shell>> acquire();
+	// stdio are the standard input, output and error of the program; they can be closed once the call returns.
+	// Resolves once the program exits, and the shell is gone then.
+	async::promise<sandbox_usage> run(const sandbox_shell& shell, const std::vector<std::string>& argv, const sandbox_limits& limits, std::array<int, 3> stdio);
+	// For a shell that turned out not to be needed
+	void discard(const sandbox_shell& shell);
+
+	size_t n_ready() const {
+		return ready.size();
+	}
+};
+
+
+#endif
@@ -0,0 +1,119 @@
+#include <exception>
+#include <tuple>
+
+#include <uvw.hpp>
+
+#include "artifacts.hpp"
+
+
+namespace {
+	const std::string data_class = "artifact";
+	const std::string binary_class = "binary";
+
+	using artifact_record = std::tuple<sha256::digest, compilation_result>;
+}
+
+
+artifact_cache::artifact_cache(registry& store, artifact_cache_options options): store(store), options(std::move(options)) {
+}
+
+
+std::optional<sha256::digest> artifact_cache::key_for(const compilation& task) const {
+	auto toolchain = options.toolchains.find(task.language_id);
+	if(toolchain == options.toolchains.end()) {
+		return std::nullopt;
+	}
+	return registry_key_hasher("artifact-v1")
+		.number(task.language_id)
+		.bytes(toolchain->second.data(), toolchain->second.size())
+		.bytes(task.source.data(), task.source.size())
+		.finish();
+}
+
+
+async::promise<compilation_result> artifact_cache::get(compilation task, compile_fn compile) {
+	async::promise<compilation_result> result;
+	auto key = key_for(task);
+	if(!key) {
+		compile(std::move(task)) | [this, result](compiler_output output) mutable {
+			publish(std::move(output)) | [result](compilation_result published) mutable {
+				result.set(std::move(published));
+			};
+		};
+		return result;
+	}
+	auto [it, is_new] = in_flight.try_emplace(*key);
+	it->second.push_back(result);
+	if(is_new) {
+		attempt(*key, std::move(task), std::move(compile));
+	}
+	return result;
+}
+
+
+void artifact_cache::attempt(sha256::digest key, compilation task, compile_fn compile) {
+	store.retrieve(data_class, registry_key_hasher::id_of(key), options.registry_timeout) | [this, key, task, compile](std::optional<std::vector<std::byte>> data) mutable {
+		if(data) {
+			try {
+				auto [stored_key, stored_result] = rpc::deserialize<artifact_record>(*data);
+				if(stored_key == key) {
+					hits++;
+					finish(key, std::move(stored_result));
+					return;
+				}
+			} catch(std::exception&) {
+			}
+		}
+		// Without an answer from the registry, compiling here is safer than waiting for someone else who may not exist
+		store.claim(data_class, registry_key_hasher::id_of(key), options.compile_lease, options.registry_timeout) | [this, key, task, compile](std::optional<bool> is_claimed) mutable {
+			if(!is_claimed.value_or(true)) {
+				auto timer = uvw::Loop::getDefault()->resource<uvw::TimerHandle>();
+				timer->on<uvw::TimerEvent>([this, key, task, compile](const uvw::TimerEvent&, uvw::TimerHandle& timer) {
+					timer.close();
+					attempt(key, task, compile);
+				});
+				timer->start(options.poll_interval, std::chrono::milliseconds{0});
+				return;
+			}
+			misses++;
+			// The result is stored only once the program is, so that nobody finds a result whose program is missing
+			compile(std::move(task)) | [this, key](compiler_output output) {
+				publish(std::move(output)) | [this, key](compilation_result result) {
+					if(result.status != verdict::judge_error) {
+						store.store(data_class, registry_key_hasher::id_of(key), rpc::serialize(artifact_record{key, result}));
+					}
+					finish(key, std::move(result));
+				};
+			};
+		};
+	};
+}
+
+
+// The id is taken from the contents, so a program that two invokers compiled, e.g. after a claim ran out, is stored once
+async::promise<compilation_result> artifact_cache::publish(compiler_output output) {
+	if(output.status != verdict::accepted) {
+		return async::to_promise(compilation_result{output.status, std::move(output.message), 0});
+	}
+	uint64_t artifact_id = registry_key_hasher::id_of(sha256::hash(output.binary.data(), output.binary.size()));
+	compilation_result result{verdict::accepted, std::move(output.message), artifact_id};
+	return with_timeout(store.store(binary_class, artifact_id, std::move(output.binary)), false, options.transfer_timeout) | [result](bool is_stored) {
+		if(!is_stored) {
+			return compilation_result{verdict::judge_error, "Could not store the compiled program", 0};
+		}
+		return result;
+	};
+}
+
+
+async::promise<std::optional<std::filesystem::path>> artifact_cache::fetch(uint64_t artifact_id) {
+	return with_timeout(store.fetch(binary_class, artifact_id), std::optional<std::filesystem::path>{}, options.transfer_timeout);
+}
+
+
+void artifact_cache::finish(const sha256::digest& key, compilation_result result) {
+	auto waiters = std::move(in_flight.extract(key).mapped());
+	for(auto& waiter: waiters) {
+		waiter.set(compilation_result(result));
+	}
+}
@@ -0,0 +1,38 @@
+#include <algorithm>
+#include <utility>
+
+#include "locality.hpp"
+
+
+recent_problems::recent_problems(size_t capacity): capacity(std::max<size_t>(capacity, 1)) {
+}
+
+
+void recent_problems::touch(uint64_t problem_id) {
+	auto it = positions.find(problem_id);
+	if(it != positions.end()) {
+		order.splice(order.begin(), order, it->second);
+		return;
+	}
+	order.push_front(problem_id);
+	positions.emplace(problem_id, order.begin());
+	if(order.size() > capacity) {
+		positions.erase(order.back());
+		order.pop_back();
+	}
+	is_changed = true;
+}
+
+
+bool recent_problems::take_changed() {
+	return std::exchange(is_changed, false);
+}
+
+
+broker::problem_filter recent_problems::filter() const {
+	broker::problem_filter result;
+	for(uint64_t problem_id: order) {
+		result.insert(problem_id);
+	}
+	return result;
+}
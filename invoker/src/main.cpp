@@ -1,22 +1,163 @@
+#include <algorithm>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <set>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <stdlib.h>
+#include <unistd.h>
 
 #include <nlohmann/json.hpp>
 #include <uvw.hpp>
 
 #include "broker/protocol.hpp"
+#include "common/registry.hpp"
 #include "rpc/client.hpp"
+#include "rpc/server.hpp"
 
+#include "artifacts.hpp"
+#include "locality.hpp"
+#include "prefetch.hpp"
 #include "protocol.hpp"
+#include "sandbox.hpp"
+
+
+std::optional<test_data_prefetcher> prefetcher;
+std::optional<recent_problems> problems;
+std::optional<sandbox_pool> sandboxes;
+std::optional<artifact_cache> artifacts;
+// The broker link, submission id and test number of the jobs being worked on, which heartbeats keep the leases of. Brokers
+// number their submissions independently, so a job is only known by the link it came in on.
+std::set<std::tuple<size_t, uint64_t, uint32_t>> running_jobs;
 
 
+struct running_job {
+	std::tuple<size_t, uint64_t, uint32_t> job;
+
+	running_job(size_t link_index, uint64_t submission_id, uint32_t test): job{link_index, submission_id, test} {
+		running_jobs.insert(job);
+	}
+	running_job(const running_job&) = delete;
+	running_job& operator=(const running_job&) = delete;
+	~running_job() {
+		running_jobs.erase(job);
+	}
+};
+
 
 class invoker_impl: public rpc::duplex_impl<invoker_impl, invoker_protocol, broker_protocol> {
 public:
+	// Index of the broker link this connection serves
+	size_t link_index = 0;
+
+	async::promise<bool> prefetch(std::vector<registry_key> keys, std::vector<std::string> sources) {
+		return prefetcher->prefetch(std::move(keys), std::move(sources));
+	}
+
+	// Shells are kept ready in the sandbox pool, but there are no compilers or checkers to run in them yet
+	async::promise<compilation_result> compile(compilation task) {
+		auto job = std::make_shared<running_job>(link_index, task.submission_id, compilation_job);
+		return artifacts->get(std::move(task), [](compilation task) {
+			std::cerr << "Cannot compile submission #" << task.submission_id << ": running submissions is not supported" << std::endl;
+			return async::to_promise(compiler_output{verdict::judge_error, "This invoker cannot run submissions", {}});
+		}) | [job](compilation_result result) {
+			return result;
+		};
+	}
+
+	// The program may have been compiled by another invoker, so it is fetched first
+	async::promise<invocation_result> run_test(test_run task) {
+		auto job = std::make_shared<running_job>(link_index, task.submission_id, task.test);
+		problems->touch(task.problem_id);
+		return artifacts->fetch(task.artifact_id) | [job, task](std::optional<std::filesystem::path> program) -> invocation_result {
+			if(!program) {
+				std::cerr << "Cannot run test " << task.test << " of submission #" << task.submission_id << ": the compiled program could not be fetched" << std::endl;
+				return {verdict::judge_error, "Could not fetch the compiled program", 0};
+			}
+			std::cerr << "Cannot run test " << task.test << " of submission #" << task.submission_id << ": running submissions is not supported" << std::endl;
+			return {verdict::judge_error, "This invoker cannot run submissions", 0};
+		};
+	}
 };
 
 
+class peer_impl: public rpc::simplex_impl<peer_impl, invoker_peer_protocol> {
+public:
+	rpc::stream<std::optional<rpc::blob>> retrieve_stream(std::string data_class, uint64_t id) {
+		return prefetcher->serve(std::move(data_class), id);
+	}
+};
+
+
+// The invoker lends each broker it serves some of its run slots. lent is how many the broker was last told, held how many
+// it may still be using: a broker that is lent fewer slots lets its running tests finish, and the slots go elsewhere only
+// once a heartbeat shows they have, so the invoker never runs more tests than it has slots. Every broker is offered all
+// compile slots, since compiling more at once than planned only makes compiles slower.
+struct broker_link {
+	std::unique_ptr<rpc::client<broker_protocol, invoker_impl>> client;
+	uint32_t lent = 0;
+	uint32_t held = 0;
+	uint32_t n_running = 0;
+	uint64_t backlog = 0;
+	// Bumped whenever lent changes, so that a heartbeat answered before the broker heard of the change is not trusted
+	uint64_t generation = 0;
+	// At most one heartbeat is in flight, so that they do not pile up while the broker is unreachable
+	bool is_heartbeat_pending = false;
+};
+std::vector<broker_link> links;
+
+
+// The first broker is the home one and is lent every slot while it has a backlog. Otherwise it keeps the slots it is
+// using and one more, so that a new submission there does not wait for the jobs of other brokers to finish, and the rest
+// go to the broker with the largest backlog, so that idle invokers steal work from whichever broker falls behind.
+void rebalance(uint32_t slots) {
+	size_t busiest = 0;
+	for(size_t i = 1; i < links.size(); i++) {
+		if(links[i].backlog > links[busiest].backlog) {
+			busiest = i;
+		}
+	}
+	std::vector<uint32_t> wanted(links.size(), 0);
+	if(links[0].backlog > 0 || links[busiest].backlog == 0) {
+		wanted[0] = slots;
+	} else {
+		wanted[0] = std::min(links[0].n_running + 1, slots);
+		wanted[busiest] = slots - wanted[0];
+	}
+
+	auto lend = [](broker_link& link, uint32_t lent) {
+		if(lent != link.lent) {
+			link.lent = lent;
+			link.generation++;
+			(*link.client)->set_slots(lent);
+		}
+	};
+	uint32_t n_held = 0;
+	for(size_t i = 0; i < links.size(); i++) {
+		if(wanted[i] < links[i].lent) {
+			lend(links[i], wanted[i]);
+		}
+		n_held += links[i].held;
+	}
+	for(size_t i = 0; i < links.size(); i++) {
+		auto& link = links[i];
+		if(wanted[i] > link.lent) {
+			uint32_t lent = std::min(wanted[i], link.held + (slots - std::min(n_held, slots)));
+			if(lent <= link.lent) {
+				continue;
+			}
+			n_held += std::max(lent, link.held) - link.held;
+			link.held = std::max(lent, link.held);
+			lend(link, lent);
+		}
+	}
+}
+
+
 
 int main(int argc, char** argv) {
 	if(argc != 2) {
@@ -54,10 +195,154 @@ int main(int argc, char** argv) {
 	}
 
 
+	// The zygote is forked before anything starts a thread
+	sandbox_options sandbox;
+	sandbox.root = config.value("sandbox_root", std::string{"sandboxes"});
+	sandbox.cgroup_parent = config.value("sandbox_cgroup", std::string{});
+	sandbox.pool_size = config.value("sandbox_pool_size", sandbox.pool_size);
+	sandbox.uid = config.value("sandbox_uid", sandbox.uid);
+	sandbox.gid = config.value("sandbox_gid", sandbox.gid);
+	sandboxes.emplace(std::move(sandbox));
+
+
 	// Start client
 	auto loop = uvw::Loop::getDefault();
+	sandboxes->start();
+
+	// Invokers serving a federation of brokers list them all, their home broker first
+	std::vector<std::string> broker_addresses;
+	if(config.contains("brokers")) {
+		broker_addresses = config.at("brokers").get<std::vector<std::string>>();
+	} else {
+		broker_addresses.push_back(config.at("broker").get<std::string>());
+	}
+	links.resize(broker_addresses.size());
+	for(size_t i = 0; i < links.size(); i++) {
+		links[i].client = std::make_unique<rpc::client<broker_protocol, invoker_impl>>(broker_addresses[i]);
+		links[i].client->impl().link_index = i;
+	}
+
+	registry_cluster_options cluster_options;
+	cluster_options.nodes = config.at("registry").get<std::vector<std::string>>();
+	cluster_options.draining_nodes = config.value("registry_draining", std::vector<std::string>{});
+	cluster_options.n_replicas = config.value<size_t>("registry_replicas", 1);
+	cluster_options.timeout = std::chrono::milliseconds{config.value<int64_t>("registry_timeout_ms", 30000)};
+	registry test_data(cluster_options, registry_cache_options{
+		config.at("registry_cache_dir").get<std::string>(),
+		config.value<uint64_t>("registry_cache_size", uint64_t{4} * 1024 * 1024 * 1024)
+	});
+
+
+	// Compiled sources are shared with the whole cluster through the registry
+	artifact_cache_options artifact_options;
+	for(auto& item: config.value("toolchains", nlohmann::json::object()).items()) {
+		artifact_options.toolchains[std::stoull(item.key())] = item.value().get<std::string>();
+	}
+	artifact_options.compile_lease = std::chrono::milliseconds{config.value<int64_t>("compile_lease_ms", 30000)};
+	artifact_options.poll_interval = std::chrono::milliseconds{config.value<int64_t>("artifact_poll_ms", 250)};
+	artifact_options.registry_timeout = std::chrono::milliseconds{config.value<int64_t>("artifact_timeout_ms", 1000)};
+	artifact_options.transfer_timeout = std::chrono::milliseconds{config.value<int64_t>("artifact_transfer_timeout_ms", 30000)};
+	artifacts.emplace(test_data, std::move(artifact_options));
+
+
+	// Serve prefetched test data to other invokers
+	prefetcher.emplace(test_data, config.value<size_t>("prefetch_in_flight", 4), std::chrono::milliseconds(config.value<int64_t>("peer_timeout_ms", 30000)));
+
+	std::string peer_listen = config.at("peer_listen").get<std::string>();
+	std::string peer_address = config.value("peer_address", peer_listen);
+	rpc::server<peer_impl> peer_server;
+	peer_server.bind(peer_listen);
+
+	// Offer the whole machine unless told otherwise
+	invoker_capacity capacity;
+	capacity.cores = std::max(std::thread::hardware_concurrency(), 1u);
+	capacity.memory = config.value<uint64_t>("memory", static_cast<uint64_t>(sysconf(_SC_PHYS_PAGES)) * sysconf(_SC_PAGE_SIZE));
+	capacity.language_ids = config.at("languages").get<std::vector<uint64_t>>();
+	capacity.slots = config.value<uint32_t>("slots", capacity.cores);
+	capacity.free_slots = capacity.slots;
+	// Compilers run outside the sandbox and next to the tests, so only a few of them at once
+	capacity.compile_slots = config.value<uint32_t>("compile_slots", std::max(capacity.cores / 4, 1u));
+	capacity.free_compile_slots = capacity.compile_slots;
+	uint32_t slots = capacity.slots;
+	links[0].lent = slots;
+	links[0].held = slots;
 
-	rpc::client<broker_protocol, invoker_impl> client(config.at("broker").get<std::string>());
+	problems.emplace(config.value<size_t>("locality_problems", 256));
+	auto register_invoker = [capacity](broker_link& link) mutable {
+		// Compile slots are shared by all brokers, run slots are lent to each
+		size_t link_index = &link - links.data();
+		uint32_t n_compiling = std::count_if(running_jobs.begin(), running_jobs.end(), [](auto& job) {
+			return std::get<2>(job) == compilation_job;
+		});
+		uint32_t n_testing = std::count_if(running_jobs.begin(), running_jobs.end(), [link_index](auto& job) {
+			return std::get<0>(job) == link_index && std::get<2>(job) != compilation_job;
+		});
+		capacity.slots = link.lent;
+		capacity.free_slots = link.lent - std::min(n_testing, link.lent);
+		capacity.free_compile_slots = capacity.compile_slots - std::min(n_compiling, capacity.compile_slots);
+		(*link.client)->register_invoker(capacity);
+		(*link.client)->report_cached_problems(problems->filter().data());
+	};
+	for(auto& link: links) {
+		link.client->set_connect_handler([&link, peer_address, register_invoker]() mutable {
+			link.is_heartbeat_pending = false;
+			(*link.client)->register_peer(peer_address);
+			register_invoker(link);
+		});
+	}
+
+
+	// Tell the broker which problems' tests are cached here, so that it sends their submissions here
+	auto locality_timer = loop->resource<uvw::TimerHandle>();
+	locality_timer->on<uvw::TimerEvent>([](const uvw::TimerEvent&, uvw::TimerHandle&) {
+		if(problems->take_changed()) {
+			for(auto& link: links) {
+				(*link.client)->report_cached_problems(problems->filter().data());
+			}
+		}
+	});
+	locality_timer->start(std::chrono::seconds{1}, std::chrono::seconds{1});
+
+
+	// Keep the leases of running jobs, tell the brokers how loaded the machine is, and lend the slots to where the work
+	// is. Every broker gets only the jobs it handed out, since another broker's job may have the same ids.
+	auto heartbeat_timer = loop->resource<uvw::TimerHandle>();
+	heartbeat_timer->on<uvw::TimerEvent>([register_invoker, slots](const uvw::TimerEvent&, uvw::TimerHandle&) mutable {
+		if(links.size() > 1) {
+			rebalance(slots);
+		}
+		invoker_heartbeat status{{}, 0, static_cast<uint64_t>(sysconf(_SC_AVPHYS_PAGES)) * sysconf(_SC_PAGE_SIZE)};
+		double load;
+		if(getloadavg(&load, 1) == 1) {
+			status.load = static_cast<uint32_t>(load * 1000);
+		}
+		for(size_t i = 0; i < links.size(); i++) {
+			auto& link = links[i];
+			if(link.is_heartbeat_pending) {
+				continue;
+			}
+			link.is_heartbeat_pending = true;
+			status.jobs.clear();
+			for(auto it = running_jobs.lower_bound({i, 0, 0}); it != running_jobs.end() && std::get<0>(*it) == i; ++it) {
+				status.jobs.emplace_back(std::get<1>(*it), std::get<2>(*it));
+			}
+			(*link.client)->heartbeat(status) | [&link, generation = link.generation, register_invoker](std::optional<heartbeat_reply> reply) mutable {
+				link.is_heartbeat_pending = false;
+				if(!reply) {
+					std::cerr << "The broker has fenced this invoker off, registering again" << std::endl;
+					register_invoker(link);
+					return;
+				}
+				link.backlog = reply->backlog;
+				link.n_running = reply->n_running;
+				if(generation == link.generation) {
+					link.held = std::max(link.lent, reply->n_running);
+				}
+			};
+		}
+	});
+	auto heartbeat_interval = std::chrono::milliseconds{config.value<int64_t>("heartbeat_interval_ms", 1000)};
+	heartbeat_timer->start(heartbeat_interval, heartbeat_interval);
 
 
 	// Handle SIGINT, SIHUP, SIGTERM
@@ -71,7 +356,17 @@ int main(int argc, char** argv) {
 				signal->close();
 			}
 			signals.clear();
-			client.stop();
+			locality_timer->stop();
+			locality_timer->close();
+			heartbeat_timer->stop();
+			heartbeat_timer->close();
+			for(auto& link: links) {
+				link.client->stop();
+			}
+			peer_server.stop();
+			prefetcher->stop();
+			sandboxes->stop();
+			test_data.stop();
 		});
 		signal->start(signum);
 		signals.push_back(std::move(signal));
@@ -0,0 +1,181 @@
+#include <algorithm>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "prefetch.hpp"
+
+
+namespace {
+	struct mapping {
+		void* addr;
+		size_t size;
+
+		mapping(void* addr, size_t size): addr(addr), size(size) {
+		}
+		mapping(const mapping&) = delete;
+		mapping& operator=(const mapping&) = delete;
+		~mapping() {
+			munmap(addr, size);
+		}
+	};
+
+
+	// nullopt if the file is gone, e.g. evicted from the cache
+	std::optional<rpc::blob> map_file(const std::filesystem::path& path) {
+		int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if(fd == -1) {
+			return std::nullopt;
+		}
+		struct stat st;
+		if(fstat(fd, &st) == -1) {
+			close(fd);
+			return std::nullopt;
+		}
+		if(st.st_size == 0) {
+			close(fd);
+			return rpc::blob{};
+		}
+		void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if(addr == MAP_FAILED) {
+			return std::nullopt;
+		}
+		auto owner = std::make_shared<const mapping>(addr, st.st_size);
+		return rpc::blob{std::move(owner), static_cast<const std::byte*>(addr), static_cast<size_t>(st.st_size)};
+	}
+}
+
+
+test_data_prefetcher::test_data_prefetcher(registry& test_data, size_t max_in_flight, std::chrono::milliseconds peer_timeout): test_data(test_data), max_in_flight(std::max<size_t>(max_in_flight, 1)), peer_timeout(peer_timeout) {
+}
+
+
+void test_data_prefetcher::stop() {
+	for(auto& [address, client]: peers) {
+		client->stop();
+	}
+}
+
+
+test_data_prefetcher::peer_client& test_data_prefetcher::peer(const std::string& address) {
+	auto it = peers.find(address);
+	if(it == peers.end()) {
+		it = peers.emplace(address, std::make_unique<peer_client>(address)).first;
+	}
+	return *it->second;
+}
+
+
+async::promise<bool> test_data_prefetcher::prefetch(std::vector<registry_key> keys, std::vector<std::string> sources) {
+	auto state = std::make_shared<job>();
+	state->keys = std::move(keys);
+	state->sources = std::make_shared<const std::vector<std::string>>(std::move(sources));
+	async::promise<bool> result = state->result;
+	pump(std::move(state));
+	return result;
+}
+
+
+void test_data_prefetcher::pump(std::shared_ptr<job> state) {
+	while(state->n_in_flight < max_in_flight && state->next < state->keys.size()) {
+		state->n_in_flight++;
+		claim(state->keys[state->next++], state->sources) | [this, state](bool is_fetched) {
+			state->is_complete = state->is_complete && is_fetched;
+			state->n_in_flight--;
+			pump(state);
+		};
+	}
+	if(state->n_in_flight == 0 && state->next == state->keys.size()) {
+		// Guards against resolving twice when the last claims finish synchronously
+		state->next++;
+		state->result.set(std::move(state->is_complete));
+	}
+}
+
+
+async::promise<bool> test_data_prefetcher::claim(const registry_key& key, std::shared_ptr<const std::vector<std::string>> sources) {
+	async::promise<bool> result;
+	std::pair<std::string, uint64_t> k{key.data_class, key.id};
+	auto it = objects.find(k);
+	if(it != objects.end() && !it->second.is_done) {
+		async::promise<std::optional<std::filesystem::path>> fetched;
+		it->second.waiters.push_back(fetched);
+		fetched | [result](std::optional<std::filesystem::path> path) mutable {
+			result.set(path.has_value());
+		};
+		return result;
+	}
+
+	// An object announced again is fetched again, in case it has changed since
+	objects[k] = object{};
+	async::promise<std::optional<std::filesystem::path>> fetched;
+	fetch(key.data_class, key.id, std::move(sources), 0, fetched);
+	fetched | [this, k, result](std::optional<std::filesystem::path> path) mutable {
+		auto& obj = objects[k];
+		obj.is_done = true;
+		obj.path = path;
+		auto waiters = std::move(obj.waiters);
+		obj.waiters.clear();
+		for(auto& waiter: waiters) {
+			waiter.set(std::optional<std::filesystem::path>(path));
+		}
+		if(!path) {
+			std::cerr << "Could not prefetch " << k.first << "/" << k.second << std::endl;
+		}
+		result.set(path.has_value());
+	};
+	return result;
+}
+
+
+void test_data_prefetcher::fetch(std::string data_class, uint64_t id, std::shared_ptr<const std::vector<std::string>> sources, size_t i, async::promise<std::optional<std::filesystem::path>> result) {
+	if(i == sources->size()) {
+		test_data.fetch(data_class, id) | [result](std::optional<std::filesystem::path> path) mutable {
+			result.set(std::move(path));
+		};
+		return;
+	}
+	auto chunks = with_timeout(peer((*sources)[i])->retrieve_stream(data_class, id), peer_timeout);
+	test_data.fetch_from(std::move(chunks), data_class, id) | [this, data_class, id, sources, i, result](std::optional<std::filesystem::path> path) mutable {
+		if(path) {
+			result.set(std::move(path));
+		} else {
+			fetch(std::move(data_class), id, std::move(sources), i + 1, std::move(result));
+		}
+	};
+}
+
+
+rpc::stream<std::optional<rpc::blob>> test_data_prefetcher::serve(std::string data_class, uint64_t id) {
+	rpc::stream<std::optional<rpc::blob>> result;
+	auto send = [result](std::optional<std::filesystem::path> path) mutable {
+		std::optional<rpc::blob> data;
+		if(path) {
+			data = map_file(*path);
+		}
+		if(!data) {
+			result.push(std::nullopt);
+		} else {
+			for(size_t offset = 0; offset < data->size(); offset += chunk_size) {
+				result.push(data->slice(offset, std::min(chunk_size, data->size() - offset)));
+			}
+		}
+		result.finish();
+	};
+
+	auto it = objects.find({data_class, id});
+	if(it == objects.end()) {
+		send(std::nullopt);
+	} else if(it->second.is_done) {
+		send(it->second.path);
+	} else {
+		async::promise<std::optional<std::filesystem::path>> fetched;
+		it->second.waiters.push_back(fetched);
+		fetched | std::move(send);
+	}
+	return result;
+}
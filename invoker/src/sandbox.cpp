@@ -0,0 +1,794 @@
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string_view>
+#include <system_error>
+#include <utility>
+
+#include <fcntl.h>
+#include <grp.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/mount.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <uvw.hpp>
+
+#include "sandbox.hpp"
+
+
+namespace {
+	// leaf is -1 without cgroups
+	struct spawn_request {
+		uint64_t shell_id;
+		int64_t leaf;
+	};
+
+	// A shell that was cloned comes with its control socket and pidfd; pid is -1 if cloning failed
+	struct zygote_report {
+		uint64_t shell_id;
+		int32_t pid;
+		int32_t status;
+		uint64_t cpu_time_us;
+		uint64_t max_memory;
+		uint8_t is_exit;
+	};
+
+	// Followed by n_args NUL-terminated arguments, and sent with the three stdio descriptors
+	struct exec_header {
+		uint64_t cpu_time_ms;
+		uint64_t address_space;
+		uint64_t file_size;
+		uint32_t n_args;
+	};
+
+	constexpr size_t max_exec_size = 64 * 1024;
+
+	constexpr int namespaces = CLONE_NEWNS | CLONE_NEWPID | CLONE_NEWNET | CLONE_NEWIPC | CLONE_NEWUTS;
+
+
+	ssize_t send_with_fds(int sock, const void* data, size_t size, const int* fds, size_t n_fds) {
+		iovec iov{const_cast<void*>(data), size};
+		msghdr message{};
+		message.msg_iov = &iov;
+		message.msg_iovlen = 1;
+		alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * 3)];
+		if(n_fds > 0) {
+			message.msg_control = control;
+			message.msg_controllen = CMSG_SPACE(sizeof(int) * n_fds);
+			cmsghdr* header = CMSG_FIRSTHDR(&message);
+			header->cmsg_level = SOL_SOCKET;
+			header->cmsg_type = SCM_RIGHTS;
+			header->cmsg_len = CMSG_LEN(sizeof(int) * n_fds);
+			std::memcpy(CMSG_DATA(header), fds, sizeof(int) * n_fds);
+		}
+		ssize_t n;
+		do {
+			n = sendmsg(sock, &message, MSG_NOSIGNAL);
+		} while(n == -1 && errno == EINTR);
+		return n;
+	}
+
+
+	// Received descriptors are close-on-exec; fds is filled up to n_fds and the rest is -1
+	ssize_t receive_with_fds(int sock, void* data, size_t size, int* fds, size_t n_fds) {
+		iovec iov{data, size};
+		msghdr message{};
+		message.msg_iov = &iov;
+		message.msg_iovlen = 1;
+		alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * 3)];
+		message.msg_control = control;
+		message.msg_controllen = sizeof(control);
+		ssize_t n;
+		do {
+			n = recvmsg(sock, &message, MSG_CMSG_CLOEXEC);
+		} while(n == -1 && errno == EINTR);
+		std::fill(fds, fds + n_fds, -1);
+		if(n <= 0) {
+			return n;
+		}
+		size_t i = 0;
+		for(cmsghdr* header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header)) {
+			if(header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+				continue;
+			}
+			size_t n_received = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			for(size_t k = 0; k < n_received; k++) {
+				int fd;
+				std::memcpy(&fd, CMSG_DATA(header) + k * sizeof(int), sizeof(int));
+				if(i < n_fds) {
+					fds[i++] = fd;
+				} else {
+					close(fd);
+				}
+			}
+		}
+		return n;
+	}
+
+
+	std::filesystem::path directory_of(const sandbox_options& options, uint64_t shell_id) {
+		return options.root / ("shell-" + std::to_string(shell_id));
+	}
+
+	std::filesystem::path leaf_path(const sandbox_options& options, size_t index) {
+		return options.cgroup_parent / ("slot-" + std::to_string(index));
+	}
+
+
+	bool write_file(const std::filesystem::path& path, const std::string& contents) {
+		int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+		if(fd == -1) {
+			return false;
+		}
+		bool is_written = write(fd, contents.data(), contents.size()) == static_cast<ssize_t>(contents.size());
+		close(fd);
+		return is_written;
+	}
+
+
+	bool write_at(int fd, const std::string& contents) {
+		return pwrite(fd, contents.data(), contents.size(), 0) == static_cast<ssize_t>(contents.size());
+	}
+
+
+	// Reads a cgroup file in a single syscall and parses the value of key, or the whole file if key is empty
+	std::optional<uint64_t> read_at(int fd, std::string_view key) {
+		char buffer[512];
+		ssize_t n = pread(fd, buffer, sizeof(buffer) - 1, 0);
+		if(n <= 0) {
+			return std::nullopt;
+		}
+		buffer[n] = '\0';
+		const char* value = buffer;
+		if(!key.empty()) {
+			std::string_view text(buffer, n);
+			size_t position = 0;
+			while(text.compare(position, key.size(), key) != 0 || buffer[position + key.size()] != ' ') {
+				position = text.find('\n', position);
+				if(position == std::string_view::npos) {
+					return std::nullopt;
+				}
+				position++;
+			}
+			value = buffer + position + key.size() + 1;
+		}
+		char* end;
+		uint64_t result = std::strtoull(value, &end, 10);
+		if(end == value) {
+			return std::nullopt;
+		}
+		return result;
+	}
+
+
+	struct shell_args {
+		const sandbox_options* options;
+		const char* directory;
+		int control;
+	};
+
+
+	// Runs in the child of the shell with stdio in place; returns only if the program could not be started
+	int exec_program(const shell_args& args, const exec_header& header, std::vector<char*>& argv) {
+		// The CPU limit is only a backstop for a program that ignores the wall time limit, so it is rounded up
+		uint64_t cpu_seconds = (header.cpu_time_ms + 999) / 1000 + 1;
+		rlimit cpu{cpu_seconds, cpu_seconds + 1};
+		rlimit file_size{header.file_size, header.file_size};
+		rlimit core{0, 0};
+		if(setrlimit(RLIMIT_CPU, &cpu) == -1 || setrlimit(RLIMIT_FSIZE, &file_size) == -1 || setrlimit(RLIMIT_CORE, &core) == -1) {
+			return 126;
+		}
+		if(header.address_space != 0) {
+			rlimit address_space{header.address_space, header.address_space};
+			if(setrlimit(RLIMIT_AS, &address_space) == -1) {
+				return 126;
+			}
+		}
+
+		// The zygote blocks SIGCHLD and ignores terminal signals, and both would carry over the execve
+		sigset_t none;
+		sigemptyset(&none);
+		sigprocmask(SIG_SETMASK, &none, nullptr);
+		for(int signum: {SIGINT, SIGHUP, SIGPIPE}) {
+			signal(signum, SIG_DFL);
+		}
+		if(setgroups(0, nullptr) == -1 || setresgid(args.options->gid, args.options->gid, args.options->gid) == -1 || setresuid(args.options->uid, args.options->uid, args.options->uid) == -1) {
+			return 126;
+		}
+		prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0);
+		char* envp[] = {nullptr};
+		execve(argv[0], argv.data(), envp);
+		return 127;
+	}
+
+
+	// Runs as PID 1 of its own namespace, still privileged, until the invoker sends the program. Returning exits the
+	// shell with that status.
+	//
+	// The program runs in a child rather than in the shell itself, since the kernel drops signals with the default
+	// action that the init of a namespace sends itself, such as the SIGABRT of abort() and the SIGXCPU of the CPU limit.
+	// The shell waits for it and passes its wait status on over the control socket, as the shell's own status cannot
+	// tell that the program was killed by a signal.
+	int shell_main(void* arg) {
+		auto& args = *static_cast<shell_args*>(arg);
+		prctl(PR_SET_PDEATHSIG, SIGKILL);
+		if(mount(nullptr, "/", nullptr, MS_REC | MS_PRIVATE, nullptr) == -1 || chdir(args.directory) == -1) {
+			return 126;
+		}
+
+		std::vector<char> buffer(max_exec_size);
+		int stdio[3];
+		ssize_t n = receive_with_fds(args.control, buffer.data(), buffer.size() - 1, stdio, 3);
+		if(n < static_cast<ssize_t>(sizeof(exec_header)) || stdio[2] == -1) {
+			return 126;
+		}
+		buffer[n] = '\0';
+		exec_header header;
+		std::memcpy(&header, buffer.data(), sizeof(header));
+		std::vector<char*> argv;
+		for(char* arg = buffer.data() + sizeof(header); argv.size() < header.n_args && arg < buffer.data() + n; arg += std::strlen(arg) + 1) {
+			argv.push_back(arg);
+		}
+		if(argv.empty()) {
+			return 126;
+		}
+		argv.push_back(nullptr);
+
+		pid_t child = fork();
+		if(child == -1) {
+			return 126;
+		}
+		if(child == 0) {
+			close(args.control);
+			for(int fd = 0; fd < 3; fd++) {
+				if(dup2(stdio[fd], fd) == -1) {
+					_exit(126);
+				}
+			}
+			_exit(exec_program(args, header, argv));
+		}
+		// The invoker sees the end of the output once the program and whatever it started are gone
+		for(int fd: stdio) {
+			close(fd);
+		}
+		int status;
+		while(waitpid(child, &status, 0) == -1) {
+			if(errno != EINTR) {
+				return 126;
+			}
+		}
+		send(args.control, &status, sizeof(status), MSG_NOSIGNAL);
+		return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+	}
+
+
+	// The clone shares nothing with the zygote, so the stack is copied on write like the rest of its memory
+	alignas(16) char shell_stack[256 * 1024];
+
+
+	zygote_report spawn_shell(const spawn_request& request, const sandbox_options& options, int& control, int& pidfd) {
+		uint64_t shell_id = request.shell_id;
+		zygote_report report{shell_id, -1, 0, 0, 0, 0};
+		auto directory = directory_of(options, shell_id);
+		std::error_code ec;
+		std::filesystem::remove_all(directory, ec);
+		if(mkdir(directory.c_str(), 0700) == -1 || chown(directory.c_str(), options.uid, options.gid) == -1) {
+			return report;
+		}
+
+		int pair[2];
+		if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) == -1) {
+			return report;
+		}
+		std::string directory_text = directory.string();
+		shell_args args{&options, directory_text.c_str(), pair[1]};
+		pid_t pid = clone(shell_main, shell_stack + sizeof(shell_stack), namespaces | SIGCHLD, &args);
+		close(pair[1]);
+		if(pid == -1) {
+			close(pair[0]);
+			return report;
+		}
+		// The shell only waits for its program, which the invoker cannot send before this report, so it is in its cgroup
+		// before anything runs
+		if(request.leaf != -1) {
+			if(!write_file(leaf_path(options, request.leaf) / "cgroup.procs", std::to_string(pid))) {
+				::kill(pid, SIGKILL);
+				close(pair[0]);
+				return report;
+			}
+		}
+		control = pair[0];
+#ifdef SYS_pidfd_open
+		pidfd = static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+#else
+		pidfd = -1;
+#endif
+		report.pid = pid;
+		return report;
+	}
+
+
+	[[noreturn]] void run_zygote(int sock, sandbox_options options) {
+		prctl(PR_SET_PDEATHSIG, SIGKILL);
+		// The invoker handles these and stops the zygote itself
+		signal(SIGINT, SIG_IGN);
+		signal(SIGHUP, SIG_IGN);
+		sigset_t mask;
+		sigemptyset(&mask);
+		sigaddset(&mask, SIGCHLD);
+		sigprocmask(SIG_BLOCK, &mask, nullptr);
+		int children = signalfd(-1, &mask, SFD_CLOEXEC);
+		if(children == -1) {
+			_exit(1);
+		}
+
+		std::unordered_map<pid_t, uint64_t> shell_ids;
+		for(;;) {
+			pollfd fds[2] = {{sock, POLLIN, 0}, {children, POLLIN, 0}};
+			if(::poll(fds, 2, -1) == -1) {
+				if(errno == EINTR) {
+					continue;
+				}
+				_exit(1);
+			}
+
+			if(fds[1].revents & POLLIN) {
+				signalfd_siginfo info;
+				if(read(children, &info, sizeof(info)) == -1 && errno != EAGAIN) {
+					_exit(1);
+				}
+				pid_t pid;
+				int status;
+				rusage usage;
+				while((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+					auto it = shell_ids.find(pid);
+					if(it == shell_ids.end()) {
+						continue;
+					}
+					uint64_t cpu_time_us = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * uint64_t{1000000} + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+					zygote_report report{it->second, pid, status, cpu_time_us, static_cast<uint64_t>(usage.ru_maxrss) * 1024, 1};
+					send_with_fds(sock, &report, sizeof(report), nullptr, 0);
+					shell_ids.erase(it);
+				}
+			}
+
+			if(fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+				spawn_request request;
+				ssize_t n = recv(sock, &request, sizeof(request), 0);
+				if(n == -1 && errno == EINTR) {
+					continue;
+				}
+				// The invoker has stopped the pool or is gone
+				if(n <= 0) {
+					for(auto& [pid, shell_id]: shell_ids) {
+						::kill(pid, SIGKILL);
+					}
+					_exit(0);
+				}
+				int handles[2] = {-1, -1};
+				zygote_report report = spawn_shell(request, options, handles[0], handles[1]);
+				if(report.pid != -1) {
+					shell_ids.emplace(report.pid, request.shell_id);
+				}
+				send_with_fds(sock, &report, sizeof(report), handles, report.pid == -1 ? 0 : handles[1] == -1 ? 1 : 2);
+				for(int fd: handles) {
+					if(fd != -1) {
+						close(fd);
+					}
+				}
+			}
+		}
+	}
+
+
+	// What a program is reported as once its shell went down with the zygote; the wait status of death by SIGKILL
+	sandbox_usage killed_usage(bool is_timed_out) {
+		return sandbox_usage{SIGKILL, std::chrono::microseconds{0}, 0, is_timed_out};
+	}
+}
+
+
+sandbox_pool::sandbox_pool(sandbox_options options_): options(std::move(options_)) {
+	// Shells left over from an earlier run are gone with their zygote
+	std::filesystem::create_directories(options.root);
+	for(auto& entry: std::filesystem::directory_iterator(options.root)) {
+		if(entry.path().filename().string().rfind("shell-", 0) == 0) {
+			std::filesystem::remove_all(entry.path());
+		}
+	}
+	// Leaves get the controllers' files only if the parent hands the controllers down
+	if(!options.cgroup_parent.empty() && !write_file(options.cgroup_parent / "cgroup.subtree_control", "+memory +pids")) {
+		std::cerr << "Could not enable the memory and pids controllers in " << options.cgroup_parent << std::endl;
+	}
+	int pair[2];
+	if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) == -1) {
+		throw std::system_error(errno, std::generic_category(), "Could not create the zygote socket");
+	}
+	zygote_pid = fork();
+	if(zygote_pid == -1) {
+		throw std::system_error(errno, std::generic_category(), "Could not fork the zygote");
+	}
+	if(zygote_pid == 0) {
+		close(pair[0]);
+		run_zygote(pair[1], options);
+	}
+	close(pair[1]);
+	zygote = pair[0];
+	fcntl(zygote, F_SETFL, fcntl(zygote, F_GETFL) | O_NONBLOCK);
+}
+
+
+sandbox_pool::~sandbox_pool() {
+	for(auto& [shell_id, state]: shells) {
+		close(state.control);
+		if(state.pidfd != -1) {
+			close(state.pidfd);
+		}
+	}
+	// The leaves themselves are reused by the next invoker
+	for(size_t index = 0; index < leaves.size(); index++) {
+		close_leaf(index);
+	}
+	if(zygote != -1) {
+		close(zygote);
+	}
+}
+
+
+void sandbox_pool::start() {
+	if(zygote == -1) {
+		return;
+	}
+	auto loop = uvw::Loop::getDefault();
+	poll = loop->resource<uvw::PollHandle>(zygote);
+	poll->on<uvw::PollEvent>([this](const uvw::PollEvent&, uvw::PollHandle&) {
+		receive();
+	});
+	poll->start(uvw::PollHandle::Event::READABLE);
+	// A zygote that cannot clone shells, e.g. for lack of privileges, is asked again only once a second
+	backoff_timer = loop->resource<uvw::TimerHandle>();
+	backoff_timer->on<uvw::TimerEvent>([this](const uvw::TimerEvent&, uvw::TimerHandle&) {
+		is_backing_off = false;
+		refill();
+	});
+	refill();
+}
+
+
+void sandbox_pool::stop() {
+	if(zygote == -1) {
+		return;
+	}
+	if(poll) {
+		poll->stop();
+		poll->close();
+		backoff_timer->stop();
+		backoff_timer->close();
+	}
+	for(auto& [shell_id, state]: shells) {
+		if(state.timer) {
+			state.timer->stop();
+			state.timer->close();
+		}
+	}
+	close(zygote);
+	zygote = -1;
+	waitpid(zygote_pid, nullptr, 0);
+
+	// The shells die with the zygote, but there is nobody left to report it
+	for(auto& [shell_id, state]: shells) {
+		if(state.result) {
+			state.result->set(killed_usage(state.is_timed_out));
+			state.result.reset();
+		}
+	}
+	ready.clear();
+	auto stranded = std::move(waiters);
+	waiters.clear();
+	for(auto& waiter: stranded) {
+		waiter.set(std::nullopt);
+	}
+}
+
+
+sandbox_shell sandbox_pool::shell_for(uint64_t shell_id) const {
+	return {shell_id, directory_of(options, shell_id)};
+}
+
+
+void sandbox_pool::refill() {
+	while(!is_backing_off && zygote != -1 && ready.size() + n_spawning < options.pool_size + waiters.size()) {
+		spawn_request request{next_shell_id, -1};
+		if(!options.cgroup_parent.empty()) {
+			auto leaf = take_leaf();
+			if(!leaf) {
+				std::cerr << "Could not set up a cgroup for a sandbox shell" << std::endl;
+				is_backing_off = true;
+				backoff_timer->start(std::chrono::seconds{1}, std::chrono::seconds{0});
+				break;
+			}
+			request.leaf = *leaf;
+		}
+		if(send(zygote, &request, sizeof(request), MSG_NOSIGNAL) == -1) {
+			if(request.leaf != -1) {
+				free_leaves.push_back(request.leaf);
+			}
+			break;
+		}
+		if(request.leaf != -1) {
+			spawning_leaves.emplace(next_shell_id, request.leaf);
+		}
+		next_shell_id++;
+		n_spawning++;
+	}
+}
+
+
+std::optional<size_t> sandbox_pool::take_leaf() {
+	if(free_leaves.empty()) {
+		free_leaves.push_back(leaves.size());
+		leaves.emplace_back();
+	}
+	size_t index = free_leaves.back();
+	if(leaves[index].cpu_stat == -1 && !open_leaf(index)) {
+		return std::nullopt;
+	}
+	free_leaves.pop_back();
+	return index;
+}
+
+
+// A leaf left over from an earlier invoker, or one whose peak cannot be reset, is removed first so that it starts
+// from scratch; a leaf that still has processes in it stays and is used as it is
+bool sandbox_pool::open_leaf(size_t index) {
+	auto path = leaf_path(options, index);
+	rmdir(path.c_str());
+	if(mkdir(path.c_str(), 0755) == -1 && errno != EEXIST) {
+		return false;
+	}
+	auto& leaf = leaves[index];
+	leaf = {};
+	write_file(path / "memory.swap.max", "0");
+	leaf.memory_peak = open((path / "memory.peak").c_str(), O_RDWR | O_CLOEXEC);
+	leaf.is_peak_resettable = leaf.memory_peak != -1;
+	if(leaf.memory_peak == -1) {
+		leaf.memory_peak = open((path / "memory.peak").c_str(), O_RDONLY | O_CLOEXEC);
+	}
+	leaf.memory_max = open((path / "memory.max").c_str(), O_WRONLY | O_CLOEXEC);
+	leaf.pids_max = open((path / "pids.max").c_str(), O_WRONLY | O_CLOEXEC);
+	leaf.cpu_stat = open((path / "cpu.stat").c_str(), O_RDONLY | O_CLOEXEC);
+	if(leaf.memory_peak == -1 || leaf.memory_max == -1 || leaf.pids_max == -1 || leaf.cpu_stat == -1) {
+		close_leaf(index);
+		return false;
+	}
+	return true;
+}
+
+
+void sandbox_pool::close_leaf(size_t index) {
+	auto& leaf = leaves[index];
+	for(int fd: {leaf.memory_peak, leaf.memory_max, leaf.pids_max, leaf.cpu_stat}) {
+		if(fd != -1) {
+			close(fd);
+		}
+	}
+	leaf = {};
+}
+
+
+// The shell is in the leaf already, so the peak starts from the little memory it uses while it waits
+bool sandbox_pool::prepare_leaf(cgroup_leaf& leaf, const sandbox_limits& limits) {
+	if(leaf.memory_limit != limits.memory) {
+		if(!write_at(leaf.memory_max, std::to_string(limits.memory))) {
+			return false;
+		}
+		leaf.memory_limit = limits.memory;
+	}
+	if(leaf.process_limit != limits.n_processes) {
+		if(!write_at(leaf.pids_max, std::to_string(limits.n_processes))) {
+			return false;
+		}
+		leaf.process_limit = limits.n_processes;
+	}
+	if(leaf.is_peak_resettable && !write_at(leaf.memory_peak, "0")) {
+		return false;
+	}
+	auto cpu_usage = read_at(leaf.cpu_stat, "usage_usec");
+	if(!cpu_usage) {
+		return false;
+	}
+	leaf.cpu_usage = *cpu_usage;
+	return true;
+}
+
+
+// The shell is PID 1 of its namespace, so every process of the program is gone by the time the shell is reaped, and
+// the leaf is empty and can take the next shell
+void sandbox_pool::account(size_t index, sandbox_usage& usage) {
+	auto& leaf = leaves[index];
+	auto cpu_usage = read_at(leaf.cpu_stat, "usage_usec");
+	auto peak = read_at(leaf.memory_peak, "");
+	if(cpu_usage && peak) {
+		usage.cpu_time = std::chrono::microseconds{*cpu_usage - leaf.cpu_usage};
+		usage.max_memory = *peak;
+	}
+	if(!leaf.is_peak_resettable) {
+		close_leaf(index);
+	}
+}
+
+
+void sandbox_pool::receive() {
+	for(;;) {
+		zygote_report report;
+		int handles[2];
+		ssize_t n = receive_with_fds(zygote, &report, sizeof(report), handles, 2);
+		if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		}
+		if(n != static_cast<ssize_t>(sizeof(report))) {
+			std::cerr << "The sandbox zygote went away, no more shells" << std::endl;
+			stop();
+			return;
+		}
+		if(report.is_exit) {
+			exited(report.shell_id, {report.status, std::chrono::microseconds{report.cpu_time_us}, report.max_memory, false});
+		} else {
+			n_spawning--;
+			spawned(report.shell_id, report.pid, handles[0], handles[1]);
+		}
+	}
+	refill();
+}
+
+
+void sandbox_pool::spawned(uint64_t shell_id, pid_t pid, int control, int pidfd) {
+	auto leaf = spawning_leaves.extract(shell_id);
+	if(pid == -1 || control == -1) {
+		if(leaf) {
+			free_leaves.push_back(leaf.mapped());
+		}
+		if(!is_backing_off) {
+			std::cerr << "Could not set up a sandbox shell" << std::endl;
+			is_backing_off = true;
+			backoff_timer->start(std::chrono::seconds{1}, std::chrono::seconds{0});
+		}
+		return;
+	}
+	shells.emplace(shell_id, shell_state{pid, control, pidfd, leaf ? std::optional<size_t>(leaf.mapped()) : std::nullopt, std::nullopt, nullptr});
+	if(waiters.empty()) {
+		ready.push_back(shell_id);
+	} else {
+		auto waiter = std::move(waiters.front());
+		waiters.pop_front();
+		waiter.set(std::optional<sandbox_shell>(shell_for(shell_id)));
+	}
+}
+
+
+void sandbox_pool::exited(uint64_t shell_id, sandbox_usage usage) {
+	auto node = shells.extract(shell_id);
+	if(!node) {
+		return;
+	}
+	auto& state = node.mapped();
+	// How the program ended, if it got to run and the shell was not killed first
+	int status;
+	if(recv(state.control, &status, sizeof(status), MSG_DONTWAIT) == static_cast<ssize_t>(sizeof(status))) {
+		usage.status = status;
+	}
+	close(state.control);
+	if(state.pidfd != -1) {
+		close(state.pidfd);
+	}
+	if(state.timer) {
+		state.timer->stop();
+		state.timer->close();
+	}
+	// A shell that dies before it was used is simply replaced
+	ready.erase(std::remove(ready.begin(), ready.end(), shell_id), ready.end());
+	std::error_code ec;
+	std::filesystem::remove_all(directory_of(options, shell_id), ec);
+	if(state.leaf) {
+		if(state.result) {
+			account(*state.leaf, usage);
+		}
+		free_leaves.push_back(*state.leaf);
+	}
+	if(state.result) {
+		usage.is_timed_out = state.is_timed_out;
+		state.result->set(std::move(usage));
+	}
+}
+
+
+// A pidfd cannot hit another process that reused the pid after the shell was reaped
+void sandbox_pool::kill(shell_state& state) {
+#ifdef SYS_pidfd_send_signal
+	if(state.pidfd != -1) {
+		syscall(SYS_pidfd_send_signal, state.pidfd, SIGKILL, nullptr, 0);
+		return;
+	}
+#endif
+	::kill(state.pid, SIGKILL);
+}
+
+
+async::promise<std::optional<sandbox_shell>> sandbox_pool::acquire() {
+	async::promise<std::optional<sandbox_shell>> result;
+	if(zygote == -1) {
+		result.set(std::nullopt);
+	} else if(ready.empty()) {
+		waiters.push_back(result);
+		refill();
+	} else {
+		uint64_t shell_id = ready.front();
+		ready.pop_front();
+		result.set(std::optional<sandbox_shell>(shell_for(shell_id)));
+		refill();
+	}
+	return result;
+}
+
+
+async::promise<sandbox_usage> sandbox_pool::run(const sandbox_shell& shell, const std::vector<std::string>& argv, const sandbox_limits& limits, std::array<int, 3> stdio) {
+	async::promise<sandbox_usage> result;
+	// The shell may have exited since it was handed out, and with the zygote gone nobody reports it
+	auto it = shells.find(shell.id);
+	if(it == shells.end() || zygote == -1) {
+		result.set(killed_usage(false));
+		return result;
+	}
+	auto& state = it->second;
+	state.result = result;
+
+	bool has_cgroup = state.leaf.has_value();
+	if(has_cgroup && !prepare_leaf(leaves[*state.leaf], limits)) {
+		std::cerr << "Could not set the limits of sandbox shell #" << shell.id << std::endl;
+		kill(state);
+		return result;
+	}
+	std::string message(sizeof(exec_header), '\0');
+	exec_header header{static_cast<uint64_t>(limits.cpu_time.count()), has_cgroup ? 0 : limits.memory, limits.file_size, static_cast<uint32_t>(argv.size())};
+	std::memcpy(message.data(), &header, sizeof(header));
+	for(auto& arg: argv) {
+		message += arg;
+		message += '\0';
+	}
+	// The shell exits if it does not get its program, and the exit is reported as usual
+	if(message.size() > max_exec_size || send_with_fds(state.control, message.data(), message.size(), stdio.data(), stdio.size()) == -1) {
+		kill(state);
+		return result;
+	}
+
+	state.timer = uvw::Loop::getDefault()->resource<uvw::TimerHandle>();
+	state.timer->on<uvw::TimerEvent>([this, shell_id = shell.id](const uvw::TimerEvent&, uvw::TimerHandle&) {
+		auto it = shells.find(shell_id);
+		if(it != shells.end()) {
+			it->second.is_timed_out = true;
+			kill(it->second);
+		}
+	});
+	state.timer->start(limits.wall_time, std::chrono::milliseconds{0});
+	return result;
+}
+
+
+void sandbox_pool::discard(const sandbox_shell& shell) {
+	auto it = shells.find(shell.id);
+	if(it != shells.end()) {
+		kill(it->second);
+	}
+}
@@ -0,0 +1,83 @@
+#ifndef REGISTRY_CACHE_HPP
+#define REGISTRY_CACHE_HPP
+
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+#include "rpc/buffer.hpp"
+
+
+namespace storage {
+	struct cache_key {
+		std::string data_class;
+		uint64_t id;
+
+		bool operator==(const cache_key& other) const = default;
+	};
+
+	struct cache_key_hash {
+		size_t operator()(const cache_key& key) const {
+			return std::hash<std::string>{}(key.data_class) ^ (std::hash<uint64_t>{}(key.id) * 0x9e3779b97f4a7c15);
+		}
+	};
+
+
+	struct cache_counters {
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+		uint64_t evictions = 0;
+		uint64_t size = 0;
+		uint64_t capacity = 0;
+		uint64_t n_entries = 0;
+	};
+
+
+	// S3-FIFO: new entries land in a small probationary queue and are only promoted to the main queue if they are hit
+	// again before falling out of it, so a one-off scan over many blobs cannot flush the hot set. Keys evicted from the
+	// small queue are remembered in a ghost queue and go straight to the main queue if they come back soon.
+	class cache {
+		struct entry {
+			cache_key key;
+			rpc::blob data;
+			uint8_t freq;
+		};
+		enum class location {
+			small,
+			main
+		};
+
+		std::list<entry> small_queue, main_queue;
+		std::list<cache_key> ghost_queue;
+		std::unordered_map<cache_key, std::pair<location, std::list<entry>::iterator>, cache_key_hash> entries;
+		std::unordered_map<cache_key, std::list<cache_key>::iterator, cache_key_hash> ghosts;
+
+		size_t capacity;
+		size_t small_size = 0, main_size = 0;
+		cache_counters counters;
+
+		size_t small_capacity() const;
+		void evict();
+		void evict_small();
+		void evict_main();
+		void remember_ghost(cache_key key);
+
+	public:
+		explicit cache(size_t capacity);
+
+		std::optional<rpc::blob> get(const cache_key& key);
+		bool contains(const cache_key& key) const;
+		void put(const cache_key& key, rpc::blob data);
+		void erase(const cache_key& key);
+
+		cache_counters stats() const;
+	};
+}
+
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef REGISTRY_ENGINE_HPP
+#define REGISTRY_ENGINE_HPP
+
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <tcb/span.hpp>
+
+#include "rpc/buffer.hpp"
+
+#include "journal.hpp"
+#include "pack.hpp"
+#include "storage.hpp"
+
+
+namespace storage {
+	struct engine_options {
+		size_t pack_threshold = 256 * 1024;
+		size_t segment_size = 64 * 1024 * 1024;
+		std::chrono::seconds compaction_interval{60};
+		double compaction_live_ratio = 0.5;
+		int gc_every_n_compactions = 60;
+		// Without the journal, writes survive a crash only if the kernel happened to write them back
+		bool is_durable = true;
+		// How long the journal waits for more writes to share a sync with; with zero, writes that arrive during a sync
+		// share the next one
+		std::chrono::microseconds group_commit_delay{0};
+		// The journal is emptied once it grows past this, after syncing everything it covers
+		size_t checkpoint_size = 64 * 1024 * 1024;
+	};
+
+
+	// Small blobs are appended to pack files, large ones keep going to standalone files. A background thread compacts
+	// the packs and collects standalone objects that are not referenced anymore.
+	//
+	// Every write is also appended to a journal, which is what makes it durable: small blobs are journalled in full, large
+	// ones are synced to their object file first and journalled as a reference to it. The packs and refs themselves are
+	// synced only at checkpoints, after which the journal is emptied; on startup, whatever the journal still holds is
+	// applied again.
+	class engine {
+		std::filesystem::path root;
+		engine_options options;
+		blob_store standalone;
+		pack_store packs;
+		std::optional<journal> wal;
+
+		// Writes hold it shared, checkpoints exclusively
+		std::shared_mutex checkpoint_mutex;
+
+		// Stores run concurrently on the thread pool; two stores of the same key that land in different backends must
+		// not interleave, or both copies could end up erased
+		std::mutex key_locks[64];
+
+		std::mutex& key_lock(const std::string& data_class, uint64_t id);
+
+		std::mutex maintenance_mutex;
+		std::condition_variable maintenance_cv;
+		bool is_stopping = false;
+		bool is_checkpoint_requested = false;
+		std::thread maintenance_thread;
+
+		void maintenance_loop();
+		void replay(const journal_record& record);
+		void checkpoint();
+		void request_checkpoint();
+
+	public:
+		engine(std::filesystem::path root, engine_options options);
+		~engine();
+
+		// Writes return the journal position that has to become durable before they are; 0 if there is nothing to wait
+		// for. The result of a write is visible to readers right away, before it is durable.
+		uint64_t store(const std::string& data_class, uint64_t id, tcb::span<const std::byte> data);
+		std::optional<rpc::blob> retrieve(const std::string& data_class, uint64_t id);
+		std::optional<object_info> stat(const std::string& data_class, uint64_t id);
+		// nullopt if there was no such key
+		std::optional<uint64_t> erase(const std::string& data_class, uint64_t id);
+		std::vector<std::pair<std::string, uint64_t>> list_keys();
+		// Reads the blobs in on-disk order rather than in the order of keys; the results are in the order of keys
+		std::vector<std::optional<rpc::blob>> retrieve_many(const std::vector<std::pair<std::string, uint64_t>>& keys);
+
+		void wait_durable(uint64_t position);
+		// Called from the journal's thread with the new durable position after every sync
+		void set_durability_listener(std::function<void(uint64_t)> listener);
+	};
+}
+
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef REGISTRY_IO_HPP
+#define REGISTRY_IO_HPP
+
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+
+#include <uvw.hpp>
+
+#include "common/async.hpp"
+#include "rpc/buffer.hpp"
+
+
+namespace storage {
+	// Log-linear histogram with four buckets per octave, good enough for percentiles within ~20%
+	class latency_histogram {
+		static constexpr int n_buckets = 4 * 40;
+
+		std::array<uint64_t, n_buckets> buckets{};
+		uint64_t count = 0;
+		uint64_t max_us = 0;
+
+		static int bucket_of(uint64_t us);
+		static uint64_t upper_bound_of(int bucket);
+
+	public:
+		void record(std::chrono::microseconds latency);
+		uint64_t percentile(double p) const;
+		uint64_t size() const;
+		uint64_t max() const;
+	};
+
+
+	// Runs blocking disk operations on the libuv thread pool. At most max_in_flight operations are handed to the pool at
+	// once so that a burst of cold reads cannot occupy every thread (libuv also uses the pool for DNS and fs requests);
+	// the rest wait in FIFO order.
+	class io_scheduler {
+		size_t max_in_flight;
+		size_t n_in_flight = 0;
+		std::deque<std::function<void()>> pending;
+		std::map<std::string, latency_histogram> latencies;
+
+		void finish();
+
+	public:
+		explicit io_scheduler(size_t max_in_flight);
+
+		// task runs on a worker thread and must not throw. If the pool refuses it, it runs on the calling thread instead,
+		// so that the result is always set.
+		template<typename T> async::promise<T> submit(std::string operation, std::function<T()> task) {
+			async::promise<T> result;
+			auto started = std::chrono::steady_clock::now();
+			auto launch = [this, operation = std::move(operation), task = std::make_shared<std::function<T()>>(std::move(task)), result, started]() mutable {
+				auto value = std::make_shared<std::optional<T>>();
+				auto req = uvw::Loop::getDefault()->resource<uvw::WorkReq>([task, value]() {
+					*value = (*task)();
+				});
+				req->template once<uvw::WorkEvent>([this, operation = std::move(operation), value, result, started](const uvw::WorkEvent&, uvw::WorkReq&) mutable {
+					latencies[operation].record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started));
+					finish();
+					result.set(std::move(**value));
+				});
+				req->template once<uvw::ErrorEvent>([this, task, result](const uvw::ErrorEvent& ev, uvw::WorkReq&) mutable {
+					std::cerr << "Could not queue disk operation, running it on the event loop: " << ev.what() << std::endl;
+					finish();
+					result.set((*task)());
+				});
+				req->queue();
+			};
+			if(n_in_flight < max_in_flight) {
+				n_in_flight++;
+				launch();
+			} else {
+				pending.push_back(std::move(launch));
+			}
+			return result;
+		}
+
+		bool is_busy() const;
+		const std::map<std::string, latency_histogram>& stats() const;
+	};
+
+
+	// Touches every page of a blob so that the page faults happen on the calling worker thread rather than later, when
+	// the event loop hands the mapping to write(2)
+	void prefault(const rpc::blob& data);
+}
+
+
+#endif
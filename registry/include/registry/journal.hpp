@@ -0,0 +1,84 @@
+#ifndef REGISTRY_JOURNAL_HPP
+#define REGISTRY_JOURNAL_HPP
+
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <tcb/span.hpp>
+
+#include "common/sha256.hpp"
+
+
+namespace storage {
+	enum class journal_record_type: uint32_t {
+		// A blob stored in full; used for blobs that go to pack files
+		put = 1,
+		// A ref to an object that was made durable on its own before the record was written; used for large blobs
+		link = 2,
+		erase = 3
+	};
+
+
+	struct journal_record {
+		journal_record_type type;
+		std::string data_class;
+		uint64_t id;
+		sha256::digest digest;
+		tcb::span<const std::byte> data;
+	};
+
+
+	// Write-ahead journal with group commit. append() only writes to the file; a committer thread fdatasyncs whatever has
+	// been appended so far, so all writes that arrive while one sync is running share the next one. Positions are
+	// logical and keep growing across reset(), so a position identifies a commit point for the lifetime of the process.
+	class journal {
+		std::filesystem::path path;
+		int fd = -1;
+		std::chrono::microseconds commit_delay;
+
+		std::mutex mutex;
+		std::condition_variable appended_cv;
+		std::condition_variable synced_cv;
+		uint64_t base = 0;
+		uint64_t size = 0;
+		uint64_t synced = 0;
+		bool is_stopping = false;
+		std::function<void(uint64_t)> on_synced;
+		std::thread committer;
+
+		void commit_loop();
+
+	public:
+		journal(std::filesystem::path path, std::chrono::microseconds commit_delay);
+		journal(const journal&) = delete;
+		journal& operator=(const journal&) = delete;
+		~journal();
+
+		// Calls apply for every intact record in order and cuts off a torn tail. Must be called before anything is
+		// appended.
+		size_t replay(const std::function<void(const journal_record&)>& apply);
+
+		// Returns the position the record ends at; the record is durable once synced_position() reaches it
+		uint64_t append(const journal_record& record);
+		uint64_t synced_position();
+		void wait(uint64_t position);
+		// Called from the committer thread after every sync
+		void set_listener(std::function<void(uint64_t)> listener);
+
+		// Waits for everything appended so far to become durable and empties the file. The caller must make sure the
+		// records have been persisted elsewhere and that nothing is appended concurrently.
+		void reset();
+		uint64_t file_size();
+	};
+}
+
+
+#endif
@@ -0,0 +1,205 @@
+#ifndef REGISTRY_MAPPED_TABLE_HPP
+#define REGISTRY_MAPPED_TABLE_HPP
+
+
+#include <cerrno>
+#include <cstdint>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+namespace storage {
+	// An open-addressing hash table that lives in an mmapped file, so it is usable right after startup without being
+	// loaded. Entry must be trivially copyable, all-zero when empty, and provide:
+	//     static uint64_t hash_of(const Key&); uint64_t hash() const; bool matches(const Key&) const;
+	//     uint32_t state; // 0 = empty, 1 = live, 2 = removed
+	template<typename Entry> class mapped_table {
+		struct header {
+			uint64_t magic;
+			uint64_t capacity;
+			uint64_t n_used;
+			uint64_t n_live;
+		};
+
+		static constexpr uint64_t magic = 0x736d6f6c74626c31; // "smoltbl1"
+
+		std::filesystem::path path;
+		int fd = -1;
+		void* addr = nullptr;
+		size_t mapped_size = 0;
+		header* hdr = nullptr;
+		Entry* slots = nullptr;
+
+
+		[[noreturn]] static void throw_errno(const std::string& what, const std::filesystem::path& path) {
+			throw std::system_error(errno, std::generic_category(), what + " " + path.string());
+		}
+
+		static size_t file_size(uint64_t capacity) {
+			return sizeof(header) + capacity * sizeof(Entry);
+		}
+
+		void map(int new_fd, size_t size) {
+			void* new_addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, new_fd, 0);
+			if(new_addr == MAP_FAILED) {
+				throw_errno("Could not mmap", path);
+			}
+			unmap();
+			fd = new_fd;
+			addr = new_addr;
+			mapped_size = size;
+			hdr = static_cast<header*>(addr);
+			slots = reinterpret_cast<Entry*>(hdr + 1);
+		}
+
+		void unmap() {
+			if(addr) {
+				munmap(addr, mapped_size);
+				addr = nullptr;
+			}
+			if(fd != -1) {
+				close(fd);
+				fd = -1;
+			}
+		}
+
+		static int create_file(const std::filesystem::path& path, uint64_t capacity) {
+			int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+			if(fd == -1) {
+				throw_errno("Could not create", path);
+			}
+			if(ftruncate(fd, file_size(capacity)) == -1) {
+				close(fd);
+				throw_errno("Could not resize", path);
+			}
+			header hdr{magic, capacity, 0, 0};
+			if(pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+				close(fd);
+				throw_errno("Could not write to", path);
+			}
+			return fd;
+		}
+
+		template<typename F> Entry* probe(uint64_t hash, F&& stop) const {
+			uint64_t mask = hdr->capacity - 1;
+			for(uint64_t i = hash & mask;; i = (i + 1) & mask) {
+				if(stop(slots[i])) {
+					return &slots[i];
+				}
+			}
+		}
+
+		void rebuild(uint64_t new_capacity) {
+			std::filesystem::path new_path = path;
+			new_path += ".new";
+			int new_fd = create_file(new_path, new_capacity);
+			void* new_addr = mmap(nullptr, file_size(new_capacity), PROT_READ | PROT_WRITE, MAP_SHARED, new_fd, 0);
+			if(new_addr == MAP_FAILED) {
+				close(new_fd);
+				throw_errno("Could not mmap", new_path);
+			}
+			header* new_hdr = static_cast<header*>(new_addr);
+			Entry* new_slots = reinterpret_cast<Entry*>(new_hdr + 1);
+			for(uint64_t i = 0; i < hdr->capacity; i++) {
+				if(slots[i].state == 1) {
+					uint64_t mask = new_capacity - 1;
+					uint64_t j = slots[i].hash() & mask;
+					while(new_slots[j].state != 0) {
+						j = (j + 1) & mask;
+					}
+					new_slots[j] = slots[i];
+					new_hdr->n_used++;
+					new_hdr->n_live++;
+				}
+			}
+			munmap(new_addr, file_size(new_capacity));
+			if(rename(new_path.c_str(), path.c_str()) == -1) {
+				close(new_fd);
+				throw_errno("Could not replace", path);
+			}
+			map(new_fd, file_size(new_capacity));
+		}
+
+	public:
+		explicit mapped_table(std::filesystem::path path_, uint64_t initial_capacity = 1024): path(std::move(path_)) {
+			int new_fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+			if(new_fd == -1) {
+				if(errno != ENOENT) {
+					throw_errno("Could not open", path);
+				}
+				new_fd = create_file(path, initial_capacity);
+			}
+			header file_hdr;
+			if(pread(new_fd, &file_hdr, sizeof(file_hdr), 0) != sizeof(file_hdr) || file_hdr.magic != magic) {
+				close(new_fd);
+				throw std::runtime_error("Corrupted table " + path.string());
+			}
+			map(new_fd, file_size(file_hdr.capacity));
+		}
+
+		mapped_table(const mapped_table&) = delete;
+		mapped_table& operator=(const mapped_table&) = delete;
+
+		~mapped_table() {
+			unmap();
+		}
+
+
+		template<typename Key> Entry* find(const Key& key) {
+			Entry* entry = probe(Entry::hash_of(key), [&](const Entry& entry) {
+				return entry.state == 0 || (entry.state == 1 && entry.matches(key));
+			});
+			return entry->state == 1 ? entry : nullptr;
+		}
+
+		// Returns a fresh slot for a key that is known to be absent. The returned pointer, like any other pointer into the
+		// table, is invalidated by the next insert().
+		template<typename Key> Entry* insert(const Key& key) {
+			if((hdr->n_used + 1) * 10 > hdr->capacity * 7) {
+				// Removed entries count towards the load factor too; if they are the reason the table is full, dropping
+				// them is enough
+				rebuild(hdr->n_live * 2 > hdr->n_used ? hdr->capacity * 2 : hdr->capacity);
+			}
+			Entry* entry = probe(Entry::hash_of(key), [&](const Entry& entry) {
+				return entry.state != 1;
+			});
+			if(entry->state == 0) {
+				hdr->n_used++;
+			}
+			hdr->n_live++;
+			*entry = Entry{};
+			entry->state = 1;
+			return entry;
+		}
+
+		void erase(Entry* entry) {
+			entry->state = 2;
+			hdr->n_live--;
+		}
+
+		template<typename F> void for_each(F&& f) {
+			for(uint64_t i = 0; i < hdr->capacity; i++) {
+				if(slots[i].state == 1) {
+					f(slots[i]);
+				}
+			}
+		}
+
+		uint64_t size() const {
+			return hdr->n_live;
+		}
+
+		void sync() {
+			msync(addr, mapped_size, MS_SYNC);
+		}
+	};
+}
+
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef REGISTRY_PACK_HPP
+#define REGISTRY_PACK_HPP
+
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <tcb/span.hpp>
+
+#include "common/sha256.hpp"
+#include "rpc/buffer.hpp"
+
+#include "mapped_table.hpp"
+#include "storage.hpp"
+
+
+namespace storage {
+	// Log-structured storage for small blobs. Blobs are appended to segment files as
+	//     [magic, length, SHA-256][data]
+	// records. Two mmapped tables map (data class, id) to a SHA-256 and a SHA-256 to a (segment, offset, length)
+	// location with a reference count, so identical blobs are stored once. Overwritten or removed blobs leave dead
+	// records behind, which compact() reclaims by moving the live records of mostly-dead segments to the active segment.
+	class pack_store {
+	public:
+		struct key {
+			uint32_t class_id;
+			uint64_t id;
+		};
+
+	private:
+		struct index_entry {
+			uint32_t state;
+			uint32_t class_id;
+			uint64_t id;
+			sha256::digest digest;
+
+			static uint64_t hash_of(const key& k);
+			uint64_t hash() const;
+			bool matches(const key& k) const;
+		};
+
+		struct content_entry {
+			uint32_t state;
+			uint32_t refcount;
+			uint32_t segment;
+			uint32_t reserved;
+			uint64_t offset;
+			uint64_t length;
+			sha256::digest digest;
+
+			static uint64_t hash_of(const sha256::digest& digest);
+			uint64_t hash() const;
+			bool matches(const sha256::digest& digest) const;
+		};
+
+		struct segment;
+
+		std::filesystem::path root;
+		size_t segment_size;
+
+		std::mutex mutex;
+		mapped_table<index_entry> index;
+		mapped_table<content_entry> contents;
+		std::vector<std::string> class_names;
+		std::unordered_map<std::string, uint32_t> class_ids;
+
+		std::map<uint32_t, std::shared_ptr<segment>> segments;
+		std::set<uint32_t> sealed_segments;
+		uint32_t active_segment;
+		uint64_t active_size;
+		int active_fd = -1;
+
+		std::filesystem::path segment_path(uint32_t segment) const;
+		std::shared_ptr<segment> get_segment(uint32_t segment);
+		void open_active_segment(uint32_t segment);
+		std::pair<uint32_t, uint64_t> append(const sha256::digest& digest, tcb::span<const std::byte> data);
+		std::optional<uint32_t> find_class(const std::string& data_class);
+		uint32_t intern_class(const std::string& data_class);
+		bool is_intact(const content_entry& content, tcb::span<const std::byte> data);
+		void release(const sha256::digest& digest);
+
+	public:
+		static constexpr size_t record_header_size = 48;
+
+		pack_store(std::filesystem::path root, size_t segment_size);
+		~pack_store();
+
+		// With verify set, an existing record of the same blob is checked against data and written again if it is
+		// damaged; used when replaying the journal
+		void store(const std::string& data_class, uint64_t id, tcb::span<const std::byte> data, const sha256::digest& digest, bool verify = false);
+		std::optional<rpc::blob> retrieve(const std::string& data_class, uint64_t id);
+		std::optional<object_info> stat(const std::string& data_class, uint64_t id);
+		bool erase(const std::string& data_class, uint64_t id);
+		std::vector<std::pair<std::string, uint64_t>> list_keys();
+		// Segment and offset of a packed blob, for ordering batched reads
+		std::optional<std::pair<uint32_t, uint64_t>> locate(const std::string& data_class, uint64_t id);
+
+		// Makes every store and erase so far durable
+		void sync();
+
+		// Rewrites sealed segments whose live fraction is below max_live_ratio; returns the number of bytes reclaimed
+		size_t compact(double max_live_ratio);
+	};
+}
+
+
+#endif
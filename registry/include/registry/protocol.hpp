@@ -0,0 +1,88 @@
+#ifndef REGISTRY_PROTOCOL_HPP
+#define REGISTRY_PROTOCOL_HPP
+
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "rpc/reflection.hpp"
+
+
+struct registry_cache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t size;
+	uint64_t capacity;
+	uint64_t n_entries;
+};
+RPC_DEFINE_STRUCT(registry_cache_stats, hits, misses, evictions, size, capacity, n_entries)
+
+
+struct registry_io_stats {
+	std::string operation;
+	uint64_t count;
+	uint64_t p50_us;
+	uint64_t p99_us;
+	uint64_t max_us;
+};
+RPC_DEFINE_STRUCT(registry_io_stats, operation, count, p50_us, p99_us, max_us)
+
+
+struct registry_key {
+	std::string data_class;
+	uint64_t id;
+};
+RPC_DEFINE_STRUCT(registry_key, data_class, id)
+
+
+struct registry_entry {
+	std::string data_class;
+	uint64_t id;
+	std::vector<std::byte> data;
+};
+RPC_DEFINE_STRUCT(registry_entry, data_class, id, data)
+
+
+// index is the position of the key in the request; results arrive in no particular order
+struct registry_item {
+	uint64_t index;
+	std::optional<std::vector<std::byte>> data;
+};
+RPC_DEFINE_STRUCT(registry_item, index, data)
+
+
+// sha256 is the SHA-256 of the contents, so clients can tell whether a copy they hold is still current
+struct registry_stat {
+	uint64_t size;
+	std::array<uint8_t, 32> sha256;
+};
+RPC_DEFINE_STRUCT(registry_stat, size, sha256)
+
+
+RPC_PROTOCOL(registry_protocol,
+	bool RPC_METHOD(store)(std::string data_class, uint64_t id, std::vector<std::byte> data);
+	std::optional<std::vector<std::byte>> RPC_METHOD(retrieve)(std::string data_class, uint64_t id);
+	std::optional<registry_stat> RPC_METHOD(stat)(std::string data_class, uint64_t id);
+	std::optional<std::vector<std::byte>> RPC_METHOD(retrieve_range)(std::string data_class, uint64_t id, uint64_t offset, uint64_t length);
+	// A missing object yields a single nullopt, an existing one its contents in chunks of up to 1 MiB
+	rpc::stream<std::optional<std::vector<std::byte>>> RPC_METHOD(retrieve_stream)(std::string data_class, uint64_t id);
+	bool RPC_METHOD(erase)(std::string data_class, uint64_t id);
+	// Lets only one of several clients that all miss a key produce it. Resolves to false while another client's claim on
+	// the key holds, which is until the key is durably stored or ttl_ms pass. Claims are kept in memory by the node that
+	// owns the key, so a restart forgets them, which costs no more than producing the object twice.
+	bool RPC_METHOD(claim)(std::string data_class, uint64_t id, uint32_t ttl_ms);
+	// Every key stored on this node, in batches; meant for maintenance tools rather than for the judge
+	rpc::stream<std::vector<registry_key>> RPC_METHOD(list_keys)();
+	std::vector<bool> RPC_METHOD(store_many)(std::vector<registry_entry> entries);
+	rpc::stream<std::vector<registry_item>> RPC_METHOD(retrieve_many)(std::vector<registry_key> keys);
+	registry_cache_stats RPC_METHOD(cache_stats)();
+	std::vector<registry_io_stats> RPC_METHOD(io_stats)();
+)
+
+
+#endif
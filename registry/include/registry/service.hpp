@@ -0,0 +1,105 @@
+#ifndef REGISTRY_SERVICE_HPP
+#define REGISTRY_SERVICE_HPP
+
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <uvw.hpp>
+
+#include "common/async.hpp"
+#include "rpc/buffer.hpp"
+#include "rpc/serialization.hpp"
+#include "rpc/stream.hpp"
+
+#include "cache.hpp"
+#include "engine.hpp"
+#include "io.hpp"
+#include "protocol.hpp"
+
+
+// What the server sends for registry_item, without copying the blob
+struct registry_blob_item {
+	uint64_t index;
+	std::optional<rpc::blob> data;
+};
+RPC_DEFINE_SERIALIZE(registry_blob_item, index, data)
+
+
+struct registry_options {
+	storage::engine_options engine;
+	size_t cache_size = 256 * 1024 * 1024;
+	size_t max_io_in_flight = 16;
+	size_t readahead = 4;
+};
+
+
+// Glues the storage engine, the hot-blob cache and the I/O scheduler together. Lives on the event loop thread; only
+// the engine is touched from worker threads.
+class registry_service {
+	storage::engine blobs;
+	storage::cache hot_blobs;
+	storage::io_scheduler io;
+	size_t readahead;
+
+	// Batched reads are split into jobs of this many cache misses, so that results start coming back before the whole
+	// batch has been read and the batch is spread over several worker threads
+	static constexpr size_t retrieve_batch_size = 32;
+	static constexpr size_t stream_chunk_size = 1024 * 1024;
+	static constexpr size_t list_batch_size = 4096;
+
+	// A read that started before a store finished must not put the old blob into the cache
+	uint64_t n_stores_finished = 0;
+	using read_waiters = std::vector<async::promise<std::optional<rpc::blob>>>;
+	// Retrieves of a key join the read in flight, if any. A store detaches it, so that retrieves that come after the
+	// store do not get the old blob; those that had joined it still do.
+	std::unordered_map<storage::cache_key, std::shared_ptr<read_waiters>, storage::cache_key_hash> reads_in_flight;
+	std::unordered_map<std::string, uint64_t> last_retrieved_ids;
+	// Expiry of every claim; expired ones are pruned whenever the map has doubled
+	std::unordered_map<storage::cache_key, std::chrono::steady_clock::time_point, storage::cache_key_hash> claims;
+	size_t claims_pruned_at = 0;
+
+	// Writes are acknowledged once the journal is synced past them. The engine reports syncs from its own thread, which
+	// wakes the loop through durability_signal.
+	std::atomic<uint64_t> durable_position = 0;
+	std::multimap<uint64_t, std::function<void()>> durability_waiters;
+	std::shared_ptr<uvw::AsyncHandle> durability_signal;
+
+	void when_durable(uint64_t position, std::function<void()> callback);
+	void flush_durable();
+	async::promise<std::optional<rpc::blob>> load(storage::cache_key key);
+	void read_ahead(const std::string& data_class, uint64_t id);
+	void stream_from(rpc::stream<std::optional<rpc::blob>> result, rpc::blob data, size_t offset);
+
+public:
+	registry_service(std::filesystem::path data_dir, registry_options options);
+
+	void stop();
+
+	async::promise<bool> store(std::string data_class, uint64_t id, std::vector<std::byte> data);
+	async::promise<std::optional<rpc::blob>> retrieve(std::string data_class, uint64_t id);
+	async::promise<std::optional<registry_stat>> stat(std::string data_class, uint64_t id);
+	async::promise<std::optional<rpc::blob>> retrieve_range(std::string data_class, uint64_t id, uint64_t offset, uint64_t length);
+	rpc::stream<std::optional<rpc::blob>> retrieve_stream(std::string data_class, uint64_t id);
+	async::promise<bool> erase(std::string data_class, uint64_t id);
+	bool claim(std::string data_class, uint64_t id, std::chrono::milliseconds ttl);
+	rpc::stream<std::vector<registry_key>> list_keys();
+	async::promise<std::vector<bool>> store_many(std::vector<registry_entry> entries);
+	rpc::stream<std::vector<registry_blob_item>> retrieve_many(std::vector<registry_key> keys);
+
+	registry_cache_stats cache_stats() const;
+	std::vector<registry_io_stats> io_stats() const;
+};
+
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef REGISTRY_STORAGE_HPP
+#define REGISTRY_STORAGE_HPP
+
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <tcb/span.hpp>
+
+#include "common/sha256.hpp"
+#include "rpc/buffer.hpp"
+
+
+namespace storage {
+	struct object_info {
+		uint64_t size;
+		sha256::digest digest;
+	};
+
+
+	// Content-addressed blob store. The on-disk layout is
+	//     objects/ab/abcdef...  - blob contents, named by SHA-256
+	//     refs/<class>/xx/<id>  - hard links to objects; the link count doubles as a reference count
+	//     tmp/                  - scratch space for atomic writes
+	// Lookups go straight to the ref path, so nothing has to be loaded or scanned on startup. Objects carry their digest
+	// in the user.sha256 extended attribute, so that stat() does not have to read them.
+	class blob_store {
+		std::filesystem::path root;
+		bool is_durable;
+		std::atomic<uint64_t> next_tmp_id = 0;
+
+		std::filesystem::path object_path(const sha256::digest& digest) const;
+		std::filesystem::path ref_path(const std::string& data_class, uint64_t id) const;
+		std::filesystem::path tmp_path();
+
+	public:
+		// With is_durable set, objects and their directory entries are synced before store() returns; refs are not, the
+		// caller is expected to journal them
+		explicit blob_store(std::filesystem::path root, bool is_durable = false);
+
+		sha256::digest store(const std::string& data_class, uint64_t id, tcb::span<const std::byte> data);
+		std::optional<rpc::blob> retrieve(const std::string& data_class, uint64_t id);
+		std::optional<object_info> stat(const std::string& data_class, uint64_t id);
+		bool erase(const std::string& data_class, uint64_t id);
+		// Points the ref at an existing object; returns false if there is no object with that digest
+		bool link_object(const std::string& data_class, uint64_t id, const sha256::digest& digest);
+		// Walks the whole ref directory
+		std::vector<std::pair<std::string, uint64_t>> list_keys();
+
+		// Removes objects no ref points to anymore. This walks the whole object directory, so it is meant to be run
+		// occasionally in the background rather than on every overwrite.
+		size_t collect_garbage();
+	};
+
+
+	bool is_valid_data_class(const std::string& data_class);
+}
+
+
+#endif
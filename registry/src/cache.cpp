@@ -0,0 +1,158 @@
+#include <algorithm>
+
+#include "cache.hpp"
+
+
+namespace storage {
+	namespace {
+		// Accounts for bookkeeping so that a flood of empty blobs cannot grow the cache without bound
+		size_t charge(const rpc::blob& data) {
+			return data.size() + 128;
+		}
+	}
+
+
+	cache::cache(size_t capacity): capacity(capacity) {
+	}
+
+
+	size_t cache::small_capacity() const {
+		return capacity / 10;
+	}
+
+
+	std::optional<rpc::blob> cache::get(const cache_key& key) {
+		auto it = entries.find(key);
+		if(it == entries.end()) {
+			counters.misses++;
+			return std::nullopt;
+		}
+		counters.hits++;
+		entry& e = *it->second.second;
+		e.freq = std::min<uint8_t>(e.freq + 1, 3);
+		return e.data;
+	}
+
+
+	bool cache::contains(const cache_key& key) const {
+		return entries.count(key);
+	}
+
+
+	void cache::put(const cache_key& key, rpc::blob data) {
+		erase(key);
+
+		// Large blobs would wipe out the small queue on their own; they are better served from the page cache
+		if(charge(data) > small_capacity()) {
+			return;
+		}
+
+		auto ghost = ghosts.find(key);
+		if(ghost != ghosts.end()) {
+			ghost_queue.erase(ghost->second);
+			ghosts.erase(ghost);
+			main_size += charge(data);
+			main_queue.push_front({key, std::move(data), 0});
+			entries.emplace(key, std::make_pair(location::main, main_queue.begin()));
+		} else {
+			small_size += charge(data);
+			small_queue.push_front({key, std::move(data), 0});
+			entries.emplace(key, std::make_pair(location::small, small_queue.begin()));
+		}
+
+		while(small_size + main_size > capacity) {
+			evict();
+		}
+	}
+
+
+	void cache::erase(const cache_key& key) {
+		auto it = entries.find(key);
+		if(it == entries.end()) {
+			return;
+		}
+		auto [loc, entry_it] = it->second;
+		if(loc == location::small) {
+			small_size -= charge(entry_it->data);
+			small_queue.erase(entry_it);
+		} else {
+			main_size -= charge(entry_it->data);
+			main_queue.erase(entry_it);
+		}
+		entries.erase(it);
+	}
+
+
+	void cache::evict() {
+		if(small_size > small_capacity() || main_queue.empty()) {
+			evict_small();
+		} else {
+			evict_main();
+		}
+	}
+
+
+	void cache::evict_small() {
+		while(!small_queue.empty()) {
+			auto it = std::prev(small_queue.end());
+			small_size -= charge(it->data);
+			if(it->freq > 1) {
+				// Promote
+				it->freq = 0;
+				main_size += charge(it->data);
+				main_queue.splice(main_queue.begin(), small_queue, it);
+				entries.at(it->key).first = location::main;
+				if(main_size > capacity - small_capacity()) {
+					evict_main();
+				}
+			} else {
+				remember_ghost(it->key);
+				entries.erase(it->key);
+				small_queue.erase(it);
+				counters.evictions++;
+				return;
+			}
+		}
+	}
+
+
+	void cache::evict_main() {
+		while(!main_queue.empty()) {
+			auto it = std::prev(main_queue.end());
+			if(it->freq > 0) {
+				// Second chance
+				it->freq--;
+				main_queue.splice(main_queue.begin(), main_queue, it);
+			} else {
+				main_size -= charge(it->data);
+				entries.erase(it->key);
+				main_queue.erase(it);
+				counters.evictions++;
+				return;
+			}
+		}
+	}
+
+
+	void cache::remember_ghost(cache_key key) {
+		if(ghosts.count(key)) {
+			return;
+		}
+		ghost_queue.push_front(key);
+		ghosts.emplace(std::move(key), ghost_queue.begin());
+		// The ghost queue tracks as many keys as the main queue holds entries
+		while(ghost_queue.size() > std::max<size_t>(main_queue.size(), 1)) {
+			ghosts.erase(ghost_queue.back());
+			ghost_queue.pop_back();
+		}
+	}
+
+
+	cache_counters cache::stats() const {
+		cache_counters result = counters;
+		result.size = small_size + main_size;
+		result.capacity = capacity;
+		result.n_entries = entries.size();
+		return result;
+	}
+}
@@ -0,0 +1,260 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "engine.hpp"
+
+
+namespace storage {
+	engine::engine(std::filesystem::path root_, engine_options options_): root(std::move(root_)), options(std::move(options_)), standalone(root, options.is_durable), packs(root / "packs", options.segment_size) {
+		options.pack_threshold = std::min(options.pack_threshold, options.segment_size - pack_store::record_header_size);
+		if(options.is_durable) {
+			wal.emplace(root / "journal", options.group_commit_delay);
+			auto started = std::chrono::steady_clock::now();
+			size_t n_records = wal->replay([this](const journal_record& record) {
+				replay(record);
+			});
+			if(n_records > 0) {
+				checkpoint();
+				auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+				std::cerr << "Replayed " << n_records << " journal records in " << elapsed.count() << " ms" << std::endl;
+			}
+		}
+		maintenance_thread = std::thread([this]() {
+			maintenance_loop();
+		});
+	}
+
+
+	engine::~engine() {
+		{
+			std::lock_guard lock(maintenance_mutex);
+			is_stopping = true;
+		}
+		maintenance_cv.notify_all();
+		maintenance_thread.join();
+	}
+
+
+	void engine::maintenance_loop() {
+		int n_compactions = 0;
+		auto next_compaction = std::chrono::steady_clock::now() + options.compaction_interval;
+		std::unique_lock lock(maintenance_mutex);
+		while(true) {
+			maintenance_cv.wait_until(lock, next_compaction, [this]() { return is_stopping || is_checkpoint_requested; });
+			if(is_stopping) {
+				break;
+			}
+			bool is_checkpoint_due = std::exchange(is_checkpoint_requested, false);
+			bool is_compaction_due = std::chrono::steady_clock::now() >= next_compaction;
+			if(is_compaction_due) {
+				next_compaction = std::chrono::steady_clock::now() + options.compaction_interval;
+			}
+			lock.unlock();
+			try {
+				if(is_checkpoint_due) {
+					checkpoint();
+				}
+				if(is_compaction_due) {
+					size_t n_reclaimed = packs.compact(options.compaction_live_ratio);
+					if(n_reclaimed > 0) {
+						std::cerr << "Compaction reclaimed " << n_reclaimed << " bytes" << std::endl;
+					}
+					if(++n_compactions % options.gc_every_n_compactions == 0) {
+						size_t n_removed = standalone.collect_garbage();
+						if(n_removed > 0) {
+							std::cerr << "Removed " << n_removed << " unreferenced objects" << std::endl;
+						}
+					}
+				}
+			} catch(std::exception& ex) {
+				std::cerr << "Storage maintenance failed: " << ex.what() << std::endl;
+			}
+			lock.lock();
+		}
+	}
+
+
+	void engine::replay(const journal_record& record) {
+		switch(record.type) {
+			case journal_record_type::put:
+				packs.store(record.data_class, record.id, record.data, record.digest, true);
+				standalone.erase(record.data_class, record.id);
+				break;
+			case journal_record_type::link:
+				// The object can only be gone if the key was erased later on, and the erase is journalled too
+				if(!standalone.link_object(record.data_class, record.id, record.digest)) {
+					std::cerr << "Object " << sha256::to_hex(record.digest) << " of " << record.data_class << "/" << record.id << " is missing" << std::endl;
+				}
+				packs.erase(record.data_class, record.id);
+				break;
+			case journal_record_type::erase:
+				packs.erase(record.data_class, record.id);
+				standalone.erase(record.data_class, record.id);
+				break;
+		}
+	}
+
+
+	void engine::checkpoint() {
+		std::unique_lock lock(checkpoint_mutex);
+		packs.sync();
+		// Refs are plain renames spread over many directories; syncing the whole filesystem is cheaper than fsyncing
+		// each of them
+		int fd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if(fd == -1) {
+			throw std::system_error(errno, std::generic_category(), "Could not open " + root.string());
+		}
+		int result = syncfs(fd);
+		int saved_errno = errno;
+		close(fd);
+		if(result == -1) {
+			throw std::system_error(saved_errno, std::generic_category(), "Could not sync " + root.string());
+		}
+		wal->reset();
+	}
+
+
+	void engine::request_checkpoint() {
+		if(!wal || wal->file_size() < options.checkpoint_size) {
+			return;
+		}
+		std::lock_guard lock(maintenance_mutex);
+		if(!is_checkpoint_requested) {
+			is_checkpoint_requested = true;
+			maintenance_cv.notify_all();
+		}
+	}
+
+
+	std::mutex& engine::key_lock(const std::string& data_class, uint64_t id) {
+		return key_locks[(std::hash<std::string>{}(data_class) ^ id) % std::size(key_locks)];
+	}
+
+
+	uint64_t engine::store(const std::string& data_class, uint64_t id, tcb::span<const std::byte> data) {
+		if(!is_valid_data_class(data_class)) {
+			throw std::invalid_argument("Invalid data class");
+		}
+		uint64_t position = 0;
+		{
+			std::shared_lock checkpoint_lock(checkpoint_mutex);
+			std::lock_guard lock(key_lock(data_class, id));
+			// Readers look into packs first, so the order of the two steps keeps either the old or the new blob visible
+			if(data.size() < options.pack_threshold) {
+				sha256::digest digest = sha256::hash(data.data(), data.size());
+				if(wal) {
+					position = wal->append({journal_record_type::put, data_class, id, digest, data});
+				}
+				packs.store(data_class, id, data, digest);
+				standalone.erase(data_class, id);
+			} else {
+				sha256::digest digest = standalone.store(data_class, id, data);
+				if(wal) {
+					position = wal->append({journal_record_type::link, data_class, id, digest, {}});
+				}
+				packs.erase(data_class, id);
+			}
+		}
+		request_checkpoint();
+		return position;
+	}
+
+
+	std::optional<rpc::blob> engine::retrieve(const std::string& data_class, uint64_t id) {
+		if(!is_valid_data_class(data_class)) {
+			throw std::invalid_argument("Invalid data class");
+		}
+		if(auto data = packs.retrieve(data_class, id)) {
+			return data;
+		}
+		return standalone.retrieve(data_class, id);
+	}
+
+
+	std::optional<object_info> engine::stat(const std::string& data_class, uint64_t id) {
+		if(!is_valid_data_class(data_class)) {
+			throw std::invalid_argument("Invalid data class");
+		}
+		if(auto info = packs.stat(data_class, id)) {
+			return info;
+		}
+		return standalone.stat(data_class, id);
+	}
+
+
+	std::optional<uint64_t> engine::erase(const std::string& data_class, uint64_t id) {
+		if(!is_valid_data_class(data_class)) {
+			throw std::invalid_argument("Invalid data class");
+		}
+		uint64_t position = 0;
+		{
+			std::shared_lock checkpoint_lock(checkpoint_mutex);
+			std::lock_guard lock(key_lock(data_class, id));
+			bool is_packed = packs.erase(data_class, id);
+			bool is_standalone = standalone.erase(data_class, id);
+			if(!is_packed && !is_standalone) {
+				return std::nullopt;
+			}
+			if(wal) {
+				position = wal->append({journal_record_type::erase, data_class, id, {}, {}});
+			}
+		}
+		request_checkpoint();
+		return position;
+	}
+
+
+	std::vector<std::pair<std::string, uint64_t>> engine::list_keys() {
+		// A key being moved between the two backends may briefly be in both
+		auto result = packs.list_keys();
+		auto standalone_keys = standalone.list_keys();
+		result.insert(result.end(), standalone_keys.begin(), standalone_keys.end());
+		std::sort(result.begin(), result.end());
+		result.erase(std::unique(result.begin(), result.end()), result.end());
+		return result;
+	}
+
+
+	std::vector<std::optional<rpc::blob>> engine::retrieve_many(const std::vector<std::pair<std::string, uint64_t>>& keys) {
+		// Packed blobs go first, by segment and offset; standalone files follow in the order they were requested in
+		std::vector<std::pair<std::pair<uint32_t, uint64_t>, size_t>> order;
+		for(size_t i = 0; i < keys.size(); i++) {
+			auto& [data_class, id] = keys[i];
+			if(!is_valid_data_class(data_class)) {
+				throw std::invalid_argument("Invalid data class");
+			}
+			order.emplace_back(packs.locate(data_class, id).value_or(std::pair<uint32_t, uint64_t>{UINT32_MAX, i}), i);
+		}
+		std::sort(order.begin(), order.end());
+
+		std::vector<std::optional<rpc::blob>> result(keys.size());
+		for(auto& [location, i]: order) {
+			result[i] = retrieve(keys[i].first, keys[i].second);
+		}
+		return result;
+	}
+
+
+	void engine::wait_durable(uint64_t position) {
+		if(wal && position > 0) {
+			wal->wait(position);
+		}
+	}
+
+
+	void engine::set_durability_listener(std::function<void(uint64_t)> listener) {
+		if(wal) {
+			wal->set_listener(std::move(listener));
+		}
+	}
+}
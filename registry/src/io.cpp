@@ -0,0 +1,89 @@
+#include <cmath>
+
+#include <unistd.h>
+
+#include "io.hpp"
+
+
+namespace storage {
+	int latency_histogram::bucket_of(uint64_t us) {
+		if(us == 0) {
+			return 0;
+		}
+		return std::min(n_buckets - 1, static_cast<int>(std::log2(static_cast<double>(us)) * 4) + 1);
+	}
+
+	uint64_t latency_histogram::upper_bound_of(int bucket) {
+		if(bucket == 0) {
+			return 0;
+		}
+		return static_cast<uint64_t>(std::exp2(bucket / 4.0));
+	}
+
+
+	void latency_histogram::record(std::chrono::microseconds latency) {
+		uint64_t us = latency.count();
+		buckets[bucket_of(us)]++;
+		count++;
+		max_us = std::max(max_us, us);
+	}
+
+
+	uint64_t latency_histogram::percentile(double p) const {
+		uint64_t rank = static_cast<uint64_t>(std::ceil(count * p));
+		uint64_t seen = 0;
+		for(int bucket = 0; bucket < n_buckets; bucket++) {
+			seen += buckets[bucket];
+			if(seen >= rank && seen > 0) {
+				return std::min(upper_bound_of(bucket), max_us);
+			}
+		}
+		return max_us;
+	}
+
+
+	uint64_t latency_histogram::size() const {
+		return count;
+	}
+
+	uint64_t latency_histogram::max() const {
+		return max_us;
+	}
+
+
+
+	io_scheduler::io_scheduler(size_t max_in_flight): max_in_flight(std::max<size_t>(max_in_flight, 1)) {
+	}
+
+
+	void io_scheduler::finish() {
+		if(pending.empty()) {
+			n_in_flight--;
+			return;
+		}
+		auto launch = std::move(pending.front());
+		pending.pop_front();
+		launch();
+	}
+
+
+	bool io_scheduler::is_busy() const {
+		return n_in_flight * 2 >= max_in_flight;
+	}
+
+
+	const std::map<std::string, latency_histogram>& io_scheduler::stats() const {
+		return latencies;
+	}
+
+
+
+	void prefault(const rpc::blob& data) {
+		static const size_t page_size = sysconf(_SC_PAGESIZE);
+		volatile std::byte sink;
+		for(size_t offset = 0; offset < data.size(); offset += page_size) {
+			sink = data.data()[offset];
+		}
+		(void)sink;
+	}
+}
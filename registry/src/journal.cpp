@@ -0,0 +1,250 @@
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "common/crc32.hpp"
+
+#include "journal.hpp"
+
+
+namespace storage {
+	namespace {
+		constexpr uint32_t record_magic = 0x534d4a4c; // "SMJL"
+
+		struct record_header {
+			uint32_t magic;
+			uint32_t type;
+			uint32_t crc;
+			uint32_t class_length;
+			uint64_t id;
+			uint64_t data_length;
+			sha256::digest digest;
+		};
+		static_assert(sizeof(record_header) == 64);
+
+
+		uint32_t record_crc(record_header header, const void* data_class, const void* data) {
+			header.crc = 0;
+			uint32_t crc = crc32::update(0, &header, sizeof(header));
+			crc = crc32::update(crc, data_class, header.class_length);
+			return crc32::update(crc, data, header.data_length);
+		}
+
+
+		[[noreturn]] void throw_errno(const std::string& what, const std::filesystem::path& path) {
+			throw std::system_error(errno, std::generic_category(), what + " " + path.string());
+		}
+
+
+		void sync_directory(const std::filesystem::path& path) {
+			int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if(fd == -1) {
+				throw_errno("Could not open", path);
+			}
+			fsync(fd);
+			close(fd);
+		}
+	}
+
+
+	journal::journal(std::filesystem::path path_, std::chrono::microseconds commit_delay): path(std::move(path_)), commit_delay(commit_delay) {
+		fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if(fd == -1) {
+			throw_errno("Could not open", path);
+		}
+		sync_directory(path.parent_path());
+		committer = std::thread([this]() {
+			commit_loop();
+		});
+	}
+
+
+	journal::~journal() {
+		{
+			std::lock_guard lock(mutex);
+			is_stopping = true;
+		}
+		appended_cv.notify_all();
+		committer.join();
+		close(fd);
+	}
+
+
+	void journal::commit_loop() {
+		std::unique_lock lock(mutex);
+		while(true) {
+			appended_cv.wait(lock, [this]() {
+				return is_stopping || base + size > synced;
+			});
+			if(base + size == synced) {
+				break;
+			}
+			if(commit_delay.count() > 0) {
+				// Give concurrent writers a moment to join this sync
+				lock.unlock();
+				std::this_thread::sleep_for(commit_delay);
+				lock.lock();
+			}
+			uint64_t target = base + size;
+			lock.unlock();
+			if(fdatasync(fd) == -1) {
+				// After a failed fsync the kernel may have dropped the dirty pages, so retrying could report data as
+				// durable that never reached the disk. Restarting and replaying the journal is the only safe option.
+				std::cerr << "Could not sync " << path << ": " << std::strerror(errno) << std::endl;
+				std::abort();
+			}
+			lock.lock();
+			synced = target;
+			auto listener = on_synced;
+			lock.unlock();
+			synced_cv.notify_all();
+			if(listener) {
+				listener(target);
+			}
+			lock.lock();
+		}
+	}
+
+
+	size_t journal::replay(const std::function<void(const journal_record&)>& apply) {
+		std::vector<std::byte> contents;
+		{
+			std::byte buffer[65536];
+			ssize_t n;
+			while((n = pread(fd, buffer, sizeof(buffer), contents.size())) != 0) {
+				if(n == -1) {
+					if(errno == EINTR) {
+						continue;
+					}
+					throw_errno("Could not read", path);
+				}
+				contents.insert(contents.end(), buffer, buffer + n);
+			}
+		}
+
+		size_t offset = 0;
+		size_t n_records = 0;
+		while(contents.size() - offset >= sizeof(record_header)) {
+			record_header header;
+			std::memcpy(&header, contents.data() + offset, sizeof(header));
+			size_t left = contents.size() - offset - sizeof(header);
+			if(header.magic != record_magic || header.class_length > left || header.data_length > left - header.class_length) {
+				break;
+			}
+			const std::byte* data_class = contents.data() + offset + sizeof(header);
+			const std::byte* data = data_class + header.class_length;
+			if(record_crc(header, data_class, data) != header.crc) {
+				break;
+			}
+			apply(journal_record{
+				static_cast<journal_record_type>(header.type),
+				std::string(reinterpret_cast<const char*>(data_class), header.class_length),
+				header.id,
+				header.digest,
+				{data, header.data_length}
+			});
+			offset += sizeof(header) + header.class_length + header.data_length;
+			n_records++;
+		}
+
+		if(offset != contents.size()) {
+			std::cerr << "Dropping " << contents.size() - offset << " bytes of a torn record at the end of " << path << std::endl;
+			if(ftruncate(fd, offset) == -1 || fsync(fd) == -1) {
+				throw_errno("Could not truncate", path);
+			}
+		}
+		std::lock_guard lock(mutex);
+		size = offset;
+		synced = base + size;
+		return n_records;
+	}
+
+
+	uint64_t journal::append(const journal_record& record) {
+		record_header header{record_magic, static_cast<uint32_t>(record.type), 0, static_cast<uint32_t>(record.data_class.size()), record.id, record.data.size(), record.digest};
+		header.crc = record_crc(header, record.data_class.data(), record.data.data());
+
+		iovec iov[3] = {
+			{&header, sizeof(header)},
+			{const_cast<char*>(record.data_class.data()), record.data_class.size()},
+			{const_cast<std::byte*>(record.data.data()), record.data.size()}
+		};
+		int iov_index = 0;
+		size_t left = sizeof(header) + record.data_class.size() + record.data.size();
+
+		std::lock_guard lock(mutex);
+		uint64_t offset = size;
+		while(left > 0) {
+			ssize_t n = pwritev(fd, iov + iov_index, 3 - iov_index, offset);
+			if(n == -1) {
+				if(errno == EINTR) {
+					continue;
+				}
+				// Replay stops at the first broken record, so a partial one must not stay in front of later ones
+				int saved_errno = errno;
+				ftruncate(fd, size);
+				errno = saved_errno;
+				throw_errno("Could not write to", path);
+			}
+			offset += n;
+			left -= n;
+			while(iov_index < 3 && static_cast<size_t>(n) >= iov[iov_index].iov_len) {
+				n -= iov[iov_index].iov_len;
+				iov_index++;
+			}
+			if(iov_index < 3) {
+				iov[iov_index].iov_base = static_cast<char*>(iov[iov_index].iov_base) + n;
+				iov[iov_index].iov_len -= n;
+			}
+		}
+		size = offset;
+		appended_cv.notify_one();
+		return base + size;
+	}
+
+
+	uint64_t journal::synced_position() {
+		std::lock_guard lock(mutex);
+		return synced;
+	}
+
+
+	void journal::wait(uint64_t position) {
+		std::unique_lock lock(mutex);
+		synced_cv.wait(lock, [&]() {
+			return synced >= position;
+		});
+	}
+
+
+	void journal::set_listener(std::function<void(uint64_t)> listener) {
+		std::lock_guard lock(mutex);
+		on_synced = std::move(listener);
+	}
+
+
+	void journal::reset() {
+		std::unique_lock lock(mutex);
+		synced_cv.wait(lock, [&]() {
+			return synced >= base + size;
+		});
+		if(ftruncate(fd, 0) == -1 || fsync(fd) == -1) {
+			throw_errno("Could not truncate", path);
+		}
+		base += size;
+		size = 0;
+	}
+
+
+	uint64_t journal::file_size() {
+		std::lock_guard lock(mutex);
+		return size;
+	}
+}
@@ -8,24 +8,60 @@
 #include "rpc/server.hpp"
 
 #include "protocol.hpp"
-#include "common/registry.hpp"
+#include "service.hpp"
 
 
-std::optional<registry> reg;
+std::optional<registry_service> service;
 
 
 class registry_impl: public rpc::simplex_impl<registry_impl, registry_protocol> {
 public:
 	async::promise<bool> store(std::string data_class, uint64_t id, std::vector<std::byte> data) {
-		return reg->store(data_class, id, data) | async::catch_([](std::runtime_error& ex) {
-			return false;
-		}).else_([]() {
-			return true;
-		});
+		return service->store(std::move(data_class), id, std::move(data));
+	}
+
+	async::promise<std::optional<rpc::blob>> retrieve(std::string data_class, uint64_t id) {
+		return service->retrieve(std::move(data_class), id);
+	}
+
+	async::promise<std::optional<registry_stat>> stat(std::string data_class, uint64_t id) {
+		return service->stat(std::move(data_class), id);
+	}
+
+	async::promise<std::optional<rpc::blob>> retrieve_range(std::string data_class, uint64_t id, uint64_t offset, uint64_t length) {
+		return service->retrieve_range(std::move(data_class), id, offset, length);
+	}
+
+	rpc::stream<std::optional<rpc::blob>> retrieve_stream(std::string data_class, uint64_t id) {
+		return service->retrieve_stream(std::move(data_class), id);
 	}
 
-	async::promise<std::optional<std::vector<std::byte>>> retrieve(std::string data_class, uint64_t id) {
-		return reg->retrieve(data_class, id);
+	async::promise<bool> erase(std::string data_class, uint64_t id) {
+		return service->erase(std::move(data_class), id);
+	}
+
+	bool claim(std::string data_class, uint64_t id, uint32_t ttl_ms) {
+		return service->claim(std::move(data_class), id, std::chrono::milliseconds{ttl_ms});
+	}
+
+	rpc::stream<std::vector<registry_key>> list_keys() {
+		return service->list_keys();
+	}
+
+	async::promise<std::vector<bool>> store_many(std::vector<registry_entry> entries) {
+		return service->store_many(std::move(entries));
+	}
+
+	rpc::stream<std::vector<registry_blob_item>> retrieve_many(std::vector<registry_key> keys) {
+		return service->retrieve_many(std::move(keys));
+	}
+
+	registry_cache_stats cache_stats() {
+		return service->cache_stats();
+	}
+
+	std::vector<registry_io_stats> io_stats() {
+		return service->io_stats();
 	}
 };
 
@@ -67,7 +103,20 @@ int main(int argc, char** argv) {
 	}
 
 
-	reg.emplace(config["data_dir"].get<std::string>());
+	registry_options options;
+	options.engine.pack_threshold = config.value<size_t>("pack_threshold", options.engine.pack_threshold);
+	options.engine.segment_size = config.value<size_t>("segment_size", options.engine.segment_size);
+	if(options.engine.segment_size <= storage::pack_store::record_header_size) {
+		std::cerr << "segment_size must be more than " << storage::pack_store::record_header_size << " bytes, the size of a pack record header" << std::endl;
+		return 1;
+	}
+	options.engine.is_durable = config.value<bool>("durable", options.engine.is_durable);
+	options.engine.group_commit_delay = std::chrono::microseconds(config.value<int64_t>("group_commit_delay_us", options.engine.group_commit_delay.count()));
+	options.engine.checkpoint_size = config.value<size_t>("checkpoint_size", options.engine.checkpoint_size);
+	options.cache_size = config.value<size_t>("cache_size", options.cache_size);
+	options.max_io_in_flight = config.value<size_t>("max_io_in_flight", options.max_io_in_flight);
+	options.readahead = config.value<size_t>("readahead", options.readahead);
+	service.emplace(config.at("data_dir").get<std::string>(), options);
 
 
 	// Start server
@@ -91,6 +140,7 @@ int main(int argc, char** argv) {
 			}
 			signals.clear();
 			server.stop();
+			service->stop();
 		});
 		signal->start(signum);
 		signals.push_back(std::move(signal));
@@ -0,0 +1,517 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "pack.hpp"
+
+
+namespace storage {
+	namespace {
+		constexpr uint32_t record_magic = 0x534d504b; // "SMPK"
+
+		struct record_header {
+			uint32_t magic;
+			uint32_t reserved;
+			uint64_t length;
+			sha256::digest digest;
+		};
+		static_assert(sizeof(record_header) == pack_store::record_header_size);
+
+
+		[[noreturn]] void throw_errno(const std::string& what, const std::filesystem::path& path) {
+			throw std::system_error(errno, std::generic_category(), what + " " + path.string());
+		}
+
+
+		std::filesystem::path ensure_directory(std::filesystem::path path) {
+			std::filesystem::create_directories(path);
+			return path;
+		}
+
+
+		uint64_t mix(uint64_t x) {
+			x ^= x >> 33;
+			x *= 0xff51afd7ed558ccd;
+			x ^= x >> 33;
+			return x;
+		}
+	}
+
+
+	struct pack_store::segment {
+		void* addr;
+		size_t size;
+
+		segment(void* addr, size_t size): addr(addr), size(size) {
+		}
+		segment(const segment&) = delete;
+		segment& operator=(const segment&) = delete;
+		~segment() {
+			munmap(addr, size);
+		}
+
+		const std::byte* data() const {
+			return static_cast<const std::byte*>(addr);
+		}
+	};
+
+
+	uint64_t pack_store::index_entry::hash_of(const key& k) {
+		return mix(k.id ^ (uint64_t{k.class_id} << 48));
+	}
+	uint64_t pack_store::index_entry::hash() const {
+		return hash_of({class_id, id});
+	}
+	bool pack_store::index_entry::matches(const key& k) const {
+		return class_id == k.class_id && id == k.id;
+	}
+
+	uint64_t pack_store::content_entry::hash_of(const sha256::digest& digest) {
+		uint64_t result;
+		std::memcpy(&result, digest.data(), sizeof(result));
+		return result;
+	}
+	uint64_t pack_store::content_entry::hash() const {
+		return hash_of(digest);
+	}
+	bool pack_store::content_entry::matches(const sha256::digest& other) const {
+		return digest == other;
+	}
+
+
+	pack_store::pack_store(std::filesystem::path root_, size_t segment_size): root(ensure_directory(std::move(root_))), segment_size(segment_size), index(root / "index"), contents(root / "contents") {
+		{
+			std::ifstream fin(root / "classes");
+			std::string name;
+			while(std::getline(fin, name)) {
+				class_ids.emplace(name, class_names.size());
+				class_names.push_back(name);
+			}
+		}
+
+		// The tail of the last segment may hold a record torn by a crash, so never append after it
+		uint32_t last_segment = 0;
+		for(auto& entry: std::filesystem::directory_iterator(root)) {
+			if(entry.path().extension() == ".pack") {
+				uint32_t segment = std::stoul(entry.path().stem().string());
+				sealed_segments.insert(segment);
+				last_segment = std::max(last_segment, segment);
+			}
+		}
+		open_active_segment(last_segment + 1);
+	}
+
+
+	pack_store::~pack_store() {
+		if(active_fd != -1) {
+			close(active_fd);
+		}
+	}
+
+
+	std::filesystem::path pack_store::segment_path(uint32_t segment) const {
+		char name[16];
+		std::snprintf(name, sizeof(name), "%08u.pack", segment);
+		return root / name;
+	}
+
+
+	std::shared_ptr<pack_store::segment> pack_store::get_segment(uint32_t n) {
+		auto it = segments.find(n);
+		if(it != segments.end()) {
+			return it->second;
+		}
+
+		std::filesystem::path path = segment_path(n);
+		int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if(fd == -1) {
+			throw_errno("Could not open", path);
+		}
+		size_t size = segment_size;
+		if(n != active_segment) {
+			struct stat st;
+			if(fstat(fd, &st) == -1) {
+				close(fd);
+				throw_errno("Could not stat", path);
+			}
+			size = st.st_size;
+		}
+		// The active segment is mapped at its maximal size so that records appended later are visible through the same
+		// mapping
+		void* addr = size == 0 ? nullptr : mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+		int saved_errno = errno;
+		close(fd);
+		if(addr == MAP_FAILED) {
+			errno = saved_errno;
+			throw_errno("Could not mmap", path);
+		}
+		auto seg = std::make_shared<segment>(addr, size);
+		segments.emplace(n, seg);
+		return seg;
+	}
+
+
+	void pack_store::open_active_segment(uint32_t n) {
+		if(active_fd != -1) {
+			// Sealed segments are never synced again
+			fdatasync(active_fd);
+			close(active_fd);
+			sealed_segments.insert(active_segment);
+		}
+		std::filesystem::path path = segment_path(n);
+		active_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+		if(active_fd == -1) {
+			throw_errno("Could not create", path);
+		}
+		int dir_fd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if(dir_fd != -1) {
+			fsync(dir_fd);
+			close(dir_fd);
+		}
+		active_segment = n;
+		active_size = 0;
+	}
+
+
+	std::pair<uint32_t, uint64_t> pack_store::append(const sha256::digest& digest, tcb::span<const std::byte> data) {
+		if(active_size > 0 && active_size + record_header_size + data.size() > segment_size) {
+			open_active_segment(active_segment + 1);
+		}
+
+		record_header header{record_magic, 0, data.size(), digest};
+		iovec iov[2] = {
+			{&header, sizeof(header)},
+			{const_cast<std::byte*>(data.data()), data.size()}
+		};
+		uint64_t offset = active_size;
+		size_t left = sizeof(header) + data.size();
+		int iov_index = 0;
+		while(left > 0) {
+			ssize_t n = pwritev(active_fd, iov + iov_index, 2 - iov_index, active_size);
+			if(n == -1) {
+				if(errno == EINTR) {
+					continue;
+				}
+				// Whatever was written is unreferenced garbage now; start over in a fresh segment so that the next record
+				// does not end up behind it
+				int saved_errno = errno;
+				std::filesystem::path path = segment_path(active_segment);
+				open_active_segment(active_segment + 1);
+				errno = saved_errno;
+				throw_errno("Could not write to", path);
+			}
+			active_size += n;
+			left -= n;
+			while(iov_index < 2 && static_cast<size_t>(n) >= iov[iov_index].iov_len) {
+				n -= iov[iov_index].iov_len;
+				iov_index++;
+			}
+			if(iov_index < 2) {
+				iov[iov_index].iov_base = static_cast<char*>(iov[iov_index].iov_base) + n;
+				iov[iov_index].iov_len -= n;
+			}
+		}
+		return {active_segment, offset};
+	}
+
+
+	std::optional<uint32_t> pack_store::find_class(const std::string& data_class) {
+		auto it = class_ids.find(data_class);
+		if(it == class_ids.end()) {
+			return std::nullopt;
+		}
+		return it->second;
+	}
+
+
+	uint32_t pack_store::intern_class(const std::string& data_class) {
+		if(auto class_id = find_class(data_class)) {
+			return *class_id;
+		}
+		// Index entries refer to classes by number, so the name has to reach the disk before any of them
+		std::filesystem::path path = root / "classes";
+		int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if(fd == -1) {
+			throw_errno("Could not open", path);
+		}
+		std::string line = data_class + '\n';
+		ssize_t n = write(fd, line.data(), line.size());
+		int saved_errno = errno;
+		if(n == static_cast<ssize_t>(line.size()) && fsync(fd) == -1) {
+			saved_errno = errno;
+			n = -1;
+		}
+		close(fd);
+		if(n != static_cast<ssize_t>(line.size())) {
+			errno = n == -1 ? saved_errno : EIO;
+			throw_errno("Could not write to", path);
+		}
+		uint32_t class_id = class_names.size();
+		class_ids.emplace(data_class, class_id);
+		class_names.push_back(data_class);
+		return class_id;
+	}
+
+
+	void pack_store::release(const sha256::digest& digest) {
+		content_entry* content = contents.find(digest);
+		if(content && --content->refcount == 0) {
+			contents.erase(content);
+		}
+	}
+
+
+	bool pack_store::is_intact(const content_entry& content, tcb::span<const std::byte> data) {
+		if(content.segment == active_segment) {
+			return true;
+		}
+		std::shared_ptr<segment> seg;
+		try {
+			seg = get_segment(content.segment);
+		} catch(std::system_error&) {
+			return false;
+		}
+		if(content.length != data.size() || seg->size < content.offset || seg->size - content.offset < record_header_size + content.length) {
+			return false;
+		}
+		record_header header;
+		std::memcpy(&header, seg->data() + content.offset, sizeof(header));
+		return header.magic == record_magic && header.length == content.length && header.digest == content.digest && std::memcmp(seg->data() + content.offset + sizeof(header), data.data(), data.size()) == 0;
+	}
+
+
+	void pack_store::store(const std::string& data_class, uint64_t id, tcb::span<const std::byte> data, const sha256::digest& digest, bool verify) {
+		std::lock_guard lock(mutex);
+
+		key k{intern_class(data_class), id};
+
+		if(verify) {
+			// The tables are written back by the kernel at any time, so after a crash they may point at records that
+			// never reached the disk
+			content_entry* content = contents.find(digest);
+			if(content && !is_intact(*content, data)) {
+				auto [segment, offset] = append(digest, data);
+				content->segment = segment;
+				content->offset = offset;
+				content->length = data.size();
+			}
+		}
+
+		std::optional<sha256::digest> old_digest;
+		if(index_entry* entry = index.find(k)) {
+			if(entry->digest == digest) {
+				return;
+			}
+			old_digest = entry->digest;
+		}
+
+		if(content_entry* content = contents.find(digest)) {
+			content->refcount++;
+		} else {
+			auto [segment, offset] = append(digest, data);
+			content = contents.insert(digest);
+			content->refcount = 1;
+			content->segment = segment;
+			content->offset = offset;
+			content->length = data.size();
+			content->digest = digest;
+		}
+
+		index_entry* entry = index.find(k);
+		if(!entry) {
+			entry = index.insert(k);
+			entry->class_id = k.class_id;
+			entry->id = k.id;
+		}
+		entry->digest = digest;
+
+		if(old_digest) {
+			release(*old_digest);
+		}
+	}
+
+
+	void pack_store::sync() {
+		std::lock_guard lock(mutex);
+		if(fdatasync(active_fd) == -1) {
+			throw_errno("Could not sync", segment_path(active_segment));
+		}
+		index.sync();
+		contents.sync();
+	}
+
+
+	std::optional<rpc::blob> pack_store::retrieve(const std::string& data_class, uint64_t id) {
+		std::lock_guard lock(mutex);
+
+		auto class_id = find_class(data_class);
+		if(!class_id) {
+			return std::nullopt;
+		}
+		index_entry* entry = index.find(key{*class_id, id});
+		if(!entry) {
+			return std::nullopt;
+		}
+		content_entry* content = contents.find(entry->digest);
+		if(!content) {
+			throw std::runtime_error("Dangling index entry for " + data_class + "/" + std::to_string(id));
+		}
+		auto seg = get_segment(content->segment);
+		const std::byte* data = seg->data() + content->offset + record_header_size;
+		return rpc::blob{std::move(seg), data, content->length};
+	}
+
+
+	std::optional<object_info> pack_store::stat(const std::string& data_class, uint64_t id) {
+		std::lock_guard lock(mutex);
+
+		auto class_id = find_class(data_class);
+		if(!class_id) {
+			return std::nullopt;
+		}
+		index_entry* entry = index.find(key{*class_id, id});
+		if(!entry) {
+			return std::nullopt;
+		}
+		content_entry* content = contents.find(entry->digest);
+		if(!content) {
+			throw std::runtime_error("Dangling index entry for " + data_class + "/" + std::to_string(id));
+		}
+		return object_info{content->length, content->digest};
+	}
+
+
+	bool pack_store::erase(const std::string& data_class, uint64_t id) {
+		std::lock_guard lock(mutex);
+
+		auto class_id = find_class(data_class);
+		if(!class_id) {
+			return false;
+		}
+		index_entry* entry = index.find(key{*class_id, id});
+		if(!entry) {
+			return false;
+		}
+		sha256::digest digest = entry->digest;
+		index.erase(entry);
+		release(digest);
+		return true;
+	}
+
+
+	std::vector<std::pair<std::string, uint64_t>> pack_store::list_keys() {
+		std::lock_guard lock(mutex);
+
+		std::vector<std::pair<std::string, uint64_t>> result;
+		index.for_each([&](const index_entry& entry) {
+			result.emplace_back(class_names.at(entry.class_id), entry.id);
+		});
+		return result;
+	}
+
+
+	std::optional<std::pair<uint32_t, uint64_t>> pack_store::locate(const std::string& data_class, uint64_t id) {
+		std::lock_guard lock(mutex);
+
+		auto class_id = find_class(data_class);
+		if(!class_id) {
+			return std::nullopt;
+		}
+		index_entry* entry = index.find(key{*class_id, id});
+		if(!entry) {
+			return std::nullopt;
+		}
+		content_entry* content = contents.find(entry->digest);
+		if(!content) {
+			return std::nullopt;
+		}
+		return std::pair{content->segment, content->offset};
+	}
+
+
+	size_t pack_store::compact(double max_live_ratio) {
+		std::vector<std::pair<uint32_t, uint64_t>> candidates;
+		{
+			std::lock_guard lock(mutex);
+			std::map<uint32_t, uint64_t> live_size;
+			contents.for_each([&](const content_entry& content) {
+				live_size[content.segment] += record_header_size + content.length;
+			});
+			for(uint32_t n: sealed_segments) {
+				struct stat st;
+				if(::stat(segment_path(n).c_str(), &st) == 0 && live_size[n] < st.st_size * max_live_ratio) {
+					candidates.emplace_back(n, st.st_size);
+				}
+			}
+		}
+
+		size_t n_reclaimed = 0;
+		for(auto [n, size]: candidates) {
+			std::shared_ptr<segment> seg;
+			{
+				std::lock_guard lock(mutex);
+				seg = get_segment(n);
+			}
+
+			// Sealed segments are immutable, so they can be read without holding the lock
+			uint64_t offset = 0;
+			uint64_t n_moved = 0;
+			bool is_intact = true;
+			while(offset < size) {
+				record_header header;
+				if(size - offset < sizeof(header)) {
+					is_intact = false;
+					break;
+				}
+				std::memcpy(&header, seg->data() + offset, sizeof(header));
+				if(header.magic != record_magic || header.length > size - offset - sizeof(header)) {
+					is_intact = false;
+					break;
+				}
+
+				std::lock_guard lock(mutex);
+				content_entry* content = contents.find(header.digest);
+				if(content && content->segment == n && content->offset == offset) {
+					auto [new_segment, new_offset] = append(header.digest, {seg->data() + offset + sizeof(header), header.length});
+					content->segment = new_segment;
+					content->offset = new_offset;
+					n_moved += sizeof(header) + header.length;
+				}
+				offset += sizeof(header) + header.length;
+			}
+
+			std::lock_guard lock(mutex);
+			if(!is_intact) {
+				// A torn record, most likely left by a failed write. Live records after it cannot be found by walking, so
+				// the segment can only go if nothing points into it anymore.
+				bool is_referenced = false;
+				contents.for_each([&](const content_entry& content) {
+					is_referenced = is_referenced || content.segment == n;
+				});
+				if(is_referenced) {
+					std::cerr << "Segment " << segment_path(n) << " is damaged at offset " << offset << ", not compacting" << std::endl;
+					continue;
+				}
+			}
+			// The moved records and the entries pointing at them must be on disk before the old copies are gone
+			if(fdatasync(active_fd) == -1) {
+				throw_errno("Could not sync", segment_path(active_segment));
+			}
+			contents.sync();
+			segments.erase(n);
+			sealed_segments.erase(n);
+			unlink(segment_path(n).c_str());
+			n_reclaimed += size - n_moved;
+		}
+		return n_reclaimed;
+	}
+}
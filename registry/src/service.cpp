@@ -0,0 +1,422 @@
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <tuple>
+
+#include "service.hpp"
+
+
+registry_service::registry_service(std::filesystem::path data_dir, registry_options options): blobs(std::move(data_dir), options.engine), hot_blobs(options.cache_size), io(options.max_io_in_flight), readahead(options.readahead) {
+	durability_signal = uvw::Loop::getDefault()->resource<uvw::AsyncHandle>();
+	durability_signal->on<uvw::AsyncEvent>([this](const uvw::AsyncEvent&, uvw::AsyncHandle&) {
+		flush_durable();
+	});
+	blobs.set_durability_listener([this, signal = durability_signal](uint64_t position) {
+		durable_position = position;
+		signal->send();
+	});
+}
+
+
+void registry_service::stop() {
+	blobs.set_durability_listener(nullptr);
+	durability_signal->close();
+}
+
+
+void registry_service::when_durable(uint64_t position, std::function<void()> callback) {
+	if(position <= durable_position) {
+		callback();
+		return;
+	}
+	durability_waiters.emplace(position, std::move(callback));
+}
+
+
+void registry_service::flush_durable() {
+	uint64_t position = durable_position;
+	while(!durability_waiters.empty() && durability_waiters.begin()->first <= position) {
+		auto callback = std::move(durability_waiters.begin()->second);
+		durability_waiters.erase(durability_waiters.begin());
+		callback();
+	}
+}
+
+
+async::promise<bool> registry_service::store(std::string data_class, uint64_t id, std::vector<std::byte> data) {
+	storage::cache_key key{std::move(data_class), id};
+	hot_blobs.erase(key);
+	reads_in_flight.erase(key);
+	auto shared_data = std::make_shared<std::vector<std::byte>>(std::move(data));
+	async::promise<bool> result;
+	io.submit<std::optional<uint64_t>>("store", [this, key, shared_data]() -> std::optional<uint64_t> {
+		try {
+			return blobs.store(key.data_class, key.id, *shared_data);
+		} catch(std::exception& ex) {
+			std::cerr << "Could not store " << key.data_class << "/" << key.id << ": " << ex.what() << std::endl;
+			return std::nullopt;
+		}
+	}) | [this, key, result](std::optional<uint64_t> position) mutable {
+		n_stores_finished++;
+		hot_blobs.erase(key);
+		if(!position) {
+			claims.erase(key);
+			result.set(false);
+			return;
+		}
+		// Whoever polls for the blob once the claim is gone must find it
+		when_durable(*position, [this, key, result]() mutable {
+			claims.erase(key);
+			result.set(true);
+		});
+	};
+	return result;
+}
+
+
+async::promise<std::optional<rpc::blob>> registry_service::retrieve(std::string data_class, uint64_t id) {
+	storage::cache_key key{std::move(data_class), id};
+	read_ahead(key.data_class, id);
+	if(auto data = hot_blobs.get(key)) {
+		return async::to_promise(std::move(data));
+	}
+	return load(std::move(key));
+}
+
+
+async::promise<std::optional<rpc::blob>> registry_service::load(storage::cache_key key) {
+	async::promise<std::optional<rpc::blob>> result;
+	auto [it, inserted] = reads_in_flight.try_emplace(key);
+	if(!inserted) {
+		it->second->push_back(result);
+		return result;
+	}
+	auto waiters = std::make_shared<read_waiters>(1, result);
+	it->second = waiters;
+
+	uint64_t n_stores_started = n_stores_finished;
+	io.submit<std::optional<rpc::blob>>("retrieve", [this, key]() -> std::optional<rpc::blob> {
+		try {
+			auto data = blobs.retrieve(key.data_class, key.id);
+			if(data) {
+				storage::prefault(*data);
+			}
+			return data;
+		} catch(std::exception& ex) {
+			std::cerr << "Could not retrieve " << key.data_class << "/" << key.id << ": " << ex.what() << std::endl;
+			return std::nullopt;
+		}
+	}) | [this, key, n_stores_started, waiters](std::optional<rpc::blob> data) {
+		if(data && n_stores_finished == n_stores_started) {
+			hot_blobs.put(key, *data);
+		}
+		if(auto it = reads_in_flight.find(key); it != reads_in_flight.end() && it->second == waiters) {
+			reads_in_flight.erase(it);
+		}
+		for(auto& waiter: *waiters) {
+			waiter.set(std::optional<rpc::blob>(data));
+		}
+	};
+	return result;
+}
+
+
+async::promise<std::optional<registry_stat>> registry_service::stat(std::string data_class, uint64_t id) {
+	storage::cache_key key{std::move(data_class), id};
+	return io.submit<std::optional<registry_stat>>("stat", [this, key]() -> std::optional<registry_stat> {
+		try {
+			if(auto info = blobs.stat(key.data_class, key.id)) {
+				return registry_stat{info->size, info->digest};
+			}
+		} catch(std::exception& ex) {
+			std::cerr << "Could not stat " << key.data_class << "/" << key.id << ": " << ex.what() << std::endl;
+		}
+		return std::nullopt;
+	});
+}
+
+
+namespace {
+	// Ranges are clamped to the blob, so reading past the end yields a short or empty result rather than an error
+	rpc::blob clamp_range(const rpc::blob& data, uint64_t offset, uint64_t length) {
+		offset = std::min<uint64_t>(offset, data.size());
+		return data.slice(offset, std::min<uint64_t>(length, data.size() - offset));
+	}
+}
+
+
+async::promise<std::optional<rpc::blob>> registry_service::retrieve_range(std::string data_class, uint64_t id, uint64_t offset, uint64_t length) {
+	storage::cache_key key{std::move(data_class), id};
+	if(auto data = hot_blobs.get(key)) {
+		return async::to_promise(std::optional<rpc::blob>(clamp_range(*data, offset, length)));
+	}
+	// Only the requested pages of the mapping are ever touched, and the partial read is not worth caching
+	return io.submit<std::optional<rpc::blob>>("retrieve_range", [this, key, offset, length]() -> std::optional<rpc::blob> {
+		try {
+			auto data = blobs.retrieve(key.data_class, key.id);
+			if(!data) {
+				return std::nullopt;
+			}
+			rpc::blob range = clamp_range(*data, offset, length);
+			storage::prefault(range);
+			return range;
+		} catch(std::exception& ex) {
+			std::cerr << "Could not retrieve " << key.data_class << "/" << key.id << ": " << ex.what() << std::endl;
+			return std::nullopt;
+		}
+	});
+}
+
+
+rpc::stream<std::optional<rpc::blob>> registry_service::retrieve_stream(std::string data_class, uint64_t id) {
+	rpc::stream<std::optional<rpc::blob>> result;
+	storage::cache_key key{std::move(data_class), id};
+	if(auto data = hot_blobs.get(key)) {
+		for(size_t offset = 0; offset < data->size(); offset += stream_chunk_size) {
+			result.push(clamp_range(*data, offset, stream_chunk_size));
+		}
+		result.finish();
+		return result;
+	}
+	// Mapping the file is cheap; the pages are read one chunk at a time by stream_from
+	io.submit<std::optional<rpc::blob>>("open", [this, key]() -> std::optional<rpc::blob> {
+		try {
+			return blobs.retrieve(key.data_class, key.id);
+		} catch(std::exception& ex) {
+			std::cerr << "Could not retrieve " << key.data_class << "/" << key.id << ": " << ex.what() << std::endl;
+			return std::nullopt;
+		}
+	}) | [this, result](std::optional<rpc::blob> data) mutable {
+		if(!data) {
+			result.push(std::nullopt);
+			result.finish();
+		} else {
+			stream_from(result, std::move(*data), 0);
+		}
+	};
+	return result;
+}
+
+
+void registry_service::stream_from(rpc::stream<std::optional<rpc::blob>> result, rpc::blob data, size_t offset) {
+	if(offset >= data.size()) {
+		result.finish();
+		return;
+	}
+	rpc::blob chunk = clamp_range(data, offset, stream_chunk_size);
+	// Chunks are read one after another and each goes out as soon as it is in memory, so the invoker gets the first bytes
+	// long before the last ones are read
+	io.submit<bool>("retrieve_chunk", [chunk]() {
+		storage::prefault(chunk);
+		return true;
+	}) | [this, result, data = std::move(data), chunk, offset](bool) mutable {
+		result.push(chunk);
+		stream_from(std::move(result), std::move(data), offset + chunk.size());
+	};
+}
+
+
+bool registry_service::claim(std::string data_class, uint64_t id, std::chrono::milliseconds ttl) {
+	auto now = std::chrono::steady_clock::now();
+	if(claims.size() >= 2 * claims_pruned_at + 1024) {
+		std::erase_if(claims, [now](auto& claim) {
+			return claim.second <= now;
+		});
+		claims_pruned_at = claims.size();
+	}
+	auto [it, is_new] = claims.try_emplace({std::move(data_class), id}, now + ttl);
+	if(!is_new && it->second > now) {
+		return false;
+	}
+	it->second = now + ttl;
+	return true;
+}
+
+
+async::promise<bool> registry_service::erase(std::string data_class, uint64_t id) {
+	storage::cache_key key{std::move(data_class), id};
+	hot_blobs.erase(key);
+	reads_in_flight.erase(key);
+	async::promise<bool> result;
+	io.submit<std::optional<uint64_t>>("erase", [this, key]() -> std::optional<uint64_t> {
+		try {
+			return blobs.erase(key.data_class, key.id);
+		} catch(std::exception& ex) {
+			std::cerr << "Could not erase " << key.data_class << "/" << key.id << ": " << ex.what() << std::endl;
+			return std::nullopt;
+		}
+	}) | [this, key, result](std::optional<uint64_t> position) mutable {
+		n_stores_finished++;
+		hot_blobs.erase(key);
+		if(!position) {
+			claims.erase(key);
+			result.set(false);
+			return;
+		}
+		when_durable(*position, [this, key, result]() mutable {
+			claims.erase(key);
+			result.set(true);
+		});
+	};
+	return result;
+}
+
+
+rpc::stream<std::vector<registry_key>> registry_service::list_keys() {
+	rpc::stream<std::vector<registry_key>> result;
+	io.submit<std::vector<std::pair<std::string, uint64_t>>>("list_keys", [this]() -> std::vector<std::pair<std::string, uint64_t>> {
+		try {
+			return blobs.list_keys();
+		} catch(std::exception& ex) {
+			std::cerr << "Could not list keys: " << ex.what() << std::endl;
+			return {};
+		}
+	}) | [result](std::vector<std::pair<std::string, uint64_t>> keys) mutable {
+		for(size_t begin = 0; begin < keys.size(); begin += list_batch_size) {
+			std::vector<registry_key> batch;
+			for(size_t i = begin; i < std::min(keys.size(), begin + list_batch_size); i++) {
+				batch.push_back({std::move(keys[i].first), keys[i].second});
+			}
+			result.push(std::move(batch));
+		}
+		result.finish();
+	};
+	return result;
+}
+
+
+async::promise<std::vector<bool>> registry_service::store_many(std::vector<registry_entry> entries) {
+	for(auto& entry: entries) {
+		hot_blobs.erase({entry.data_class, entry.id});
+		reads_in_flight.erase({entry.data_class, entry.id});
+	}
+	auto shared_entries = std::make_shared<std::vector<registry_entry>>(std::move(entries));
+	async::promise<std::vector<bool>> result;
+	// The batch is acknowledged as a whole once its last write is durable
+	io.submit<std::pair<std::vector<bool>, uint64_t>>("store_many", [this, shared_entries]() {
+		std::pair<std::vector<bool>, uint64_t> outcome{{}, 0};
+		for(auto& entry: *shared_entries) {
+			try {
+				outcome.second = std::max(outcome.second, blobs.store(entry.data_class, entry.id, entry.data));
+				outcome.first.push_back(true);
+			} catch(std::exception& ex) {
+				std::cerr << "Could not store " << entry.data_class << "/" << entry.id << ": " << ex.what() << std::endl;
+				outcome.first.push_back(false);
+			}
+		}
+		return outcome;
+	}) | [this, shared_entries, result](std::pair<std::vector<bool>, uint64_t> outcome) mutable {
+		n_stores_finished++;
+		// Only the keys are kept until the writes are durable, not the data
+		std::vector<storage::cache_key> keys;
+		for(auto& entry: *shared_entries) {
+			hot_blobs.erase({entry.data_class, entry.id});
+			keys.push_back({entry.data_class, entry.id});
+		}
+		when_durable(outcome.second, [this, keys = std::move(keys), result, is_stored = std::move(outcome.first)]() mutable {
+			for(auto& key: keys) {
+				claims.erase(key);
+			}
+			result.set(std::move(is_stored));
+		});
+	};
+	return result;
+}
+
+
+rpc::stream<std::vector<registry_blob_item>> registry_service::retrieve_many(std::vector<registry_key> keys) {
+	rpc::stream<std::vector<registry_blob_item>> result;
+
+	// Everything that is in memory goes out at once, in a single frame
+	std::vector<registry_blob_item> hits;
+	std::vector<size_t> misses;
+	for(size_t i = 0; i < keys.size(); i++) {
+		if(auto data = hot_blobs.get({keys[i].data_class, keys[i].id})) {
+			hits.push_back({i, std::move(data)});
+		} else {
+			misses.push_back(i);
+		}
+	}
+	if(!hits.empty()) {
+		result.push(std::move(hits));
+	}
+	if(misses.empty()) {
+		result.finish();
+		return result;
+	}
+
+	// Neighbouring ids of a class are usually written together and so lie close on disk
+	std::sort(misses.begin(), misses.end(), [&](size_t a, size_t b) {
+		return std::tie(keys[a].data_class, keys[a].id) < std::tie(keys[b].data_class, keys[b].id);
+	});
+
+	auto n_jobs_left = std::make_shared<size_t>((misses.size() + retrieve_batch_size - 1) / retrieve_batch_size);
+	uint64_t n_stores_started = n_stores_finished;
+	for(size_t begin = 0; begin < misses.size(); begin += retrieve_batch_size) {
+		auto indices = std::make_shared<std::vector<size_t>>(misses.begin() + begin, misses.begin() + std::min(misses.size(), begin + retrieve_batch_size));
+		auto batch = std::make_shared<std::vector<std::pair<std::string, uint64_t>>>();
+		for(size_t i: *indices) {
+			batch->emplace_back(keys[i].data_class, keys[i].id);
+		}
+		io.submit<std::vector<std::optional<rpc::blob>>>("retrieve_many", [this, batch]() -> std::vector<std::optional<rpc::blob>> {
+			try {
+				auto blobs_read = blobs.retrieve_many(*batch);
+				for(auto& data: blobs_read) {
+					if(data) {
+						storage::prefault(*data);
+					}
+				}
+				return blobs_read;
+			} catch(std::exception& ex) {
+				std::cerr << "Could not retrieve a batch of " << batch->size() << " blobs: " << ex.what() << std::endl;
+				return std::vector<std::optional<rpc::blob>>(batch->size());
+			}
+		}) | [this, result, indices, batch, n_jobs_left, n_stores_started](std::vector<std::optional<rpc::blob>> blobs_read) mutable {
+			std::vector<registry_blob_item> items;
+			for(size_t j = 0; j < indices->size(); j++) {
+				if(blobs_read[j] && n_stores_finished == n_stores_started) {
+					hot_blobs.put({(*batch)[j].first, (*batch)[j].second}, *blobs_read[j]);
+				}
+				items.push_back({(*indices)[j], std::move(blobs_read[j])});
+			}
+			result.push(std::move(items));
+			if(--*n_jobs_left == 0) {
+				result.finish();
+			}
+		};
+	}
+	return result;
+}
+
+
+void registry_service::read_ahead(const std::string& data_class, uint64_t id) {
+	auto [it, inserted] = last_retrieved_ids.try_emplace(data_class, id);
+	bool is_sequential = !inserted && it->second + 1 == id;
+	it->second = id;
+	if(!is_sequential) {
+		return;
+	}
+	// Tests are usually stored under consecutive ids and fetched in order, so fetch the next few into the cache while
+	// the disk is otherwise idle
+	for(uint64_t next_id = id + 1; next_id <= id + readahead && !io.is_busy(); next_id++) {
+		storage::cache_key key{data_class, next_id};
+		if(!hot_blobs.contains(key) && !reads_in_flight.count(key)) {
+			load(std::move(key));
+		}
+	}
+}
+
+
+registry_cache_stats registry_service::cache_stats() const {
+	storage::cache_counters counters = hot_blobs.stats();
+	return {counters.hits, counters.misses, counters.evictions, counters.size, counters.capacity, counters.n_entries};
+}
+
+
+std::vector<registry_io_stats> registry_service::io_stats() const {
+	std::vector<registry_io_stats> result;
+	for(auto& [operation, latencies]: io.stats()) {
+		result.push_back({operation, latencies.size(), latencies.percentile(0.5), latencies.percentile(0.99), latencies.max()});
+	}
+	return result;
+}
@@ -0,0 +1,295 @@
+#include <algorithm>
+#include <cerrno>
+#include <memory>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "storage.hpp"
+
+
+namespace storage {
+	namespace {
+		struct mapping {
+			void* addr;
+			size_t size;
+
+			mapping(void* addr, size_t size): addr(addr), size(size) {
+			}
+			mapping(const mapping&) = delete;
+			mapping& operator=(const mapping&) = delete;
+			~mapping() {
+				munmap(addr, size);
+			}
+		};
+
+
+		[[noreturn]] void throw_errno(const std::string& what, const std::filesystem::path& path) {
+			throw std::system_error(errno, std::generic_category(), what + " " + path.string());
+		}
+
+
+		constexpr const char* digest_attribute = "user.sha256";
+
+
+		void sync_directory(const std::filesystem::path& path) {
+			int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if(fd == -1) {
+				throw_errno("Could not open", path);
+			}
+			int result = fsync(fd);
+			int saved_errno = errno;
+			close(fd);
+			if(result == -1) {
+				errno = saved_errno;
+				throw_errno("Could not sync", path);
+			}
+		}
+
+
+		void write_object(const std::filesystem::path& path, tcb::span<const std::byte> data, const sha256::digest& digest, bool is_durable) {
+			int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+			if(fd == -1) {
+				throw_errno("Could not create", path);
+			}
+			const std::byte* ptr = data.data();
+			size_t left = data.size();
+			while(left > 0) {
+				ssize_t n = write(fd, ptr, left);
+				if(n == -1) {
+					if(errno == EINTR) {
+						continue;
+					}
+					int saved_errno = errno;
+					close(fd);
+					unlink(path.c_str());
+					errno = saved_errno;
+					throw_errno("Could not write to", path);
+				}
+				ptr += n;
+				left -= n;
+			}
+			// Not every filesystem supports extended attributes; stat() falls back to hashing the contents then. The
+			// attribute has to be set before the file becomes read-only.
+			fsetxattr(fd, digest_attribute, digest.data(), digest.size(), 0);
+			fchmod(fd, 0444);
+			if(is_durable && fsync(fd) == -1) {
+				int saved_errno = errno;
+				close(fd);
+				unlink(path.c_str());
+				errno = saved_errno;
+				throw_errno("Could not sync", path);
+			}
+			close(fd);
+		}
+
+
+		// rename(2) and link(2) do not create parent directories; these are created lazily on the first ENOENT
+		template<typename F> void with_parent_directory(const std::filesystem::path& path, F&& f) {
+			if(f() == 0) {
+				return;
+			}
+			if(errno != ENOENT) {
+				throw_errno("Could not create", path);
+			}
+			std::filesystem::create_directories(path.parent_path());
+			if(f() != 0) {
+				throw_errno("Could not create", path);
+			}
+		}
+	}
+
+
+	bool is_valid_data_class(const std::string& data_class) {
+		if(data_class.empty() || data_class.size() > 64) {
+			return false;
+		}
+		return std::all_of(data_class.begin(), data_class.end(), [](char c) {
+			return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || ('0' <= c && c <= '9') || c == '_' || c == '-';
+		});
+	}
+
+
+	blob_store::blob_store(std::filesystem::path root_, bool is_durable): root(std::move(root_)), is_durable(is_durable) {
+		std::filesystem::create_directories(root / "objects");
+		std::filesystem::create_directories(root / "refs");
+		// Leftovers from writes interrupted by a crash
+		std::filesystem::remove_all(root / "tmp");
+		std::filesystem::create_directories(root / "tmp");
+	}
+
+
+	std::filesystem::path blob_store::object_path(const sha256::digest& digest) const {
+		std::string hex = sha256::to_hex(digest);
+		return root / "objects" / hex.substr(0, 2) / hex;
+	}
+
+	std::filesystem::path blob_store::ref_path(const std::string& data_class, uint64_t id) const {
+		if(!is_valid_data_class(data_class)) {
+			throw std::invalid_argument("Invalid data class");
+		}
+		static constexpr char digits[] = "0123456789abcdef";
+		char fanout[3] = {digits[(id >> 4) & 15], digits[id & 15], '\0'};
+		return root / "refs" / data_class / fanout / std::to_string(id);
+	}
+
+	std::filesystem::path blob_store::tmp_path() {
+		return root / "tmp" / (std::to_string(getpid()) + "-" + std::to_string(next_tmp_id++));
+	}
+
+
+	sha256::digest blob_store::store(const std::string& data_class, uint64_t id, tcb::span<const std::byte> data) {
+		std::filesystem::path ref = ref_path(data_class, id);
+		sha256::digest digest = sha256::hash(data.data(), data.size());
+		std::filesystem::path object = object_path(digest);
+
+		std::filesystem::path tmp = tmp_path();
+		// The object may be collected as garbage between the check and link(2), in which case it is simply written again
+		while(link(object.c_str(), tmp.c_str()) == -1) {
+			if(errno != ENOENT) {
+				throw_errno("Could not link", tmp);
+			}
+			std::filesystem::path tmp_object = tmp_path();
+			write_object(tmp_object, data, digest, is_durable);
+			with_parent_directory(object, [&]() {
+				return rename(tmp_object.c_str(), object.c_str());
+			});
+		}
+		if(is_durable) {
+			// Even if the object was already there, whoever renamed it into place may not have synced the directory yet
+			sync_directory(object.parent_path());
+		}
+		with_parent_directory(ref, [&]() {
+			return rename(tmp.c_str(), ref.c_str());
+		});
+		return digest;
+	}
+
+
+	bool blob_store::link_object(const std::string& data_class, uint64_t id, const sha256::digest& digest) {
+		std::filesystem::path ref = ref_path(data_class, id);
+		std::filesystem::path object = object_path(digest);
+		std::filesystem::path tmp = tmp_path();
+		if(link(object.c_str(), tmp.c_str()) == -1) {
+			if(errno == ENOENT) {
+				return false;
+			}
+			throw_errno("Could not link", tmp);
+		}
+		with_parent_directory(ref, [&]() {
+			return rename(tmp.c_str(), ref.c_str());
+		});
+		return true;
+	}
+
+
+	std::optional<rpc::blob> blob_store::retrieve(const std::string& data_class, uint64_t id) {
+		std::filesystem::path ref = ref_path(data_class, id);
+
+		int fd = open(ref.c_str(), O_RDONLY | O_CLOEXEC);
+		if(fd == -1) {
+			if(errno == ENOENT) {
+				return std::nullopt;
+			}
+			throw_errno("Could not open", ref);
+		}
+
+		struct stat st;
+		if(fstat(fd, &st) == -1) {
+			int saved_errno = errno;
+			close(fd);
+			errno = saved_errno;
+			throw_errno("Could not stat", ref);
+		}
+		if(st.st_size == 0) {
+			close(fd);
+			return rpc::blob{};
+		}
+
+		void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		int saved_errno = errno;
+		close(fd);
+		if(addr == MAP_FAILED) {
+			errno = saved_errno;
+			throw_errno("Could not mmap", ref);
+		}
+
+		auto owner = std::make_shared<const mapping>(addr, st.st_size);
+		return rpc::blob{std::move(owner), static_cast<const std::byte*>(addr), static_cast<size_t>(st.st_size)};
+	}
+
+
+	std::optional<object_info> blob_store::stat(const std::string& data_class, uint64_t id) {
+		std::filesystem::path ref = ref_path(data_class, id);
+		object_info info;
+		ssize_t n = getxattr(ref.c_str(), digest_attribute, info.digest.data(), info.digest.size());
+		if(n == -1 && errno == ENOENT) {
+			return std::nullopt;
+		}
+		if(n != static_cast<ssize_t>(info.digest.size())) {
+			auto data = retrieve(data_class, id);
+			if(!data) {
+				return std::nullopt;
+			}
+			return object_info{data->size(), sha256::hash(data->data(), data->size())};
+		}
+		struct stat st;
+		if(::stat(ref.c_str(), &st) == -1) {
+			if(errno == ENOENT) {
+				return std::nullopt;
+			}
+			throw_errno("Could not stat", ref);
+		}
+		info.size = st.st_size;
+		return info;
+	}
+
+
+	bool blob_store::erase(const std::string& data_class, uint64_t id) {
+		std::filesystem::path ref = ref_path(data_class, id);
+		if(unlink(ref.c_str()) == -1) {
+			if(errno == ENOENT) {
+				return false;
+			}
+			throw_errno("Could not remove", ref);
+		}
+		return true;
+	}
+
+
+	std::vector<std::pair<std::string, uint64_t>> blob_store::list_keys() {
+		std::vector<std::pair<std::string, uint64_t>> result;
+		for(auto& class_dir: std::filesystem::directory_iterator(root / "refs")) {
+			std::string data_class = class_dir.path().filename().string();
+			if(!is_valid_data_class(data_class)) {
+				continue;
+			}
+			for(auto& entry: std::filesystem::recursive_directory_iterator(class_dir.path())) {
+				std::string name = entry.path().filename().string();
+				if(entry.is_regular_file() && !name.empty() && std::all_of(name.begin(), name.end(), [](char c) { return '0' <= c && c <= '9'; })) {
+					result.emplace_back(data_class, std::stoull(name));
+				}
+			}
+		}
+		return result;
+	}
+
+
+	size_t blob_store::collect_garbage() {
+		size_t n_removed = 0;
+		for(auto& entry: std::filesystem::recursive_directory_iterator(root / "objects")) {
+			struct stat st;
+			if(entry.is_regular_file() && ::stat(entry.path().c_str(), &st) == 0 && st.st_nlink == 1) {
+				if(unlink(entry.path().c_str()) == 0) {
+					n_removed++;
+				}
+			}
+		}
+		return n_removed;
+	}
+}
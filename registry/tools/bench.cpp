@@ -0,0 +1,63 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "engine.hpp"
+
+
+// Measures durable store throughput of the storage engine with a varying number of concurrent writers, each of which
+// waits for its previous store to become durable before issuing the next one, like a client waiting for the reply.
+
+
+int main(int argc, char** argv) {
+	if(argc < 2) {
+		std::cerr << "Usage: " << argv[0] << " <scratch_dir> [blob_size] [seconds] [group_commit_delay_us]" << std::endl;
+		return 1;
+	}
+	std::filesystem::path dir = argv[1];
+	size_t blob_size = argc > 2 ? std::stoull(argv[2]) : 4096;
+	std::chrono::seconds duration{argc > 3 ? std::stoll(argv[3]) : 5};
+	std::chrono::microseconds group_commit_delay{argc > 4 ? std::stoll(argv[4]) : 0};
+
+	std::cout << "writers\tstores/s\tMiB/s" << std::endl;
+	for(int n_writers: {1, 8, 64}) {
+		std::filesystem::remove_all(dir);
+		std::filesystem::create_directories(dir);
+		storage::engine_options options;
+		options.group_commit_delay = group_commit_delay;
+		storage::engine blobs(dir, options);
+
+		std::atomic<bool> is_stopping = false;
+		std::atomic<uint64_t> n_stores = 0;
+		std::vector<std::thread> writers;
+		for(int writer = 0; writer < n_writers; writer++) {
+			writers.emplace_back([&, writer]() {
+				std::vector<std::byte> data(blob_size);
+				for(uint64_t i = 0; !is_stopping; i++) {
+					// Distinct contents, so that nothing is deduplicated
+					std::memcpy(data.data(), &i, std::min(sizeof(i), data.size()));
+					std::memcpy(data.data() + data.size() - std::min(sizeof(writer), data.size()), &writer, std::min(sizeof(writer), data.size()));
+					blobs.wait_durable(blobs.store("bench", uint64_t(writer) << 32 | i, data));
+					n_stores++;
+				}
+			});
+		}
+		std::this_thread::sleep_for(duration);
+		is_stopping = true;
+		for(auto& writer: writers) {
+			writer.join();
+		}
+
+		double stores_per_second = double(n_stores) / duration.count();
+		std::cout << n_writers << "\t" << uint64_t(stores_per_second) << "\t" << stores_per_second * blob_size / (1024 * 1024) << std::endl;
+	}
+	std::filesystem::remove_all(dir);
+	return 0;
+}
@@ -0,0 +1,207 @@
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+
+#include <nlohmann/json.hpp>
+#include <uvw.hpp>
+
+#include "common/hash_ring.hpp"
+#include "rpc/client.hpp"
+
+#include "protocol.hpp"
+
+
+// Moves objects to the nodes that own them under the configured ring, after nodes were added or removed. Every node,
+// including the draining ones, is scanned in turn; objects missing on an owner are copied there, and objects on a node
+// that does not own them anymore are erased once all owners have them. A copy is skipped if the owner already has the
+// key, so that a newer version written by a client in the meantime is not overwritten.
+
+
+class empty_impl: public rpc::simplex_impl<empty_impl, rpc::EmptyProtocol> {
+};
+
+using registry_client = rpc::client<registry_protocol, empty_impl>;
+
+
+class rebalancer {
+	struct migration {
+		registry_key key;
+		size_t n_targets_left;
+		bool is_copied_everywhere = true;
+	};
+
+	std::vector<std::unique_ptr<registry_client>> nodes;
+	hash_ring ring;
+	size_t n_replicas;
+	size_t max_in_flight;
+
+	size_t source = 0;
+	bool is_listed = false;
+	std::deque<registry_key> keys;
+	size_t n_in_flight = 0;
+
+	uint64_t n_checked = 0;
+	uint64_t n_copied = 0;
+	uint64_t n_erased = 0;
+	uint64_t n_failed = 0;
+
+	void scan() {
+		if(source == nodes.size()) {
+			std::cerr << "Done: " << n_checked << " objects checked, " << n_copied << " copied, " << n_erased << " erased, " << n_failed << " failed" << std::endl;
+			for(auto& node: nodes) {
+				node->stop();
+			}
+			return;
+		}
+		std::cerr << "Scanning node #" << source << std::endl;
+		(*nodes[source])->list_keys().subscribe([this](std::vector<registry_key> batch) {
+			keys.insert(keys.end(), std::make_move_iterator(batch.begin()), std::make_move_iterator(batch.end()));
+			pump();
+		}, [this]() {
+			is_listed = true;
+			pump();
+		});
+	}
+
+	void pump() {
+		while(n_in_flight < max_in_flight && !keys.empty()) {
+			registry_key key = std::move(keys.front());
+			keys.pop_front();
+			migrate(std::move(key));
+		}
+		if(is_listed && keys.empty() && n_in_flight == 0) {
+			source++;
+			is_listed = false;
+			scan();
+		}
+	}
+
+	void migrate(registry_key key) {
+		if(++n_checked % 10000 == 0) {
+			std::cerr << n_checked << " objects checked, " << n_copied << " copied, " << n_erased << " erased" << std::endl;
+		}
+
+		std::vector<size_t> owners = ring.owners(key.data_class, key.id, n_replicas);
+		std::vector<size_t> targets;
+		for(size_t owner: owners) {
+			if(owner != source) {
+				targets.push_back(owner);
+			}
+		}
+		if(targets.empty()) {
+			return;
+		}
+
+		n_in_flight++;
+		auto state = std::make_shared<migration>(migration{std::move(key), targets.size()});
+		for(size_t target: targets) {
+			(*nodes[target])->stat(state->key.data_class, state->key.id) | [this, state, target](std::optional<registry_stat> stat) {
+				if(stat) {
+					finish_target(state, true);
+					return;
+				}
+				(*nodes[source])->retrieve(state->key.data_class, state->key.id) | [this, state, target](std::optional<std::vector<std::byte>> data) {
+					if(!data) {
+						// Erased by someone else in the meantime
+						finish_target(state, true);
+						return;
+					}
+					(*nodes[target])->store(state->key.data_class, state->key.id, std::move(*data)) | [this, state](bool is_stored) {
+						n_copied += is_stored;
+						finish_target(state, is_stored);
+					};
+				};
+			};
+		}
+	}
+
+	void finish_target(std::shared_ptr<migration> state, bool is_copied) {
+		state->is_copied_everywhere = state->is_copied_everywhere && is_copied;
+		if(--state->n_targets_left > 0) {
+			return;
+		}
+		std::vector<size_t> owners = ring.owners(state->key.data_class, state->key.id, n_replicas);
+		bool is_owner = std::find(owners.begin(), owners.end(), source) != owners.end();
+		if(!state->is_copied_everywhere) {
+			std::cerr << "Could not copy " << state->key.data_class << "/" << state->key.id << ", keeping it on node #" << source << std::endl;
+			n_failed++;
+		} else if(!is_owner) {
+			(*nodes[source])->erase(state->key.data_class, state->key.id) | [this](bool is_erased) {
+				n_erased += is_erased;
+				n_in_flight--;
+				pump();
+			};
+			return;
+		}
+		n_in_flight--;
+		pump();
+	}
+
+public:
+	rebalancer(const std::vector<std::string>& ring_nodes, const std::vector<std::string>& draining_nodes, size_t n_replicas, size_t max_in_flight): ring(ring_nodes), n_replicas(n_replicas), max_in_flight(max_in_flight) {
+		for(auto& address: ring_nodes) {
+			nodes.push_back(std::make_unique<registry_client>(address));
+		}
+		for(auto& address: draining_nodes) {
+			nodes.push_back(std::make_unique<registry_client>(address));
+		}
+	}
+
+	void start() {
+		scan();
+	}
+};
+
+
+
+int main(int argc, char** argv) {
+	if(argc != 2) {
+		std::cerr << "Usage: " << argv[0] << " <path_to_config>" << std::endl;
+		return 1;
+	}
+
+
+	std::filesystem::path config_path;
+	try {
+		config_path = std::filesystem::absolute(std::filesystem::path(argv[1]));
+		std::filesystem::current_path(config_path.parent_path());
+	} catch(std::filesystem::filesystem_error&) {
+		std::cerr << "Could not open configuration file at " << argv[1] << std::endl;
+		return 1;
+	}
+
+
+	// Parse config
+	nlohmann::json config;
+	{
+		std::ifstream fin(config_path.c_str());
+		if(!fin) {
+			std::cerr << "Could not open configuration file at " << argv[1] << std::endl;
+			return 1;
+		}
+		fin >> config;
+		char c;
+		if(fin >> c) {
+			std::cerr << "The configuration file contains excess data" << std::endl;
+			return 1;
+		}
+	}
+
+
+	auto loop = uvw::Loop::getDefault();
+
+	rebalancer worker(
+		config.at("nodes").get<std::vector<std::string>>(),
+		config.value("draining", std::vector<std::string>{}),
+		config.value<size_t>("replicas", 1),
+		config.value<size_t>("max_in_flight", 4)
+	);
+	worker.start();
+
+	loop->run();
+
+
+	return 0;
+}
@@ -0,0 +1,137 @@
+#ifndef RPC_BUFFER_HPP
+#define RPC_BUFFER_HPP
+
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include <tcb/span.hpp>
+
+
+namespace rpc {
+	// An immutable, reference-counted view of bytes. The owner keeps the underlying storage (a vector, an mmapped
+	// file, ...) alive for as long as any view exists, so one blob can be queued to many sockets without copying.
+	class blob {
+		std::shared_ptr<const void> _owner;
+		const std::byte* _data = nullptr;
+		size_t _size = 0;
+
+	public:
+		blob() = default;
+		blob(std::shared_ptr<const void> owner, const std::byte* data, size_t size): _owner(std::move(owner)), _data(data), _size(size) {
+		}
+		explicit blob(std::vector<std::byte> data) {
+			auto owner = std::make_shared<const std::vector<std::byte>>(std::move(data));
+			_data = owner->data();
+			_size = owner->size();
+			_owner = std::move(owner);
+		}
+
+		const std::byte* data() const {
+			return _data;
+		}
+		size_t size() const {
+			return _size;
+		}
+		bool empty() const {
+			return _size == 0;
+		}
+		const std::byte* begin() const {
+			return _data;
+		}
+		const std::byte* end() const {
+			return _data + _size;
+		}
+
+		tcb::span<const std::byte> span() const {
+			return {_data, _size};
+		}
+		blob slice(size_t offset, size_t length) const {
+			return {_owner, _data + offset, length};
+		}
+		std::vector<std::byte> to_vector() const {
+			return {_data, _data + _size};
+		}
+	};
+
+
+	// A serialization target that keeps large blobs out of line instead of copying them into one contiguous buffer.
+	class buffer_chain {
+		static constexpr size_t splice_threshold = 4096;
+
+		std::vector<blob> segments;
+		std::vector<std::byte> tail;
+		size_t segments_size = 0;
+
+		void flush_tail() {
+			if(!tail.empty()) {
+				segments_size += tail.size();
+				segments.emplace_back(std::move(tail));
+				tail.clear();
+			}
+		}
+
+	public:
+		void append(std::byte data) {
+			tail.push_back(data);
+		}
+		void append(const std::byte* begin, const std::byte* end) {
+			tail.insert(tail.end(), begin, end);
+		}
+		void append(const blob& data) {
+			if(data.size() < splice_threshold) {
+				append(data.begin(), data.end());
+				return;
+			}
+			flush_tail();
+			segments_size += data.size();
+			segments.push_back(data);
+		}
+		void append(buffer_chain&& other) {
+			if(!other.segments.empty()) {
+				flush_tail();
+				segments_size += other.segments_size;
+				segments.insert(segments.end(), std::make_move_iterator(other.segments.begin()), std::make_move_iterator(other.segments.end()));
+			}
+			if(tail.empty()) {
+				tail = std::move(other.tail);
+			} else {
+				tail.insert(tail.end(), other.tail.begin(), other.tail.end());
+			}
+		}
+
+		size_t size() const {
+			return segments_size + tail.size();
+		}
+
+		std::vector<blob> into_segments() && {
+			flush_tail();
+			return std::move(segments);
+		}
+	};
+
+
+	inline void write_bytes(std::vector<std::byte>& to, std::byte data) {
+		to.push_back(data);
+	}
+	inline void write_bytes(std::vector<std::byte>& to, const std::byte* begin, const std::byte* end) {
+		to.insert(to.end(), begin, end);
+	}
+	inline void write_bytes(std::vector<std::byte>& to, const blob& data) {
+		to.insert(to.end(), data.begin(), data.end());
+	}
+
+	inline void write_bytes(buffer_chain& to, std::byte data) {
+		to.append(data);
+	}
+	inline void write_bytes(buffer_chain& to, const std::byte* begin, const std::byte* end) {
+		to.append(begin, end);
+	}
+	inline void write_bytes(buffer_chain& to, const blob& data) {
+		to.append(data);
+	}
+}
+
+
+#endif
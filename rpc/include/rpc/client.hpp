@@ -43,12 +43,15 @@ namespace rpc {
 		generic_protocol server_protocol;
 		std::map<std::string, int32_t> server_ids_of_methods;
 		std::map<size_t, async::promise<std::vector<std::byte>>> promises;
+		std::map<size_t, std::function<void(std::vector<std::byte>)>> partial_handlers;
 		uint64_t next_message_id = 0;
 
 		generic_impl client_impl;
 
 		std::vector<pending_message> pending_messages;
 
+		std::function<void(void)> on_connect;
+
 		template<typename Handle, typename Address> void _connect_impl(Address&& address);
 
 		void on_incoming_handshake(tcb::span<const std::byte> span);
@@ -58,10 +61,8 @@ namespace rpc {
 		struct proxy_invoker {
 			generic_client* client;
 
-			template<typename ReturnType, typename... Args> async::promise<ReturnType> invoke(const char* method_name, Args&&... args) {
-				return client->invoke(method_name, serialize(std::tuple<Args...>{std::forward<Args>(args)...})) | [](const std::vector<std::byte>& data) {
-					return deserialize<ReturnType>(data);
-				};
+			template<typename ReturnType, typename... Args> auto invoke(const char* method_name, Args&&... args) {
+				return invoke_and_deserialize<ReturnType>(*client, method_name, serialize(std::tuple<Args...>{std::forward<Args>(args)...}));
 			}
 		};
 
@@ -75,7 +76,9 @@ namespace rpc {
 
 		void stop();
 		void reconnect(bool due_to_failure = false);
-		async::promise<std::vector<std::byte>> invoke(const char* method_name, std::vector<std::byte>&& args);
+		// Called after every successful handshake, including reconnects; calls made from it go out before the queued ones
+		void set_connect_handler(std::function<void(void)> handler);
+		async::promise<std::vector<std::byte>> invoke(const char* method_name, std::vector<std::byte>&& args, std::function<void(std::vector<std::byte>)> on_partial = nullptr);
 	};
 
 
@@ -88,8 +91,8 @@ namespace rpc {
 			server_invoker(client& _client): _client(_client) {
 			}
 
-			virtual async::promise<std::vector<std::byte>> invoke(const char* method_name, std::vector<std::byte>&& args) {
-				return _client.invoke(method_name, std::move(args));
+			virtual async::promise<std::vector<std::byte>> invoke(const char* method_name, std::vector<std::byte>&& args, std::function<void(std::vector<std::byte>)> on_partial) {
+				return _client.invoke(method_name, std::move(args), std::move(on_partial));
 			}
 		};
 
@@ -107,6 +110,11 @@ namespace rpc {
 		auto operator->() {
 			return &proxy;
 		}
+
+		// The object that serves the calls the server makes over this connection
+		ClientImpl& impl() {
+			return *static_cast<ClientImpl*>(client_impl_object);
+		}
 	};
 };
 
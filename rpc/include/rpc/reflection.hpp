@@ -11,6 +11,7 @@
 #include "common/async.hpp"
 
 #include "serialization.hpp"
+#include "stream.hpp"
 
 
 #define RPC_PROTOCOL(protocol_name, body) \
@@ -72,7 +73,7 @@ namespace rpc {
 		struct method_impl {
 			const char* name;
 			std::string signature;
-			std::function<async::promise<std::vector<std::byte>>(void*, const std::vector<std::byte>&)> fn;
+			std::function<async::promise<buffer_chain>(void*, const std::vector<std::byte>&, std::function<void(buffer_chain)>)> fn;
 		};
 	}
 
@@ -131,20 +132,36 @@ namespace rpc {
 	class generic_peer_invoker {
 	public:
 		virtual ~generic_peer_invoker() = default;
-		virtual async::promise<std::vector<std::byte>> invoke(const char* method_name, std::vector<std::byte>&& args) = 0;
+		virtual async::promise<std::vector<std::byte>> invoke(const char* method_name, std::vector<std::byte>&& args, std::function<void(std::vector<std::byte>)> on_partial) = 0;
 	};
 
 
+	// Turns a serialized call into the proxy's return value: a promise, or a stream fed by partial responses
+	template<typename ReturnType, typename Invoker> auto invoke_and_deserialize(Invoker& invoker, const char* method_name, std::vector<std::byte>&& args) {
+		if constexpr(is_stream_v<ReturnType>) {
+			ReturnType result;
+			invoker.invoke(method_name, std::move(args), [result](std::vector<std::byte> data) mutable {
+				result.push(deserialize<typename ReturnType::value_type>(data));
+			}) | [result](const std::vector<std::byte>&) mutable {
+				result.finish();
+			};
+			return result;
+		} else {
+			return invoker.invoke(method_name, std::move(args), nullptr) | [](const std::vector<std::byte>& data) {
+				return deserialize<ReturnType>(data);
+			};
+		}
+	}
+
+
 	struct peer_proxy_invoker {
 		std::unique_ptr<generic_peer_invoker> invoker;
 
 		peer_proxy_invoker(std::unique_ptr<generic_peer_invoker>&& invoker): invoker(std::move(invoker)) {
 		}
 
-		template<typename ReturnType, typename... Args> async::promise<ReturnType> invoke(const char* method_name, Args&&... args) {
-			return invoker->invoke(method_name, serialize(std::tuple<Args...>{std::forward<Args>(args)...})) | [](const std::vector<std::byte>& data) {
-				return deserialize<ReturnType>(data);
-			};
+		template<typename ReturnType, typename... Args> auto invoke(const char* method_name, Args&&... args) {
+			return invoke_and_deserialize<ReturnType>(*invoker, method_name, serialize(std::tuple<Args...>{std::forward<Args>(args)...}));
 		}
 	};
 
@@ -162,7 +179,7 @@ namespace rpc {
 				template<typename Signature> struct announcement {
 					template<typename Getter> inline announcement(const char* method_name, Getter&& getter) {
 						auto method = getter(impl_container{});
-						_reflection.methods.push_back({method_name, stringify_type<std::remove_pointer_t<Signature>>(), [method](void* impl_ptr, const std::vector<std::byte>& args) -> async::promise<std::vector<std::byte>> {
+						_reflection.methods.push_back({method_name, stringify_type<std::remove_pointer_t<Signature>>(), [method](void* impl_ptr, const std::vector<std::byte>& args, std::function<void(buffer_chain)> send_partial) -> async::promise<buffer_chain> {
 							SelfImpl& self_impl = *static_cast<SelfImpl*>(impl_ptr);
 							auto get_result = [&]() -> decltype(auto) {
 								return std::apply([&self_impl, method](auto&&... args) -> decltype(auto) {
@@ -171,10 +188,18 @@ namespace rpc {
 							};
 							if constexpr(std::is_same_v<decltype(get_result()), void>) {
 								get_result();
-								return async::to_promise(std::vector<std::byte>{});
+								return async::to_promise(buffer_chain{});
+							} else if constexpr(is_stream_v<std::remove_cvref_t<decltype(get_result())>>) {
+								async::promise<buffer_chain> done;
+								get_result().subscribe([send_partial](auto value) {
+									send_partial(serialize_chain(value));
+								}, [done]() mutable {
+									done.set(buffer_chain{});
+								});
+								return done;
 							} else {
 								return async::to_promise(get_result()) | [](auto value) {
-									return serialize(std::forward<decltype(value)>(value));
+									return serialize_chain(value);
 								};
 							}
 						}});
@@ -209,7 +234,7 @@ namespace rpc {
 				template<typename Signature> struct announcement {
 					template<typename Getter> inline announcement(const char* method_name, Getter&& getter) {
 						auto method = getter(impl_container{});
-						_reflection.methods.push_back({method_name, stringify_type<std::remove_pointer_t<Signature>>(), [method](void* impl_ptr, const std::vector<std::byte>& args) -> async::promise<std::vector<std::byte>> {
+						_reflection.methods.push_back({method_name, stringify_type<std::remove_pointer_t<Signature>>(), [method](void* impl_ptr, const std::vector<std::byte>& args, std::function<void(buffer_chain)> send_partial) -> async::promise<buffer_chain> {
 							SelfImpl& self_impl = *static_cast<SelfImpl*>(impl_ptr);
 							auto get_result = [&]() -> decltype(auto) {
 								return std::apply([&self_impl, method](auto&&... args) -> decltype(auto) {
@@ -218,10 +243,18 @@ namespace rpc {
 							};
 							if constexpr(std::is_same_v<decltype(get_result()), void>) {
 								get_result();
-								return async::to_promise(std::vector<std::byte>{});
+								return async::to_promise(buffer_chain{});
+							} else if constexpr(is_stream_v<std::remove_cvref_t<decltype(get_result())>>) {
+								async::promise<buffer_chain> done;
+								get_result().subscribe([send_partial](auto value) {
+									send_partial(serialize_chain(value));
+								}, [done]() mutable {
+									done.set(buffer_chain{});
+								});
+								return done;
 							} else {
 								return async::to_promise(get_result()) | [](auto value) {
-									return serialize(std::forward<decltype(value)>(value));
+									return serialize_chain(value);
 								};
 							}
 						}});
@@ -13,6 +13,8 @@
 
 #include <tcb/span.hpp>
 
+#include "buffer.hpp"
+
 
 #define MAP_OUT
 #define EVAL0(...) __VA_ARGS__
@@ -36,7 +38,7 @@
 #define RPC_DESERIALIZE_FIELD(_, field_name) deserialize_to(ptr, end, to.field_name);
 
 #define RPC_DEFINE_SERIALIZE(struct_name, ...) \
-	inline void serialize_to(const struct_name& data, std::vector<std::byte>& to) { \
+	template<typename Out> inline void serialize_to(const struct_name& data, Out& to) { \
 		using rpc::serialize_to; \
 		MAP(RPC_SERIALIZE_FIELD, _, __VA_ARGS__) \
 	} \
@@ -45,63 +47,81 @@
 		MAP(RPC_DESERIALIZE_FIELD, _, __VA_ARGS__) \
 	}
 
+#define RPC_FIELD_TYPE_STRING(struct_name, field_name) ::rpc::type_string<decltype(struct_name::field_name)>::text,
+
+// Serialization plus a type string, so that the struct can be used in RPC_METHOD signatures. Must be used in the global
+// namespace.
+#define RPC_DEFINE_STRUCT(struct_name, ...) \
+	RPC_DEFINE_SERIALIZE(struct_name, __VA_ARGS__) \
+	template<> struct rpc::type_string<struct_name> { \
+		static inline std::string text = #struct_name "{" + ::rpc::join_strings(", ", {MAP(RPC_FIELD_TYPE_STRING, struct_name, __VA_ARGS__)}) + "}"; \
+	};
+
 
 namespace rpc {
-	template<typename T, typename = std::enable_if_t<std::is_integral_v<T>>> void serialize_to(T num, std::vector<std::byte>& to) {
+	template<typename T> inline constexpr bool is_number_v = std::is_integral_v<T> || (std::is_enum_v<T> && !std::is_same_v<T, std::byte>);
+
+
+	template<typename T, typename Out, typename = std::enable_if_t<is_number_v<T>>> void serialize_to(T num, Out& to) {
 		std::byte* begin = reinterpret_cast<std::byte*>(&num);
 		std::byte* end = begin + sizeof(num);
 		if constexpr(std::endian::native == std::endian::little) {
 			std::reverse(begin, end);
 		}
-		to.insert(to.end(), begin, end);
+		write_bytes(to, begin, end);
 	}
 
-	inline void serialize_to(std::byte data, std::vector<std::byte>& to) {
-		to.push_back(data);
+	template<typename Out> void serialize_to(std::byte data, Out& to) {
+		write_bytes(to, data);
 	}
 
-	template<typename T> void serialize_to(const std::vector<T>& data, std::vector<std::byte>& to);
-	template<typename... Types> void serialize_to(const std::variant<Types...>& data, std::vector<std::byte>& to);
-	template<typename... Types> void serialize_to(const std::tuple<Types...>& data, std::vector<std::byte>& to);
-	template<typename First, typename Second> void serialize_to(const std::pair<First, Second>& data, std::vector<std::byte>& to);
-	template<typename T, size_t N> void serialize_to(const std::array<T, N>& data, std::vector<std::byte>& to);
-	template<typename T> void serialize_to(const std::optional<T>& data, std::vector<std::byte>& to);
-	void serialize_to(const std::string& data, std::vector<std::byte>& to);
+	template<typename T, typename Out> void serialize_to(const std::vector<T>& data, Out& to);
+	template<typename... Types, typename Out> void serialize_to(const std::variant<Types...>& data, Out& to);
+	template<typename... Types, typename Out> void serialize_to(const std::tuple<Types...>& data, Out& to);
+	template<typename First, typename Second, typename Out> void serialize_to(const std::pair<First, Second>& data, Out& to);
+	template<typename T, size_t N, typename Out> void serialize_to(const std::array<T, N>& data, Out& to);
+	template<typename T, typename Out> void serialize_to(const std::optional<T>& data, Out& to);
+	template<typename Out> void serialize_to(const std::string& data, Out& to);
+	template<typename Out> void serialize_to(const blob& data, Out& to);
 
-	template<typename T> void serialize_to(const std::vector<T>& data, std::vector<std::byte>& to) {
+	template<typename T, typename Out> void serialize_to(const std::vector<T>& data, Out& to) {
 		serialize_to(static_cast<uint64_t>(data.size()), to);
-		for(const auto& elem: data) {
-			serialize_to(elem, to);
+		if constexpr(std::is_same_v<T, std::byte>) {
+			write_bytes(to, data.data(), data.data() + data.size());
+		} else {
+			for(const auto& elem: data) {
+				serialize_to(elem, to);
+			}
 		}
 	}
 
-	template<typename... Types> void serialize_to(const std::variant<Types...>& data, std::vector<std::byte>& to) {
+	template<typename... Types, typename Out> void serialize_to(const std::variant<Types...>& data, Out& to) {
 		serialize_to(static_cast<uint8_t>(data.index()), to);
 		std::visit([&to](const auto& value) {
 			serialize_to(value, to);
 		}, data);
 	}
 
-	template<typename... Types, size_t... I> void _serialize_tuple_helper(const std::tuple<Types...>& data, std::vector<std::byte>& to, std::index_sequence<I...>) {
+	template<typename... Types, typename Out, size_t... I> void _serialize_tuple_helper(const std::tuple<Types...>& data, Out& to, std::index_sequence<I...>) {
 		(serialize_to(std::get<I>(data), to), ...);
 	}
 
-	template<typename... Types> void serialize_to(const std::tuple<Types...>& data, std::vector<std::byte>& to) {
+	template<typename... Types, typename Out> void serialize_to(const std::tuple<Types...>& data, Out& to) {
 		_serialize_tuple_helper(data, to, std::make_index_sequence<sizeof...(Types)>());
 	}
 
-	template<typename First, typename Second> void serialize_to(const std::pair<First, Second>& data, std::vector<std::byte>& to) {
+	template<typename First, typename Second, typename Out> void serialize_to(const std::pair<First, Second>& data, Out& to) {
 		serialize_to(data.first, to);
 		serialize_to(data.second, to);
 	}
 
-	template<typename T, size_t N> void serialize_to(const std::array<T, N>& data, std::vector<std::byte>& to) {
+	template<typename T, size_t N, typename Out> void serialize_to(const std::array<T, N>& data, Out& to) {
 		for(const auto& elem: data) {
 			serialize_to(elem, to);
 		}
 	}
 
-	template<typename T> void serialize_to(const std::optional<T>& data, std::vector<std::byte>& to) {
+	template<typename T, typename Out> void serialize_to(const std::optional<T>& data, Out& to) {
 		if(data) {
 			serialize_to(true, to);
 			serialize_to(*data, to);
@@ -110,11 +130,16 @@ namespace rpc {
 		}
 	}
 
-	inline void serialize_to(const std::string& data, std::vector<std::byte>& to) {
+	template<typename Out> void serialize_to(const std::string& data, Out& to) {
 		serialize_to(static_cast<uint64_t>(data.size()), to);
-		size_t old_to_size = to.size();
-		to.resize(old_to_size + data.size());
-		std::memcpy(to.data() + old_to_size, data.data(), data.size());
+		const std::byte* begin = reinterpret_cast<const std::byte*>(data.data());
+		write_bytes(to, begin, begin + data.size());
+	}
+
+	// Blobs are wire-compatible with std::vector<std::byte>
+	template<typename Out> void serialize_to(const blob& data, Out& to) {
+		serialize_to(static_cast<uint64_t>(data.size()), to);
+		write_bytes(to, data);
 	}
 
 	template<typename T> std::vector<std::byte> serialize(const T& data) {
@@ -123,9 +148,15 @@ namespace rpc {
 		return to;
 	}
 
+	template<typename T> buffer_chain serialize_chain(const T& data) {
+		buffer_chain to;
+		serialize_to(data, to);
+		return to;
+	}
 
 
-	template<typename T, typename = std::enable_if_t<std::is_integral_v<T>>> void deserialize_to(const std::byte*& ptr, const std::byte* end, T& to) {
+
+	template<typename T, typename = std::enable_if_t<is_number_v<T>>> void deserialize_to(const std::byte*& ptr, const std::byte* end, T& to) {
 		if(static_cast<size_t>(end - ptr) < sizeof(T)) {
 			throw std::invalid_argument("Invalid serialized value (integral type)");
 		}
@@ -152,13 +183,29 @@ namespace rpc {
 	template<typename T, size_t N> void deserialize_to(const std::byte*& ptr, const std::byte* end, std::array<T, N>& to);
 	template<typename T> void deserialize_to(const std::byte*& ptr, const std::byte* end, std::optional<T>& to);
 	void deserialize_to(const std::byte*& ptr, const std::byte* end, std::string& to);
+	void deserialize_to(const std::byte*& ptr, const std::byte* end, blob& to);
 
 	template<typename T> void deserialize_to(const std::byte*& ptr, const std::byte* end, std::vector<T>& to) {
 		uint64_t size;
 		deserialize_to(ptr, end, size);
-		to.resize(size);
-		for(uint64_t i = 0; i < size; i++) {
-			deserialize_to(ptr, end, to[i]);
+		if constexpr(std::is_same_v<T, std::byte>) {
+			if(size > static_cast<size_t>(end - ptr)) {
+				throw std::invalid_argument("Invalid serialized value (std::vector<std::byte>)");
+			}
+			to.assign(ptr, ptr + size);
+			ptr += size;
+		} else if constexpr(std::is_same_v<T, bool>) {
+			to.resize(size);
+			for(uint64_t i = 0; i < size; i++) {
+				bool value;
+				deserialize_to(ptr, end, value);
+				to[i] = value;
+			}
+		} else {
+			to.resize(size);
+			for(uint64_t i = 0; i < size; i++) {
+				deserialize_to(ptr, end, to[i]);
+			}
 		}
 	}
 
@@ -220,6 +267,12 @@ namespace rpc {
 		ptr += size;
 	}
 
+	inline void deserialize_to(const std::byte*& ptr, const std::byte* end, blob& to) {
+		std::vector<std::byte> data;
+		deserialize_to(ptr, end, data);
+		to = blob{std::move(data)};
+	}
+
 	template<typename T> T deserialize(tcb::span<const std::byte> data) {
 		T to;
 		const std::byte* ptr = data.begin();
@@ -264,6 +317,9 @@ namespace rpc {
 	template<typename T> struct type_string<T, std::enable_if_t<std::is_integral_v<T>>> {
 		static inline std::string text = (std::is_unsigned_v<T> ? "uint" : "int") + std::to_string(sizeof(T) * CHAR_BIT) + "_t";
 	};
+	template<typename T> struct type_string<T, std::enable_if_t<is_number_v<T> && !std::is_integral_v<T>>> {
+		static inline std::string text = type_string<std::underlying_type_t<T>>::text;
+	};
 	template<> struct type_string<void> {
 		static inline std::string text = "void";
 	};
@@ -273,6 +329,9 @@ namespace rpc {
 	template<> struct type_string<std::string> {
 		static inline std::string text = "string";
 	};
+	template<> struct type_string<blob> {
+		static inline std::string text = "vector<byte>";
+	};
 	template<typename T> struct type_string<std::vector<T>> {
 		static inline std::string text = "vector<" + type_string<T>::text + ">";
 	};
@@ -26,6 +26,7 @@ namespace rpc {
 
 			std::map<std::string, int32_t> client_ids_of_methods;
 			std::map<size_t, async::promise<std::vector<std::byte>>> promises;
+			std::map<size_t, std::function<void(std::vector<std::byte>)>> partial_handlers;
 			uint64_t next_message_id = 0;
 
 			std::shared_ptr<generic_socket> sock;
@@ -38,7 +39,7 @@ namespace rpc {
 			void on_message(rpc_message&& message);
 			void on_incoming_handshake(tcb::span<const std::byte> span);
 
-			async::promise<std::vector<std::byte>> invoke(const char* method_name, std::vector<std::byte>&& args);
+			async::promise<std::vector<std::byte>> invoke(const char* method_name, std::vector<std::byte>&& args, std::function<void(std::vector<std::byte>)> on_partial);
 
 			void report_handshake_error(const std::string& text);
 			void handle_message(const rpc_message& message);
@@ -52,7 +53,7 @@ namespace rpc {
 
 		public:
 			client_invoker(server_client& client);
-			virtual async::promise<std::vector<std::byte>> invoke(const char* method_name, std::vector<std::byte>&& args);
+			virtual async::promise<std::vector<std::byte>> invoke(const char* method_name, std::vector<std::byte>&& args, std::function<void(std::vector<std::byte>)> on_partial);
 		};
 
 
@@ -29,6 +29,7 @@ namespace rpc {
 		virtual ~generic_socket() = default;
 
 		virtual void write(std::vector<std::byte> data) = 0;
+		virtual void write(blob data) = 0;
 
 		virtual void stop() = 0;
 
@@ -42,14 +43,28 @@ namespace rpc {
 			return _handshake_finished;
 		}
 
-		inline void reply(uint64_t message_id, std::vector<std::byte> response) {
-			rpc_message message;
-			message.message_size = 0;
-			message.method_id = -1;
-			message.message_id = message_id;
-			message.args = std::move(response);
-			message.message_size = serialize(message).size();
-			write(serialize(message));
+		inline void reply(uint64_t message_id, buffer_chain response) {
+			write_response(-1, message_id, std::move(response));
+		}
+
+		// One piece of a streamed response; the stream ends with a regular reply
+		inline void reply_partial(uint64_t message_id, buffer_chain response) {
+			write_response(-3, message_id, std::move(response));
+		}
+
+		inline void write_response(int32_t method_id, uint64_t message_id, buffer_chain response) {
+			// Same wire format as rpc_message, but the payload is never copied into a contiguous buffer
+			std::vector<std::byte> header;
+			serialize_to(static_cast<uint32_t>(4 + 4 + 8 + 8 + response.size()), header);
+			serialize_to(method_id, header);
+			serialize_to(message_id, header);
+			serialize_to(static_cast<uint64_t>(response.size()), header);
+			buffer_chain message;
+			message.append(header.data(), header.data() + header.size());
+			message.append(std::move(response));
+			for(blob& segment: std::move(message).into_segments()) {
+				write(std::move(segment));
+			}
 		}
 
 		inline void report_error(uint64_t message_id, const std::string& text) {
@@ -188,6 +203,17 @@ namespace rpc {
 			handle->write(std::unique_ptr<char[], decltype(deleter)>(reinterpret_cast<char*>(ptr), deleter), size);
 		}
 
+		virtual void write(blob data) {
+			if(!_is_connected) {
+				throw std::runtime_error("Socket not connected");
+			}
+			char* ptr = const_cast<char*>(reinterpret_cast<const char*>(data.data()));
+			size_t size = data.size();
+			auto deleter = [data = std::move(data)](char*) {
+			};
+			handle->write(std::unique_ptr<char[], decltype(deleter)>(ptr, deleter), size);
+		}
+
 
 		virtual void stop() {
 			if(_is_connected) {
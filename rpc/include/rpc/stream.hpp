@@ -0,0 +1,87 @@
+#ifndef RPC_STREAM_HPP
+#define RPC_STREAM_HPP
+
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "common/async.hpp"
+
+#include "serialization.hpp"
+
+
+namespace rpc {
+	// A sequence of values that become available over time. A method returning stream<T> sends each pushed value in its
+	// own partial response frame as soon as it is pushed, and the final response marks the end of the stream. Like
+	// async::promise, a stream is a shared handle: whoever produces the values pushes them and calls finish(), whoever
+	// consumes them subscribes. Values pushed before subscribe() are buffered.
+	template<typename T> class stream {
+		struct state {
+			std::vector<T> buffered;
+			bool is_finished = false;
+			std::function<void(T)> on_value;
+			std::function<void()> on_finish;
+		};
+
+		std::shared_ptr<state> impl;
+
+	public:
+		using value_type = T;
+
+		stream(): impl(std::make_shared<state>()) {
+		}
+
+		void push(T value) {
+			if(impl->on_value) {
+				impl->on_value(std::move(value));
+			} else {
+				impl->buffered.push_back(std::move(value));
+			}
+		}
+
+		void finish() {
+			impl->is_finished = true;
+			if(impl->on_finish) {
+				auto on_finish = std::move(impl->on_finish);
+				impl->on_finish = nullptr;
+				on_finish();
+			}
+		}
+
+		void subscribe(std::function<void(T)> on_value, std::function<void()> on_finish) {
+			for(T& value: impl->buffered) {
+				on_value(std::move(value));
+			}
+			impl->buffered.clear();
+			impl->on_value = std::move(on_value);
+			impl->on_finish = std::move(on_finish);
+			if(impl->is_finished) {
+				finish();
+			}
+		}
+
+		async::promise<std::vector<T>> collect() {
+			async::promise<std::vector<T>> result;
+			auto values = std::make_shared<std::vector<T>>();
+			subscribe([values](T value) {
+				values->push_back(std::move(value));
+			}, [values, result]() mutable {
+				result.set(std::move(*values));
+			});
+			return result;
+		}
+	};
+
+
+	template<typename T> inline constexpr bool is_stream_v = false;
+	template<typename T> inline constexpr bool is_stream_v<stream<T>> = true;
+
+
+	template<typename T> struct type_string<stream<T>> {
+		static inline std::string text = "stream<" + type_string<T>::text + ">";
+	};
+}
+
+
+#endif
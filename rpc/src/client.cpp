@@ -1,5 +1,6 @@
 #include <iostream>
 #include <filesystem>
+#include <iterator>
 
 #include <uvw.hpp>
 
@@ -73,6 +74,13 @@ namespace rpc {
 
 		std::cerr << "Handshake with " << server_text_address << " is now established" << std::endl;
 
+		if(on_connect) {
+			auto queued = std::move(pending_messages);
+			pending_messages.clear();
+			on_connect();
+			pending_messages.insert(pending_messages.end(), std::make_move_iterator(queued.begin()), std::make_move_iterator(queued.end()));
+		}
+
 		for(pending_message& pending: pending_messages) {
 			rpc_message message;
 			message.message_size = 0;
@@ -93,11 +101,21 @@ namespace rpc {
 				std::cerr << "Client failure on " << server_text_address << ": Response to message #" << message.message_id << ": no corresponding request or double response" << std::endl;
 				return;
 			}
+			partial_handlers.erase(message.message_id);
 			promises.extract(it).mapped().set(std::move(message.args));
+		} else if(message.method_id == -3) {
+			auto it = partial_handlers.find(message.message_id);
+			if(it == partial_handlers.end()) {
+				std::cerr << "Client failure on " << server_text_address << ": Partial response to message #" << message.message_id << ": no corresponding streaming request" << std::endl;
+				return;
+			}
+			it->second(std::move(message.args));
 		} else if(message.method_id == -2) {
 			std::cerr << "Client failure on " << server_text_address << ": Message #" << message.message_id << ": " << deserialize<std::string>(message.args) << std::endl;
 		} else if(0 <= message.method_id && message.method_id < client_impl.methods.size()) {
-			client_impl.methods[message.method_id].fn(client_impl_object, message.args) | [sock = sock, message_id = message.message_id](std::vector<std::byte> result) {
+			client_impl.methods[message.method_id].fn(client_impl_object, message.args, [sock = sock, message_id = message.message_id](buffer_chain partial) {
+				sock->reply_partial(message_id, std::move(partial));
+			}) | [sock = sock, message_id = message.message_id](buffer_chain result) {
 				sock->reply(message_id, std::move(result));
 			};
 		} else {
@@ -161,8 +179,16 @@ namespace rpc {
 	}
 
 
-	async::promise<std::vector<std::byte>> generic_client::invoke(const char* method_name, std::vector<std::byte>&& args) {
+	void generic_client::set_connect_handler(std::function<void(void)> handler) {
+		on_connect = std::move(handler);
+	}
+
+
+	async::promise<std::vector<std::byte>> generic_client::invoke(const char* method_name, std::vector<std::byte>&& args, std::function<void(std::vector<std::byte>)> on_partial) {
 		uint64_t message_id = next_message_id++;
+		if(on_partial) {
+			partial_handlers.emplace(message_id, std::move(on_partial));
+		}
 		if(!sock || !sock->handshake_finished()) {
 			pending_messages.push_back({method_name, message_id, std::move(args)});
 		} else {
@@ -98,11 +98,21 @@ namespace rpc {
 				std::cerr << "Error on #" << client_id << ": response to message #" << message.message_id << ": no corresponding request or double response" << std::endl;
 				return;
 			}
+			partial_handlers.erase(message.message_id);
 			promises.extract(it).mapped().set(std::move(message.args));
+		} else if(message.method_id == -3) {
+			auto it = partial_handlers.find(message.message_id);
+			if(it == partial_handlers.end()) {
+				std::cerr << "Error on #" << client_id << ": partial response to message #" << message.message_id << ": no corresponding streaming request" << std::endl;
+				return;
+			}
+			it->second(std::move(message.args));
 		} else if(message.method_id == -2) {
 			std::cerr << "Error on #" << client_id << ": message #" << message.message_id << ": " << deserialize<std::string>(message.args) << std::endl;
 		} else if(0 <= message.method_id && message.method_id < server.server_impl.methods.size()) {
-			server.server_impl.methods[message.method_id].fn(server_impl_object, message.args) | [sock = sock, message_id = message.message_id](std::vector<std::byte> result) {
+			server.server_impl.methods[message.method_id].fn(server_impl_object, message.args, [sock = sock, message_id = message.message_id](buffer_chain partial) {
+				sock->reply_partial(message_id, std::move(partial));
+			}) | [sock = sock, message_id = message.message_id](buffer_chain result) {
 				sock->reply(message_id, std::move(result));
 			};
 		} else {
@@ -111,8 +121,11 @@ namespace rpc {
 	}
 
 
-	async::promise<std::vector<std::byte>> generic_server::server_client::invoke(const char* method_name, std::vector<std::byte>&& args) {
+	async::promise<std::vector<std::byte>> generic_server::server_client::invoke(const char* method_name, std::vector<std::byte>&& args, std::function<void(std::vector<std::byte>)> on_partial) {
 		uint64_t message_id = next_message_id++;
+		if(on_partial) {
+			partial_handlers.emplace(message_id, std::move(on_partial));
+		}
 		sock->invoke(client_ids_of_methods.at(method_name), message_id, std::move(args));
 		async::promise<std::vector<std::byte>> prom;
 		promises.emplace(message_id, prom);
@@ -124,8 +137,8 @@ namespace rpc {
 	generic_server::client_invoker::client_invoker(server_client& client): client(client) {
 	}
 
-	async::promise<std::vector<std::byte>> generic_server::client_invoker::invoke(const char* method_name, std::vector<std::byte>&& args) {
-		return client.invoke(method_name, std::move(args));
+	async::promise<std::vector<std::byte>> generic_server::client_invoker::invoke(const char* method_name, std::vector<std::byte>&& args, std::function<void(std::vector<std::byte>)> on_partial) {
+		return client.invoke(method_name, std::move(args), std::move(on_partial));
 	}
 
 
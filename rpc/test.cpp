@@ -1,3 +1,4 @@
+#include <chrono>
 #include <iostream>
 
 #include <uvw.hpp>
@@ -10,6 +11,7 @@ RPC_PROTOCOL(echo_protocol,
 	std::string RPC_METHOD(say_hello_world_v1)();
 	std::string RPC_METHOD(echo_v1)(std::string text);
 	void RPC_METHOD(request_something_from_me)(int32_t n);
+	rpc::stream<std::string> RPC_METHOD(count_down)(int32_t n);
 )
 
 RPC_PROTOCOL(reverse_echo_protocol,
@@ -28,6 +30,22 @@ public:
 	void request_something_from_me(int32_t n) {
 		peer.say_good_bye(std::to_string(n) + "th human on the Earth") | [](std::string text) { std::cout << text << std::endl; };
 	}
+	// One value every 100 ms, so that each goes out in its own partial frame while the call is still open
+	rpc::stream<std::string> count_down(int32_t n) {
+		rpc::stream<std::string> values;
+		auto timer = uvw::Loop::getDefault()->resource<uvw::TimerHandle>();
+		timer->on<uvw::TimerEvent>([values, n](const uvw::TimerEvent&, uvw::TimerHandle& timer) mutable {
+			if(n == 0) {
+				values.finish();
+				timer.stop();
+				timer.close();
+				return;
+			}
+			values.push(std::to_string(n--) + "...");
+		});
+		timer->start(std::chrono::milliseconds{0}, std::chrono::milliseconds{100});
+		return values;
+	}
 };
 
 class reverse_echo_impl: public rpc::duplex_impl<reverse_echo_impl, reverse_echo_protocol, echo_protocol> {
@@ -49,8 +67,10 @@ int main() {
 
 	rpc::client<echo_protocol, reverse_echo_impl> client("./rpc.sock");
 
+	client.set_connect_handler([]() { std::cout << "Connected" << std::endl; });
 	client->say_hello_world_v1() | [](std::string text) { std::cout << text << std::endl; };
 	client->request_something_from_me(28);
+	client->count_down(3).subscribe([](std::string text) { std::cout << text << std::endl; }, []() { std::cout << "Liftoff!" << std::endl; });
 
 	std::vector<std::shared_ptr<uvw::SignalHandle>> signals;
 	for(int signum: {SIGINT, SIGHUP, SIGTERM}) {